@@ -0,0 +1,110 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file background_worker.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A background worker class.
+ */
+
+#ifndef FSCP_BACKGROUND_WORKER_HPP
+#define FSCP_BACKGROUND_WORKER_HPP
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <deque>
+
+namespace fscp
+{
+	/**
+	 * \brief A background worker class.
+	 *
+	 * The tasks are run in order, on a thread that is started with the first task.
+	 */
+	class background_worker : public boost::noncopyable
+	{
+		public:
+
+			/**
+			 * \brief The task type.
+			 */
+			typedef boost::function<void ()> task_type;
+
+			/**
+			 * \brief Create a background worker.
+			 */
+			background_worker();
+
+			/**
+			 * \brief Create a background worker pinned to a CPU.
+			 * \param cpu The index of the CPU. If the thread cannot be pinned, it runs on any CPU.
+			 */
+			explicit background_worker(unsigned int cpu);
+
+			/**
+			 * \brief Destroy the background worker.
+			 *
+			 * The current task is completed, the pending ones are discarded.
+			 */
+			~background_worker();
+
+			/**
+			 * \brief Queue a task.
+			 * \param task The task. It must not throw.
+			 */
+			void post(task_type task);
+
+		private:
+
+			void run();
+
+			boost::mutex m_mutex;
+			boost::condition_variable m_condition;
+			std::deque<task_type> m_tasks;
+			bool m_stopping;
+			boost::optional<unsigned int> m_cpu;
+			boost::scoped_ptr<boost::thread> m_thread;
+	};
+}
+
+#endif /* FSCP_BACKGROUND_WORKER_HPP */
@@ -0,0 +1,186 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file callback_queue.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A bounded queue of callbacks, run by an executor.
+ */
+
+#ifndef FSCP_CALLBACK_QUEUE_HPP
+#define FSCP_CALLBACK_QUEUE_HPP
+
+#include "constants.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+#include <utility>
+
+namespace fscp
+{
+	/**
+	 * \brief A bounded queue of callbacks, run by an executor.
+	 *
+	 * The callbacks are run in order, one at a time, by tasks handed to the executor. Only the data callbacks count against the capacity of the queue: the other callbacks are rare, and always queued.
+ *
+ * If a callback throws anyway, the exception goes through the executor: the remaining callbacks are handed to the executor again in a new task first.
+	 *
+	 * Instances must be owned by a boost::shared_ptr: the tasks handed to the executor keep the queue alive.
+	 */
+	class callback_queue : public boost::noncopyable, public boost::enable_shared_from_this<callback_queue>
+	{
+		public:
+
+			/**
+			 * \brief The task type.
+			 */
+			typedef boost::function<void ()> task_type;
+
+			/**
+			 * \brief The executor type.
+			 *
+			 * An executor must run the tasks it is given, on any thread, at some point.
+			 */
+			typedef boost::function<void (task_type)> executor_type;
+
+			/**
+			 * \brief The key type of the data callbacks.
+			 */
+			typedef std::pair<boost::asio::ip::udp::endpoint, channel_number_type> key_type;
+
+			/**
+			 * \brief What to do with a data callback when the queue is full.
+			 */
+			enum overflow_policy
+			{
+				OVERFLOW_DROP, /**< \brief Drop the new callback. */
+				OVERFLOW_BLOCK, /**< \brief Queue the new callback anyway, and tell the caller to stop producing until the room handler is called. */
+				OVERFLOW_COALESCE /**< \brief Replace the last queued callback with the same key, or drop the new callback if there is none. */
+			};
+
+			/**
+			 * \brief Create a callback queue.
+			 * \param executor The executor.
+			 * \param capacity The count of data callbacks that may be queued.
+			 * \param policy The overflow policy.
+			 * \param room_handler With OVERFLOW_BLOCK, called by the executor once the queue is no longer full. It must not throw.
+			 */
+			callback_queue(executor_type executor, size_t capacity, overflow_policy policy, task_type room_handler = task_type());
+
+			/**
+			 * \brief Queue a callback.
+			 * \param task The callback. It must not throw.
+			 */
+			void post(task_type task);
+
+			/**
+			 * \brief Queue a data callback.
+			 * \param task The callback. It must not throw.
+			 * \param key The key of the callback, for OVERFLOW_COALESCE.
+			 * \return false if the queue is full and the policy is OVERFLOW_BLOCK: the caller should stop producing until the room handler is called.
+			 *
+			 * This call never waits: with OVERFLOW_BLOCK, the callbacks posted while the queue is full are still queued.
+			 */
+			bool post(task_type task, const key_type& key);
+
+			/**
+			 * \brief Get the count of data callbacks dropped because the queue was full.
+			 * \return The count of data callbacks.
+			 */
+			size_t dropped_count() const;
+
+			/**
+			 * \brief Get the count of data callbacks replaced by newer ones because the queue was full.
+			 * \return The count of data callbacks.
+			 */
+			size_t coalesced_count() const;
+
+			/**
+			 * \brief Get the count of data callbacks queued while the queue was full, with OVERFLOW_BLOCK.
+			 * \return The count of data callbacks.
+			 */
+			size_t blocked_count() const;
+
+			/**
+			 * \brief Detach the room handler.
+			 *
+			 * Once this method returns, the room handler is never called again, even by the tasks still pending on the executor. The owner of the room handler must call it before going away.
+			 */
+			void detach_room_handler();
+
+		private:
+
+			struct entry
+			{
+				entry(task_type _task, bool _bounded, const key_type& _key) :
+					task(_task),
+					bounded(_bounded),
+					key(_key)
+				{
+				}
+
+				task_type task;
+				bool bounded;
+				key_type key;
+			};
+
+			bool push(const entry&);
+			void run();
+			void call_room_handler();
+
+			executor_type m_executor;
+			size_t m_capacity;
+			overflow_policy m_policy;
+			task_type m_room_handler;
+			boost::mutex m_room_handler_mutex;
+			mutable boost::mutex m_mutex;
+			std::deque<entry> m_entries;
+			size_t m_bounded_count;
+			bool m_running;
+			bool m_full;
+			size_t m_dropped_count;
+			size_t m_coalesced_count;
+			size_t m_blocked_count;
+	};
+}
+
+#endif /* FSCP_CALLBACK_QUEUE_HPP */
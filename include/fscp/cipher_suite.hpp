@@ -0,0 +1,103 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+
+/**
+ * \file cipher_suite.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief The cipher suites.
+ */
+
+#ifndef FSCP_CIPHER_SUITE_HPP
+#define FSCP_CIPHER_SUITE_HPP
+
+#include <openssl/obj_mac.h>
+
+#include <cstddef>
+
+namespace fscp
+{
+	/**
+	 * \brief The AES-256-CBC and HMAC-SHA256 cipher suite traits.
+	 *
+	 * A cipher suite traits type gives the algorithms of a suite and their sizes as compile-time constants, so that the data path can be specialized for it.
+	 */
+	struct aes256_cbc_hmac_sha256_suite
+	{
+		/**
+		 * \brief The cipher algorithm.
+		 */
+		static const int cipher_algorithm = NID_aes_256_cbc;
+
+		/**
+		 * \brief The cipher algorithm used to generate initialization vectors.
+		 */
+		static const int iv_cipher_algorithm = NID_aes_256_cbc;
+
+		/**
+		 * \brief The message digest algorithm.
+		 */
+		static const int message_digest_algorithm = NID_sha256;
+
+		/**
+		 * \brief The cipher block size.
+		 */
+		static const size_t block_size = 16;
+
+		/**
+		 * \brief The initialization vector length.
+		 */
+		static const size_t iv_length = 16;
+
+		/**
+		 * \brief The message digest size.
+		 */
+		static const size_t digest_size = 32;
+
+		/**
+		 * \brief The size of the HMAC sent in messages: the digest is cut in half.
+		 */
+		static const size_t hmac_size = digest_size / 2;
+	};
+
+	/**
+	 * \brief The cipher suite used by the current protocol version.
+	 */
+	typedef aes256_cbc_hmac_sha256_suite default_cipher_suite;
+}
+
+#endif /* FSCP_CIPHER_SUITE_HPP */
@@ -79,9 +79,11 @@ namespace fscp
 			 * \param seal_key_len The seal key length.
 			 * \param enc_key The encryption key.
 			 * \param enc_key_len The encryption key length.
+			 * \param authenticated_channels The channels on which the sender accepts authenticated-only data.
+			 * \param session_flags The session flags the sender enabled.
 			 * \return The count of bytes written.
 			 */
-			static size_t write(void* buf, size_t buf_len, session_number_type session_number, const challenge_type& challenge, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+			static size_t write(void* buf, size_t buf_len, session_number_type session_number, const challenge_type& challenge, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len, channel_mask_type authenticated_channels = 0, session_flags_type session_flags = 0);
 
 			/**
 			 * \brief Write a session message to a buffer.
@@ -91,10 +93,12 @@ namespace fscp
 			 * \param seal_key_len The seal key length.
 			 * \param enc_key The encryption key.
 			 * \param enc_key_len The encryption key length.
+			 * \param authenticated_channels The channels on which the sender accepts authenticated-only data.
+			 * \param session_flags The session flags the sender enabled.
 			 * \return The buffer.
 			 */
 			template <typename T>
-			static std::vector<T> write(session_number_type session_number, const challenge_type& challenge, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+			static std::vector<T> write(session_number_type session_number, const challenge_type& challenge, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len, channel_mask_type authenticated_channels = 0, session_flags_type session_flags = 0);
 
 			/**
 			 * \brief Create a clear_session_message and map it on a buffer.
@@ -141,6 +145,18 @@ namespace fscp
 			 */
 			size_t encryption_key_size() const;
 
+			/**
+			 * \brief Get the channels on which the sender accepts authenticated-only data.
+			 * \return The channel mask. Messages from older peers don't carry it: it is 0 then.
+			 */
+			channel_mask_type authenticated_channels() const;
+
+			/**
+			 * \brief Get the session flags the sender enabled.
+			 * \return The session flags. Messages from older peers don't carry them: they are 0 then.
+			 */
+			session_flags_type session_flags() const;
+
 		protected:
 
 			/**
@@ -148,6 +164,26 @@ namespace fscp
 			 */
 			static const size_t BODY_LENGTH = sizeof(session_number_type) + challenge_type::static_size + 2 * KEY_LENGTH + 2 * sizeof(uint16_t);
 
+			/**
+			 * \brief The value that starts the optional fields that follow the body.
+			 *
+			 * Older peers ignore anything past BODY_LENGTH, but may also send trailing garbage there: the magic value tells the two apart.
+			 */
+			static const uint32_t EXTENSION_MAGIC = 0x46534345;
+
+			/**
+			 * \brief The length of the optional fields that follow the body, including the magic value.
+			 *
+			 * The session flags came last: peers that only know about the authenticated channels send a shorter extension.
+			 */
+			static const size_t EXTENSION_LENGTH = sizeof(uint32_t) + sizeof(channel_mask_type) + sizeof(session_flags_type);
+
+			/**
+			 * \brief Check if the optional fields are present.
+			 * \return true if the optional fields are present.
+			 */
+			bool has_extension() const;
+
 			/**
 			 * \brief The data.
 			 * \return The data buffer.
@@ -157,14 +193,15 @@ namespace fscp
 		private:
 
 			const void* m_data;
+			size_t m_data_len;
 	};
 
 	template <typename T>
-	inline std::vector<T> clear_session_message::write(session_number_type _session_number, const challenge_type& _challenge, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+	inline std::vector<T> clear_session_message::write(session_number_type _session_number, const challenge_type& _challenge, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len, channel_mask_type _authenticated_channels, session_flags_type _session_flags)
 	{
-		std::vector<T> result(BODY_LENGTH);
+		std::vector<T> result(BODY_LENGTH + EXTENSION_LENGTH);
 
-		result.resize(write(&result[0], result.size(), _session_number, _challenge, seal_key, seal_key_len, enc_key, enc_key_len));
+		result.resize(write(&result[0], result.size(), _session_number, _challenge, seal_key, seal_key_len, enc_key, enc_key_len, _authenticated_channels, _session_flags));
 
 		return result;
 	}
@@ -203,6 +240,31 @@ namespace fscp
 		return ntohs(buffer_tools::get<uint16_t>(data(), sizeof(session_number_type) + challenge_type::static_size + sizeof(uint16_t) + seal_key_size()));
 	}
 
+	inline channel_mask_type clear_session_message::authenticated_channels() const
+	{
+		if (!has_extension())
+		{
+			return 0;
+		}
+
+		return ntohs(buffer_tools::get<channel_mask_type>(data(), BODY_LENGTH + sizeof(uint32_t)));
+	}
+
+	inline session_flags_type clear_session_message::session_flags() const
+	{
+		if (!has_extension() || (m_data_len < BODY_LENGTH + EXTENSION_LENGTH))
+		{
+			return 0;
+		}
+
+		return ntohs(buffer_tools::get<session_flags_type>(data(), BODY_LENGTH + sizeof(uint32_t) + sizeof(channel_mask_type)));
+	}
+
+	inline bool clear_session_message::has_extension() const
+	{
+		return (m_data_len >= BODY_LENGTH + sizeof(uint32_t) + sizeof(channel_mask_type)) && (ntohl(buffer_tools::get<uint32_t>(data(), BODY_LENGTH)) == EXTENSION_MAGIC);
+	}
+
 	inline const uint8_t* clear_session_message::data() const
 	{
 		return static_cast<const uint8_t*>(m_data);
@@ -68,18 +68,20 @@ namespace fscp
 			 * \param buf_len The length of buf.
 			 * \param session_number The session number.
 			 * \param challenge The challenge.
+			 * \param session_flags The session flags the sender asks for.
 			 * \return The count of bytes written.
 			 */
-			static size_t write(void* buf, size_t buf_len, session_number_type session_number, const challenge_type& challenge);
+			static size_t write(void* buf, size_t buf_len, session_number_type session_number, const challenge_type& challenge, session_flags_type session_flags = 0);
 
 			/**
 			 * \brief Write a session request message to a buffer.
 			 * \param session_number The session number.
 			 * \param challenge The challenge.
+			 * \param session_flags The session flags the sender asks for.
 			 * \return The buffer.
 			 */
 			template <typename T>
-			static std::vector<T> write(session_number_type session_number, const challenge_type& challenge);
+			static std::vector<T> write(session_number_type session_number, const challenge_type& challenge, session_flags_type session_flags = 0);
 
 			/**
 			 * \brief Create a clear_session_request_message and map it on a buffer.
@@ -102,6 +104,12 @@ namespace fscp
 			 */
 			challenge_type challenge() const;
 
+			/**
+			 * \brief Get the session flags the sender asks for.
+			 * \return The session flags. Messages from older peers don't carry them: they are 0 then.
+			 */
+			session_flags_type session_flags() const;
+
 		protected:
 
 			/**
@@ -109,6 +117,22 @@ namespace fscp
 			 */
 			static const size_t BODY_LENGTH = sizeof(session_number_type) + challenge_type::static_size;
 
+			/**
+			 * \brief The value that starts the optional fields that follow the body.
+			 */
+			static const uint32_t EXTENSION_MAGIC = 0x46534345;
+
+			/**
+			 * \brief The length of the optional fields that follow the body, including the magic value.
+			 */
+			static const size_t EXTENSION_LENGTH = sizeof(uint32_t) + sizeof(session_flags_type);
+
+			/**
+			 * \brief Check if the optional fields are present.
+			 * \return true if the optional fields are present.
+			 */
+			bool has_extension() const;
+
 			/**
 			 * \brief The data.
 			 * \return The data buffer.
@@ -118,14 +142,15 @@ namespace fscp
 		private:
 
 			const void* m_data;
+			size_t m_data_len;
 	};
 
 	template <typename T>
-	inline std::vector<T> clear_session_request_message::write(session_number_type _session_number, const challenge_type& _challenge)
+	inline std::vector<T> clear_session_request_message::write(session_number_type _session_number, const challenge_type& _challenge, session_flags_type _session_flags)
 	{
-		std::vector<T> result(BODY_LENGTH);
+		std::vector<T> result(BODY_LENGTH + EXTENSION_LENGTH);
 
-		result.resize(write(&result[0], result.size(), _session_number, _challenge));
+		result.resize(write(&result[0], result.size(), _session_number, _challenge, _session_flags));
 
 		return result;
 	}
@@ -144,6 +169,21 @@ namespace fscp
 		return result;
 	}
 
+	inline session_flags_type clear_session_request_message::session_flags() const
+	{
+		if (!has_extension())
+		{
+			return 0;
+		}
+
+		return ntohs(buffer_tools::get<session_flags_type>(data(), BODY_LENGTH + sizeof(uint32_t)));
+	}
+
+	inline bool clear_session_request_message::has_extension() const
+	{
+		return (m_data_len >= BODY_LENGTH + EXTENSION_LENGTH) && (ntohl(buffer_tools::get<uint32_t>(data(), BODY_LENGTH)) == EXTENSION_MAGIC);
+	}
+
 	inline const uint8_t* clear_session_request_message::data() const
 	{
 		return static_cast<const uint8_t*>(m_data);
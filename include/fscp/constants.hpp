@@ -47,6 +47,8 @@
 
 #include <boost/asio.hpp>
 
+#include "cipher_suite.hpp"
+
 #include <cryptoplus/cipher/cipher_algorithm.hpp>
 #include <cryptoplus/hash/message_digest_algorithm.hpp>
 #include <cryptoplus/x509/certificate.hpp>
@@ -90,6 +92,23 @@ namespace fscp
 	 */
 	typedef uint32_t sequence_number_type;
 
+	/**
+	 * \brief The extended sequence number type.
+	 *
+	 * Only the low 32 bits of an extended sequence number are sent: the receiver reconstructs the high bits.
+	 */
+	typedef uint64_t extended_sequence_number_type;
+
+	/**
+	 * \brief The session flags type.
+	 */
+	typedef uint16_t session_flags_type;
+
+	/**
+	 * \brief The session flag that enables the extended sequence numbers.
+	 */
+	const session_flags_type SESSION_FLAG_EXTENDED_SEQUENCE_NUMBERS = 0x0001;
+
 	/**
 	 * \brief The current protocol version.
 	 */
@@ -105,6 +124,26 @@ namespace fscp
 		MESSAGE_TYPE_PRESENTATION = 0x02,
 		MESSAGE_TYPE_SESSION_REQUEST = 0x03,
 		MESSAGE_TYPE_SESSION = 0x04,
+		MESSAGE_TYPE_ECDHE_SESSION_REQUEST = 0x05,
+		MESSAGE_TYPE_ECDHE_SESSION = 0x06,
+		MESSAGE_TYPE_RESUME_SESSION_REQUEST = 0x07,
+		MESSAGE_TYPE_RESUME_SESSION = 0x08,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_0 = 0x60,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_1 = 0x61,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_2 = 0x62,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_3 = 0x63,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_4 = 0x64,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_5 = 0x65,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_6 = 0x66,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_7 = 0x67,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_8 = 0x68,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_9 = 0x69,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_10 = 0x6A,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_11 = 0x6B,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_12 = 0x6C,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_13 = 0x6D,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_14 = 0x6E,
+		MESSAGE_TYPE_AUTHENTICATED_DATA_15 = 0x6F,
 		MESSAGE_TYPE_DATA_0 = 0x70,
 		MESSAGE_TYPE_DATA_1 = 0x71,
 		MESSAGE_TYPE_DATA_2 = 0x72,
@@ -149,6 +188,13 @@ namespace fscp
 		CHANNEL_NUMBER_15 = 15
 	};
 
+	/**
+	 * \brief A set of channels, as a bit mask.
+	 *
+	 * The bit n is set if the channel number n belongs to the set.
+	 */
+	typedef uint16_t channel_mask_type;
+
 	/**
 	 * \brief The endpoint type type.
 	 */
@@ -161,17 +207,17 @@ namespace fscp
 	/**
 	 * \brief The cipher algorithm.
 	 */
-	const int CIPHER_ALGORITHM = NID_aes_256_cbc;
+	const int CIPHER_ALGORITHM = default_cipher_suite::cipher_algorithm;
 
 	/**
 	 * \brief The cipher algorithm used to generate initialization vectors.
 	 */
-	const int IV_CIPHER_ALGORITHM = NID_aes_256_cbc;
+	const int IV_CIPHER_ALGORITHM = default_cipher_suite::iv_cipher_algorithm;
 
 	/**
 	 * \brief The message digest algorithm.
 	 */
-	const int MESSAGE_DIGEST_ALGORITHM = NID_sha256;
+	const int MESSAGE_DIGEST_ALGORITHM = default_cipher_suite::message_digest_algorithm;
 
 	/**
 	 * \brief The certificate digest algorithm.
@@ -188,6 +234,46 @@ namespace fscp
 	 */
 	const boost::posix_time::time_duration SESSION_TIMEOUT = SESSION_KEEP_ALIVE_PERIOD * 3;
 
+	/**
+	 * \brief How long the data messages of the previous session are still accepted after a renewal.
+	 */
+	const boost::posix_time::time_duration SESSION_GRACE_PERIOD = boost::posix_time::seconds(5);
+
+	/**
+	 * \brief The lifespan of a session that uses extended sequence numbers.
+	 */
+	const boost::posix_time::time_duration EXTENDED_SESSION_LIFESPAN = boost::posix_time::hours(1);
+
+	/**
+	 * \brief The default count of sequence numbers, below the highest one received, that may still be accepted once.
+	 */
+	const size_t DEFAULT_REPLAY_WINDOW_SIZE = 64;
+
+	/**
+	 * \brief The default count of incoming handshake messages that may wait for a handshake worker.
+	 */
+	const size_t DEFAULT_HANDSHAKE_QUEUE_SIZE = 64;
+
+	/**
+	 * \brief The default count of incoming data messages that may be in the receive pipeline.
+	 */
+	const size_t DEFAULT_RECEIVE_QUEUE_SIZE = 1024;
+
+	/**
+	 * \brief The default count of data message callbacks that may wait for the callback executor.
+	 */
+	const size_t DEFAULT_CALLBACK_QUEUE_SIZE = 1024;
+
+	/**
+	 * \brief The default time an asynchronous callback has to answer, before its message is ignored.
+	 */
+	const boost::posix_time::time_duration DEFAULT_DECISION_TIMEOUT = boost::posix_time::seconds(10);
+
+	/**
+	 * \brief The default count of incoming messages that may wait for the answer of an asynchronous callback.
+	 */
+	const size_t DEFAULT_DECISION_QUEUE_SIZE = 64;
+
 	/**
 	 * \brief Check if a message type is a DATA type message.
 	 * \param type The message type.
@@ -199,8 +285,28 @@ namespace fscp
 	}
 
 	/**
-	 * \brief Convert a DATA message type to a channel number.
-	 * \param type The message type. Must be one from MESSAGE_TYPE_DATA_0 to MESSAGE_TYPE_DATA_15.
+	 * \brief Check if a message type is an AUTHENTICATED_DATA type message.
+	 * \param type The message type.
+	 * \return true if the message type is one from MESSAGE_TYPE_AUTHENTICATED_DATA_0 to MESSAGE_TYPE_AUTHENTICATED_DATA_15.
+	 */
+	inline bool is_authenticated_data_message_type(message_type type)
+	{
+		return (type >= MESSAGE_TYPE_AUTHENTICATED_DATA_0) && (type <= MESSAGE_TYPE_AUTHENTICATED_DATA_15);
+	}
+
+	/**
+	 * \brief Get the mask of a channel number.
+	 * \param channel_number The channel number.
+	 * \return The channel mask that only contains channel_number.
+	 */
+	inline channel_mask_type to_channel_mask(channel_number_type channel_number)
+	{
+		return static_cast<channel_mask_type>(1 << static_cast<unsigned int>(channel_number));
+	}
+
+	/**
+	 * \brief Convert a DATA or AUTHENTICATED_DATA message type to a channel number.
+	 * \param type The message type. Must be one from MESSAGE_TYPE_DATA_0 to MESSAGE_TYPE_DATA_15 or from MESSAGE_TYPE_AUTHENTICATED_DATA_0 to MESSAGE_TYPE_AUTHENTICATED_DATA_15.
 	 * \return The channel number.
 	 */
 	channel_number_type to_channel_number(message_type type);
@@ -212,6 +318,13 @@ namespace fscp
 	 */
 	message_type to_data_message_type(channel_number_type channel_number);
 
+	/**
+	 * \brief Convert a channel number to an AUTHENTICATED_DATA message type.
+	 * \param channel_number The channel number.
+	 * \return The AUTHENTICATED_DATA message type.
+	 */
+	message_type to_authenticated_data_message_type(channel_number_type channel_number);
+
 	/**
 	 * \brief Gives a hash for a certificate.
 	 * \param buf The output buffer.
@@ -0,0 +1,120 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+
+/**
+ * \file context_pool.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A pool of reusable contexts.
+ */
+
+#ifndef FSCP_CONTEXT_POOL_HPP
+#define FSCP_CONTEXT_POOL_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <vector>
+
+namespace fscp
+{
+	/**
+	 * \brief A pool of contexts that are expensive to create.
+	 *
+	 * A thread takes a context, uses it alone, then gives it back for the next user. The pool only grows to the count of contexts used at the same time and never shrinks: once it has grown, taking and giving back contexts does not allocate.
+	 *
+	 * Context can be an incomplete type.
+	 */
+	template <typename Context>
+	class context_pool : public boost::noncopyable
+	{
+		public:
+
+			/**
+			 * \brief The context pointer type.
+			 */
+			typedef boost::shared_ptr<Context> context_ptr;
+
+			/**
+			 * \brief Take a context from the pool.
+			 * \return A context, or a null pointer if the pool is empty.
+			 *
+			 * This method can be called from any thread.
+			 */
+			context_ptr take();
+
+			/**
+			 * \brief Give a context to the pool.
+			 * \param context The context. It can either come from take() or be a new one.
+			 *
+			 * This method can be called from any thread.
+			 */
+			void give_back(const context_ptr& context);
+
+		private:
+
+			boost::mutex m_mutex;
+			std::vector<context_ptr> m_contexts;
+	};
+
+	template <typename Context>
+	inline typename context_pool<Context>::context_ptr context_pool<Context>::take()
+	{
+		context_ptr result;
+
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		if (!m_contexts.empty())
+		{
+			result.swap(m_contexts.back());
+			m_contexts.pop_back();
+		}
+
+		return result;
+	}
+
+	template <typename Context>
+	inline void context_pool<Context>::give_back(const context_ptr& context)
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		m_contexts.push_back(context);
+	}
+}
+
+#endif /* FSCP_CONTEXT_POOL_HPP */
@@ -0,0 +1,205 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file crypto_scheduler.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A pool of threads that several servers share for their cryptographic work.
+ */
+
+#ifndef FSCP_CRYPTO_SCHEDULER_HPP
+#define FSCP_CRYPTO_SCHEDULER_HPP
+
+#include <boost/array.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace fscp
+{
+	/**
+	 * \brief A pool of threads that several servers share for their cryptographic work.
+	 *
+	 * Each thread has its own queue, which the tasks are spread over. A thread whose queue is empty steals from the others, so that idle threads pick up the backlog of a busy server.
+	 *
+	 * In a queue, the clients are served in turn, so that a busy server cannot starve the others. The handshake tasks of all the clients, in any queue, come before their data tasks: a thread steals a handshake task from another queue rather than running a data task of its own.
+	 */
+	class crypto_scheduler : public boost::noncopyable
+	{
+		public:
+
+			/**
+			 * \brief The task type.
+			 */
+			typedef boost::function<void ()> task_type;
+
+			/**
+			 * \brief The priority of a task.
+			 */
+			enum priority_type
+			{
+				PRIORITY_HANDSHAKE = 0, /**< \brief A handshake task: run before any data task. */
+				PRIORITY_DATA = 1 /**< \brief A data task. */
+			};
+
+			/**
+			 * \brief A client of the scheduler.
+			 *
+			 * Destroying a client discards its pending tasks, and waits for its running ones to complete.
+			 */
+			class client : public boost::noncopyable
+			{
+				public:
+
+					/**
+					 * \brief Register a client.
+					 * \param scheduler The scheduler. Cannot be null.
+					 */
+					explicit client(boost::shared_ptr<crypto_scheduler> scheduler);
+
+					/**
+					 * \brief Unregister the client.
+					 */
+					~client();
+
+					/**
+					 * \brief Queue a task.
+					 * \param priority The priority of the task.
+					 * \param task The task. It must not throw.
+					 *
+					 * The tasks may run in any order, on any thread.
+					 */
+					void post(priority_type priority, task_type task);
+
+					/**
+					 * \brief Get the count of threads of the scheduler.
+					 * \return The count of threads.
+					 */
+					size_t thread_count() const;
+
+				private:
+
+					boost::shared_ptr<crypto_scheduler> m_scheduler;
+					size_t m_id;
+			};
+
+			/**
+			 * \brief Create a scheduler.
+			 * \param thread_count The count of threads. Cannot be 0.
+			 */
+			explicit crypto_scheduler(size_t thread_count);
+
+			/**
+			 * \brief Create a scheduler whose threads are pinned to CPUs.
+			 * \param cpus The CPUs: one thread is started per entry, and pinned to it. Cannot be empty.
+			 */
+			explicit crypto_scheduler(const std::vector<unsigned int>& cpus);
+
+			/**
+			 * \brief Destroy the scheduler.
+			 *
+			 * The running tasks are completed, the pending ones are discarded.
+			 */
+			~crypto_scheduler();
+
+			/**
+			 * \brief Get the count of threads.
+			 * \return The count of threads.
+			 */
+			size_t thread_count() const;
+
+		private:
+
+			typedef std::map<size_t, boost::array<std::deque<task_type>, 2> > client_task_map;
+
+			/**
+			 * \brief The queue of a thread.
+			 */
+			struct queue
+			{
+				boost::mutex mutex;
+				client_task_map client_tasks;
+
+				/**
+				 * \brief The clients that have tasks in the queue, in the order they are served.
+				 */
+				std::deque<size_t> clients;
+			};
+
+			void start(size_t);
+			size_t add_client();
+			void remove_client(size_t);
+			void post(size_t, priority_type, task_type);
+			bool take(size_t, size_t&, task_type&);
+			bool take_from(queue&, priority_type, size_t&, task_type&);
+			void run(size_t);
+
+			std::vector<boost::shared_ptr<queue> > m_queues;
+			std::vector<unsigned int> m_cpus;
+			boost::thread_group m_threads;
+			boost::atomic<size_t> m_next_queue;
+
+			boost::mutex m_mutex;
+			boost::condition_variable m_condition;
+			boost::condition_variable m_idle_condition;
+			size_t m_pending_count;
+			boost::atomic<size_t> m_pending_handshake_count;
+			std::map<size_t, size_t> m_running_counts;
+			size_t m_next_client_id;
+			bool m_stopping;
+	};
+
+	inline size_t crypto_scheduler::thread_count() const
+	{
+		return m_queues.size();
+	}
+
+	inline size_t crypto_scheduler::client::thread_count() const
+	{
+		return m_scheduler->thread_count();
+	}
+}
+
+#endif /* FSCP_CRYPTO_SCHEDULER_HPP */
@@ -48,11 +48,14 @@
 #include "message.hpp"
 
 #include "constants.hpp"
+#include "data_path.hpp"
 
 #include <cryptoplus/pkey/pkey.hpp>
 
 namespace fscp
 {
+	class session_keys;
+
 	/**
 	 * \brief A data message class.
 	 */
@@ -60,6 +63,59 @@ namespace fscp
 	{
 		public:
 
+			/**
+			 * \brief The recommended maximum count of messages in a batch.
+			 */
+			static const size_t MAX_BATCH_SIZE = 16;
+
+			/**
+			 * \brief A data message write operation.
+			 * \see write_batch()
+			 */
+			struct write_operation
+			{
+				/**
+				 * \brief The buffer to write to.
+				 */
+				void* buf;
+
+				/**
+				 * \brief The length of buf.
+				 */
+				size_t buf_len;
+
+				/**
+				 * \brief The channel number.
+				 */
+				channel_number_type channel_number;
+
+				/**
+				 * \brief The sequence number. Only its low 32 bits are sent.
+				 */
+				extended_sequence_number_type sequence_number;
+
+				/**
+				 * \brief The cleartext data.
+				 */
+				const void* cleartext;
+
+				/**
+				 * \brief The data length.
+				 */
+				size_t cleartext_len;
+
+				/**
+				 * \brief Whether the data is only authenticated, and sent in clear.
+				 * \see write_authenticated()
+				 */
+				bool authenticated_only;
+
+				/**
+				 * \brief The count of bytes written, set by write_batch().
+				 */
+				size_t size;
+			};
+
 			/**
 			 * \brief Write a data message to a buffer.
 			 * \param buf The buffer to write to.
@@ -75,7 +131,45 @@ namespace fscp
 			 * \param enc_key_len The encryption key length.
 			 * \return The count of bytes written.
 			 */
-			static size_t write(void* buf, size_t buf_len, channel_number_type channel_number, session_number_type session_number, sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+			static size_t write(void* buf, size_t buf_len, channel_number_type channel_number, session_number_type session_number, extended_sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+
+			/**
+			 * \brief Write a data message to a buffer, using the contexts of a session.
+			 * \param buf The buffer to write to.
+			 * \param buf_len The length of buf.
+			 * \param channel_number The channel number.
+			 * \param sequence_number The sequence number.
+			 * \param cleartext The cleartext data.
+			 * \param cleartext_len The data length.
+			 * \param keys The session keys.
+			 * \return The count of bytes written.
+			 */
+			static size_t write(void* buf, size_t buf_len, channel_number_type channel_number, extended_sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, const session_keys& keys);
+
+			/**
+			 * \brief Write an authenticated-only data message to a buffer.
+			 * \param buf The buffer to write to.
+			 * \param buf_len The length of buf.
+			 * \param channel_number The channel number.
+			 * \param sequence_number The sequence number.
+			 * \param cleartext The cleartext data.
+			 * \param cleartext_len The data length.
+			 * \param keys The session keys.
+			 * \return The count of bytes written.
+			 *
+			 * The data is not encrypted: only use this for data that is already protected by an upper layer. The seal covers the header, the sequence number and the data, and uses a key derived from the seal key, so that the seal of a DATA message is never valid for an authenticated-only one.
+			 */
+			static size_t write_authenticated(void* buf, size_t buf_len, channel_number_type channel_number, extended_sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, const session_keys& keys);
+
+			/**
+			 * \brief Write several data messages that belong to the same session.
+			 * \param operations The write operations.
+			 * \param count The count of write operations. Should not exceed MAX_BATCH_SIZE.
+			 * \param keys The session keys.
+			 *
+			 * The result is the same as calling write() for each operation, but the cryptographic contexts of the session are taken once for the whole batch. The messages are still ciphered and sealed one after the other.
+			 */
+			static void write_batch(write_operation* operations, size_t count, const session_keys& keys);
 
 			/**
 			 * \brief Write a contact-request message to a buffer.
@@ -90,7 +184,18 @@ namespace fscp
 			 * \param enc_key_len The encryption key length.
 			 * \return The count of bytes written.
 			 */
-			static size_t write_contact_request(void* buf, size_t buf_len, session_number_type session_number, sequence_number_type sequence_number, const hash_list_type& hash_list, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+			static size_t write_contact_request(void* buf, size_t buf_len, session_number_type session_number, extended_sequence_number_type sequence_number, const hash_list_type& hash_list, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+
+			/**
+			 * \brief Write a contact-request message to a buffer, using the contexts of a session.
+			 * \param buf The buffer to write to.
+			 * \param buf_len The length of buf.
+			 * \param sequence_number The sequence number.
+			 * \param hash_list The hash list.
+			 * \param keys The session keys.
+			 * \return The count of bytes written.
+			 */
+			static size_t write_contact_request(void* buf, size_t buf_len, extended_sequence_number_type sequence_number, const hash_list_type& hash_list, const session_keys& keys);
 
 			/**
 			 * \brief Write a contact message to a buffer.
@@ -105,7 +210,18 @@ namespace fscp
 			 * \param enc_key_len The encryption key length.
 			 * \return The count of bytes written.
 			 */
-			static size_t write_contact(void* buf, size_t buf_len, session_number_type session_number, sequence_number_type sequence_number, const contact_map_type& contact_map, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+			static size_t write_contact(void* buf, size_t buf_len, session_number_type session_number, extended_sequence_number_type sequence_number, const contact_map_type& contact_map, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+
+			/**
+			 * \brief Write a contact message to a buffer, using the contexts of a session.
+			 * \param buf The buffer to write to.
+			 * \param buf_len The length of buf.
+			 * \param sequence_number The sequence number.
+			 * \param contact_map The contact map.
+			 * \param keys The session keys.
+			 * \return The count of bytes written.
+			 */
+			static size_t write_contact(void* buf, size_t buf_len, extended_sequence_number_type sequence_number, const contact_map_type& contact_map, const session_keys& keys);
 
 			/**
 			 * \brief Write a keep-alive message to a buffer.
@@ -120,7 +236,28 @@ namespace fscp
 			 * \param enc_key_len The encryption key length.
 			 * \return The count of bytes written.
 			 */
-			static size_t write_keep_alive(void* buf, size_t buf_len, session_number_type session_number, sequence_number_type sequence_number, size_t random_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+			static size_t write_keep_alive(void* buf, size_t buf_len, session_number_type session_number, extended_sequence_number_type sequence_number, size_t random_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+
+			/**
+			 * \brief Write a keep-alive message to a buffer, using the contexts of a session.
+			 * \param buf The buffer to write to.
+			 * \param buf_len The length of buf.
+			 * \param sequence_number The sequence number.
+			 * \param random_len The length of the random content to send.
+			 * \param keys The session keys.
+			 * \return The count of bytes written.
+			 */
+			static size_t write_keep_alive(void* buf, size_t buf_len, extended_sequence_number_type sequence_number, size_t random_len, const session_keys& keys);
+
+			/**
+			 * \brief Parse the hash list.
+			 * \param buf The buffer to parse.
+			 * \param buflen The length of the buffer to parse.
+			 * \param hash_list The hash list to fill. If hash_list is NULL, the function returns the count of hashes in buf.
+			 * \param hash_list_len The count of hashes hash_list can hold.
+			 * \return The count of hashes written to hash_list.
+			 */
+			static size_t parse_hash_list(const void* buf, size_t buflen, hash_type* hash_list, size_t hash_list_len);
 
 			/**
 			 * \brief Parse the hash list.
@@ -185,6 +322,8 @@ namespace fscp
 
 			/**
 			 * \brief Check if the seal matches with a given seal key.
+			 *
+			 * Only supports messages whose sequence number high part is zero: use check_seal_and_get_cleartext() for the others.
 			 * \param tmp A temporary buffer to use.
 			 * \param tmp_len The temporary buffer length. Should be at least 32 bytes long.
 			 * \param seal_key The seal key.
@@ -193,6 +332,41 @@ namespace fscp
 			 */
 			void check_seal(void* tmp, size_t tmp_len, const void* seal_key, size_t seal_key_len) const;
 
+			/**
+			 * \brief Check if the seal matches with the seal key of a session, without deciphering the message.
+			 * \param keys The session keys.
+			 * \param sequence_number_high The high 32 bits of the extended sequence number of the message, as reconstructed by the receiver. Zero for sessions that don't use extended sequence numbers.
+			 * \warning If the check fails, an exception is thrown.
+			 *
+			 * The seal covers the ciphertext: for messages whose content is not needed, like KEEP-ALIVE messages, the check alone authenticates the message.
+			 */
+			void check_seal(const session_keys& keys, sequence_number_type sequence_number_high) const;
+
+			/**
+			 * \brief Check the seal and get the clear text data in a single pass.
+			 * \param buf The buffer that must receive the data. If buf is NULL, the function returns the expected size of buf.
+			 * \param buf_len The length of buf.
+			 * \param keys The session keys.
+			 * \param sequence_number_high The high 32 bits of the extended sequence number of the message, as reconstructed by the receiver. Zero for sessions that don't use extended sequence numbers.
+			 * \return The count of bytes deciphered.
+			 * \warning If the seal check fails, an exception is thrown and the content of buf must be ignored.
+			 *
+			 * This is equivalent to check_seal() followed by get_cleartext(), but the ciphertext is read only once: every chunk is sealed and deciphered while it is still in the cache.
+			 *
+			 * For authenticated-only messages, the data is copied as is once the seal is checked.
+			 */
+			size_t check_seal_and_get_cleartext(void* buf, size_t buf_len, const session_keys& keys, sequence_number_type sequence_number_high = 0) const;
+
+			/**
+			 * \brief Measure the speed of a data path kernel.
+			 * \param kernel The data path kernel.
+			 * \param cleartext_len The size of the data to send in each message.
+			 * \param iterations The count of messages to write and read.
+			 * \return The average duration of a message write and read, in nanoseconds.
+			 * \see select_data_path_kernel()
+			 */
+			static double measure_kernel(data_path_kernel kernel, size_t cleartext_len, size_t iterations);
+
 			/**
 			 * \brief Get the clear text data, using a given encryption key.
 			 * \param buf The buffer that must receive the data. If buf is NULL, the function returns the expected size of buf.
@@ -259,11 +433,32 @@ namespace fscp
 			 * \param type The message type.
 			 * \return The count of bytes written.
 			 */
-			static size_t raw_write(void* buf, size_t buf_len, session_number_type session_number, sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len, message_type type);
+			static size_t raw_write(void* buf, size_t buf_len, session_number_type session_number, extended_sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len, message_type type);
+
+			/**
+			 * \brief Write a data message to a buffer, using the contexts of a session.
+			 * \param buf The buffer to write to.
+			 * \param buf_len The length of buf.
+			 * \param sequence_number The sequence number.
+			 * \param cleartext The cleartext data.
+			 * \param cleartext_len The data length.
+			 * \param keys The session keys.
+			 * \param type The message type.
+			 * \return The count of bytes written.
+			 */
+			static size_t raw_write(void* buf, size_t buf_len, extended_sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, const session_keys& keys, message_type type);
 
 		private:
 
+			template <typename CipherSuite>
+			class message_writer;
+
+			template <typename CipherSuite>
+			class message_reader;
+
 			void check_format() const;
+
+			friend class session_keys;
 	};
 
 	inline sequence_number_type data_message::sequence_number() const
@@ -288,7 +483,7 @@ namespace fscp
 
 	inline size_t data_message::hmac_size() const
 	{
-		return cryptoplus::hash::message_digest_algorithm(MESSAGE_DIGEST_ALGORITHM).result_size() / 2;
+		return default_cipher_suite::hmac_size;
 	}
 
 	template <typename T>
@@ -0,0 +1,169 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+
+/**
+ * \file data_path.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief The data path kernel selection.
+ */
+
+#ifndef FSCP_DATA_PATH_HPP
+#define FSCP_DATA_PATH_HPP
+
+#include <cstddef>
+
+namespace fscp
+{
+	/**
+	 * \brief The CPU features that matter to the data path.
+	 */
+	struct cpu_features
+	{
+		/**
+		 * \brief Whether the AES-NI instructions are available.
+		 */
+		bool aes_ni;
+
+		/**
+		 * \brief Whether the PCLMULQDQ instruction is available.
+		 */
+		bool pclmul;
+
+		/**
+		 * \brief Whether the SHA extensions are available.
+		 */
+		bool sha_ni;
+
+		/**
+		 * \brief Whether AVX2 is available and enabled by the operating system.
+		 */
+		bool avx2;
+
+		/**
+		 * \brief Whether AVX-512 (foundation) is available and enabled by the operating system.
+		 */
+		bool avx512;
+	};
+
+	/**
+	 * \brief The data path kernels.
+	 */
+	enum data_path_kernel
+	{
+		/**
+		 * \brief Cipher (or decipher) and seal each chunk while it is still in the cache.
+		 */
+		DATA_PATH_KERNEL_STITCHED = 0,
+
+		/**
+		 * \brief Cipher (or decipher) the whole message, then seal it.
+		 *
+		 * With hardware AES and SHA, the two passes can beat the stitched loop since each primitive runs on longer buffers.
+		 */
+		DATA_PATH_KERNEL_TWO_PASS = 1
+	};
+
+	/**
+	 * \brief The data path kernel selection report.
+	 */
+	struct data_path_report
+	{
+		/**
+		 * \brief The detected CPU features.
+		 *
+		 * They are only reported: the kernel is selected from the measured timings alone.
+		 */
+		cpu_features features;
+
+		/**
+		 * \brief The kernel the self-benchmark selected.
+		 *
+		 * set_data_path_kernel() overrides it.
+		 */
+		data_path_kernel kernel;
+
+		/**
+		 * \brief The median measured time of a message write and read with the stitched kernel, in nanoseconds.
+		 */
+		double stitched_duration;
+
+		/**
+		 * \brief The median measured time of a message write and read with the two-pass kernel, in nanoseconds.
+		 */
+		double two_pass_duration;
+	};
+
+	/**
+	 * \brief Detect the CPU features.
+	 * \return The CPU features. On non-x86 architectures, all features are reported as absent.
+	 */
+	cpu_features detect_cpu_features();
+
+	/**
+	 * \brief Select the fastest data path kernel, if it was not done already.
+	 * \return The selection report.
+	 *
+	 * The first call detects the CPU features and runs a short self-benchmark of every kernel: both kernels are timed in turn several times, and the median timings are compared, so that a single noisy run cannot decide. It is thread-safe.
+	 */
+	const data_path_report& select_data_path_kernel();
+
+	/**
+	 * \brief Force the data path kernel.
+	 * \param kernel The data path kernel to use instead of the one the self-benchmark selects.
+	 *
+	 * Call this before creating the servers: the sessions that already exist keep the kernel of their contexts, and the self-benchmark is then never run. It is thread-safe.
+	 */
+	void set_data_path_kernel(data_path_kernel kernel);
+
+	/**
+	 * \brief Get the data path kernel in use.
+	 * \return The kernel set with set_data_path_kernel() if any, or the kernel selected by select_data_path_kernel() otherwise.
+	 *
+	 * The server calls it when it is created, so that the self-benchmark does not delay the first messages.
+	 */
+	data_path_kernel get_data_path_kernel();
+
+	/**
+	 * \brief Get the name of a data path kernel.
+	 * \param kernel The data path kernel.
+	 * \return The name of the kernel.
+	 */
+	const char* to_string(data_path_kernel kernel);
+}
+
+#endif /* FSCP_DATA_PATH_HPP */
@@ -76,12 +76,25 @@ namespace fscp
 			 */
 			typedef boost::shared_ptr<array_data_type> pointer_data_type;
 
+			/**
+			 * \brief Copy data into a new pointer data.
+			 * \param data The data to copy.
+			 * \return The copied data.
+			 */
+			static pointer_data_type make_pointer(boost::asio::const_buffer data);
+
 			/**
 			 * \brief Push data to the data store.
 			 * \param data The data to push.
 			 */
 			void push(boost::asio::const_buffer data);
 
+			/**
+			 * \brief Push already copied data to the data store.
+			 * \param data The data to push.
+			 */
+			void push(pointer_data_type data);
+
 			/**
 			 * \brief Check if the data store is empty.
 			 * \return true if the data store is empty.
@@ -96,6 +109,14 @@ namespace fscp
 			 */
 			const array_data_type& front() const;
 
+			/**
+			 * \brief Get a pointer to the front element, if any.
+			 * \return A shared pointer to the front element, that remains valid after pop() is called.
+			 * \warning Calling this method on an empty data_store is undefined behavior.
+			 * \see empty
+			 */
+			pointer_data_type front_pointer() const;
+
 			/**
 			 * \brief Pop the front element, if any.
 			 * \warning Calling this method on an empty data_store is undefined behavior.
@@ -108,9 +129,19 @@ namespace fscp
 			std::queue<pointer_data_type> m_queue;
 	};
 
+	inline data_store::pointer_data_type data_store::make_pointer(boost::asio::const_buffer data)
+	{
+		return boost::make_shared<array_data_type>(boost::asio::buffer_cast<const data_type*>(data), boost::asio::buffer_cast<const data_type*>(data + boost::asio::buffer_size(data)));
+	}
+
 	inline void data_store::push(boost::asio::const_buffer data)
 	{
-		m_queue.push(boost::make_shared<array_data_type>(boost::asio::buffer_cast<const data_type*>(data), boost::asio::buffer_cast<const data_type*>(data + boost::asio::buffer_size(data))));
+		push(make_pointer(data));
+	}
+
+	inline void data_store::push(pointer_data_type data)
+	{
+		m_queue.push(data);
 	}
 
 	inline bool data_store::empty() const
@@ -123,6 +154,11 @@ namespace fscp
 		return *m_queue.front();
 	}
 
+	inline data_store::pointer_data_type data_store::front_pointer() const
+	{
+		return m_queue.front();
+	}
+
 	inline void data_store::pop()
 	{
 		m_queue.pop();
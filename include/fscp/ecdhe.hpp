@@ -0,0 +1,158 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file ecdhe.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief The elliptic-curve ephemeral key exchange primitives.
+ */
+
+#ifndef FSCP_ECDHE_HPP
+#define FSCP_ECDHE_HPP
+
+#include "session_store.hpp"
+
+#include <cryptoplus/pkey/pkey.hpp>
+
+#include <boost/array.hpp>
+
+#include <openssl/opensslv.h>
+
+#include <stdint.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/**
+ * \brief Defined if the ECDHE handshake is available.
+ *
+ * X25519 and Ed25519 require OpenSSL 1.1.1 or later.
+ */
+#define FSCP_HAS_ECDHE_HANDSHAKE
+#endif
+
+namespace fscp
+{
+	namespace ecdhe
+	{
+		/**
+		 * \brief The X25519 key length.
+		 */
+		const size_t KEY_LENGTH = 32;
+
+		/**
+		 * \brief The X25519 key type.
+		 */
+		typedef boost::array<uint8_t, KEY_LENGTH> key_type;
+
+		/**
+		 * \brief Check if the ECDHE handshake is supported by the underlying cryptographic library.
+		 * \return true if the ECDHE handshake is supported.
+		 */
+		bool is_supported();
+
+		/**
+		 * \brief Sign a buffer with an identity key.
+		 * \param sig The buffer that must receive the signature. If sig is NULL, the function returns the maximum size of the signature.
+		 * \param sig_len The length of sig.
+		 * \param buf The buffer to sign.
+		 * \param buf_len The length of buf.
+		 * \param key The private key to use. Ed25519 keys produce Ed25519 signatures, RSA keys produce RSASSA-PSS signatures.
+		 * \return The count of bytes written.
+		 */
+		size_t sign(void* sig, size_t sig_len, const void* buf, size_t buf_len, cryptoplus::pkey::pkey key);
+
+		/**
+		 * \brief Check a signature made with sign().
+		 * \param sig The signature.
+		 * \param sig_len The length of sig.
+		 * \param buf The signed buffer.
+		 * \param buf_len The length of buf.
+		 * \param key The public key to use.
+		 * \warning If the check fails, an exception is thrown.
+		 */
+		void check_signature(const void* sig, size_t sig_len, const void* buf, size_t buf_len, cryptoplus::pkey::pkey key);
+
+		/**
+		 * \brief An ephemeral X25519 key pair.
+		 *
+		 * The private key is wiped when the instance is destroyed.
+		 */
+		class ephemeral_key
+		{
+			public:
+
+				/**
+				 * \brief Generate a new random key pair.
+				 */
+				ephemeral_key();
+
+				/**
+				 * \brief Destroy the key pair.
+				 */
+				~ephemeral_key();
+
+				/**
+				 * \brief Get the public key.
+				 * \return The public key.
+				 */
+				const key_type& public_key() const;
+
+				/**
+				 * \brief Derive the session keys shared with a remote host.
+				 * \param peer_public_key The public key of the remote host.
+				 * \param challenge The challenge of the session request, used as the HKDF salt.
+				 * \param session_number The session number.
+				 * \param is_initiator true if this key pair belongs to the host that requested the session.
+				 * \return The session.
+				 *
+				 * The seal and encryption keys are the first and second halves of HKDF-SHA256(salt: challenge, ikm: X25519 shared secret, info: "FSCP session" || session_number || initiator public key || responder public key).
+				 */
+				session_store derive_session(const key_type& peer_public_key, const challenge_type& challenge, session_store::session_number_type session_number, bool is_initiator) const;
+
+			private:
+
+				key_type m_private_key;
+				key_type m_public_key;
+		};
+
+		inline const key_type& ephemeral_key::public_key() const
+		{
+			return m_public_key;
+		}
+	}
+}
+
+#endif /* FSCP_ECDHE_HPP */
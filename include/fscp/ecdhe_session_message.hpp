@@ -0,0 +1,208 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file ecdhe_session_message.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief An ECDHE session message class.
+ */
+
+#ifndef FSCP_ECDHE_SESSION_MESSAGE_HPP
+#define FSCP_ECDHE_SESSION_MESSAGE_HPP
+
+#include "message.hpp"
+#include "ecdhe.hpp"
+
+#include <cryptoplus/pkey/pkey.hpp>
+
+namespace fscp
+{
+	/**
+	 * \brief An ECDHE session message class.
+	 *
+	 * ECDHE_SESSION_REQUEST and ECDHE_SESSION messages share the same format.
+	 */
+	class ecdhe_session_message : public message
+	{
+		public:
+
+			/**
+			 * \brief The session number type.
+			 */
+			typedef session_store::session_number_type session_number_type;
+
+			/**
+			 * \brief Write an ECDHE session message to a buffer.
+			 * \param buf The buffer to write to.
+			 * \param buf_len The length of buf.
+			 * \param type The message type. Must be MESSAGE_TYPE_ECDHE_SESSION_REQUEST or MESSAGE_TYPE_ECDHE_SESSION.
+			 * \param session_number The session number.
+			 * \param challenge The challenge.
+			 * \param public_key The ephemeral public key.
+			 * \param authenticated_channels The channels whose data is only authenticated, not encrypted. Must be 0 for requests.
+			 * \param session_flags The session flags the sender asks for (requests) or enabled (responses).
+			 * \param sig_key The private key to use to sign the message.
+			 * \return The count of bytes written.
+			 */
+			static size_t write(void* buf, size_t buf_len, message_type type, session_number_type session_number, const challenge_type& challenge, const ecdhe::key_type& public_key, channel_mask_type authenticated_channels, session_flags_type session_flags, cryptoplus::pkey::pkey sig_key);
+
+			/**
+			 * \brief Create an ecdhe_session_message from a message.
+			 * \param message The message.
+			 */
+			ecdhe_session_message(const message& message);
+
+			/**
+			 * \brief Get the session number.
+			 * \return The session number.
+			 */
+			session_number_type session_number() const;
+
+			/**
+			 * \brief Get the challenge.
+			 * \return The challenge.
+			 */
+			challenge_type challenge() const;
+
+			/**
+			 * \brief Get the ephemeral public key.
+			 * \return The ephemeral public key.
+			 */
+			ecdhe::key_type public_key() const;
+
+			/**
+			 * \brief Get the channels whose data is only authenticated, not encrypted.
+			 * \return The channel mask.
+			 */
+			channel_mask_type authenticated_channels() const;
+
+			/**
+			 * \brief Get the session flags the sender asks for (requests) or enabled (responses).
+			 * \return The session flags.
+			 */
+			session_flags_type session_flags() const;
+
+			/**
+			 * \brief Get the signature.
+			 * \return The signature.
+			 */
+			const uint8_t* signature() const;
+
+			/**
+			 * \brief Get the signature size.
+			 * \return The signature size.
+			 */
+			size_t signature_size() const;
+
+			/**
+			 * \brief Check if the signature matches with a given public key.
+			 * \param key The public key to use.
+			 * \warning If the check fails, an exception is thrown.
+			 */
+			void check_signature(cryptoplus::pkey::pkey key) const;
+
+		protected:
+
+			/**
+			 * \brief The length of the signed fields.
+			 */
+			static const size_t FIELDS_LENGTH = sizeof(session_number_type) + challenge_type::static_size + ecdhe::KEY_LENGTH + sizeof(channel_mask_type) + sizeof(session_flags_type);
+
+			/**
+			 * \brief The min length of the body.
+			 */
+			static const size_t MIN_BODY_LENGTH = FIELDS_LENGTH + sizeof(uint16_t);
+
+			/**
+			 * \brief The signed data type: the message type followed by the fields.
+			 */
+			typedef boost::array<uint8_t, 1 + FIELDS_LENGTH> signed_data_type;
+
+			/**
+			 * \brief Get the signed data of a message.
+			 * \param type The message type.
+			 * \param fields The fields.
+			 * \return The signed data.
+			 */
+			static signed_data_type get_signed_data(message_type type, const void* fields);
+	};
+
+	inline ecdhe_session_message::session_number_type ecdhe_session_message::session_number() const
+	{
+		return ntohl(buffer_tools::get<session_number_type>(payload(), 0));
+	}
+
+	inline challenge_type ecdhe_session_message::challenge() const
+	{
+		challenge_type result;
+
+		std::memcpy(result.c_array(), payload() + sizeof(session_number_type), result.size());
+
+		return result;
+	}
+
+	inline ecdhe::key_type ecdhe_session_message::public_key() const
+	{
+		ecdhe::key_type result;
+
+		std::memcpy(result.c_array(), payload() + sizeof(session_number_type) + challenge_type::static_size, result.size());
+
+		return result;
+	}
+
+	inline channel_mask_type ecdhe_session_message::authenticated_channels() const
+	{
+		return ntohs(buffer_tools::get<channel_mask_type>(payload(), FIELDS_LENGTH - sizeof(session_flags_type) - sizeof(channel_mask_type)));
+	}
+
+	inline session_flags_type ecdhe_session_message::session_flags() const
+	{
+		return ntohs(buffer_tools::get<session_flags_type>(payload(), FIELDS_LENGTH - sizeof(session_flags_type)));
+	}
+
+	inline const uint8_t* ecdhe_session_message::signature() const
+	{
+		return payload() + MIN_BODY_LENGTH;
+	}
+
+	inline size_t ecdhe_session_message::signature_size() const
+	{
+		return ntohs(buffer_tools::get<uint16_t>(payload(), FIELDS_LENGTH));
+	}
+}
+
+#endif /* FSCP_ECDHE_SESSION_MESSAGE_HPP */
@@ -46,6 +46,8 @@
 #define FSCP_FSCP_HPP
 
 #include "server.hpp"
+#include "cpu_affinity.hpp"
+#include "crypto_scheduler.hpp"
 
 namespace fscp
 {
@@ -76,13 +76,13 @@ namespace fscp
 
 			/**
 			 * \brief Create a new request.
-			 * \param io_service The io_service to use.
+			 * \param strand The strand the timeout handler runs through.
 			 * \param unique_number The unique number.
 			 * \param target The target host.
 			 * \param callback The callback.
 			 * \param timeout The timeout value.
 			 */
-			hello_request(boost::asio::io_service& io_service, uint32_t unique_number, const ep_type& target, callback_type callback, boost::posix_time::time_duration timeout);
+			hello_request(boost::asio::io_service::strand& strand, uint32_t unique_number, const ep_type& target, callback_type callback, boost::posix_time::time_duration timeout);
 
 			/**
 			 * \brief Destroy the request.
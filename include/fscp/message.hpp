@@ -118,6 +118,14 @@ namespace fscp
 			 */
 			const uint8_t* payload() const;
 
+			/**
+			 * \brief Get the digest of the whole message.
+			 * \return The digest of the header and the payload.
+			 *
+			 * The digest identifies retransmissions of a message.
+			 */
+			hash_type digest() const;
+
 		protected:
 
 			/**
@@ -50,6 +50,9 @@
 #include <cryptoplus/x509/certificate.hpp>
 #include <cryptoplus/pkey/pkey.hpp>
 
+#include <boost/array.hpp>
+
+#include <algorithm>
 #include <list>
 
 namespace fscp
@@ -66,10 +69,20 @@ namespace fscp
 			 */
 			typedef cryptoplus::x509::certificate cert_type;
 
+			/**
+			 * \brief The public key type.
+			 */
+			typedef cryptoplus::pkey::pkey key_type;
+
+			/**
+			 * \brief The count of verified signatures that are remembered.
+			 */
+			static const size_t VERIFIED_SIGNATURE_CACHE_SIZE = 8;
+
 			/**
 			 * \brief Create an empty presentation_store.
 			 */
-			presentation_store() {};
+			presentation_store() : m_verified_signature_count(0), m_verified_signature_index(0) {};
 
 			/**
 			 * \brief Create a new presentation store.
@@ -106,12 +119,66 @@ namespace fscp
 				return m_sig_hash;
 			}
 
+			/**
+			 * \brief Get the public key of the signature certificate.
+			 * \return The signature verification key.
+			 *
+			 * The key is extracted once, when the presentation store is created.
+			 */
+			key_type signature_key() const
+			{
+				return m_sig_key;
+			}
+
+			/**
+			 * \brief Get the public key of the encryption certificate.
+			 * \return The encryption key.
+			 *
+			 * The key is extracted once, when the presentation store is created.
+			 */
+			key_type encryption_key() const
+			{
+				return m_enc_key;
+			}
+
+			/**
+			 * \brief Check if the signature of a message was already verified.
+			 * \param digest The message digest.
+			 * \return true if the signature of the message was already verified with signature_key().
+			 */
+			bool is_signature_verified(const hash_type& digest) const;
+
+			/**
+			 * \brief Remember that the signature of a message was verified.
+			 * \param digest The message digest.
+			 *
+			 * Only the last VERIFIED_SIGNATURE_CACHE_SIZE digests are remembered.
+			 */
+			void set_signature_verified(const hash_type& digest);
+
 		private:
 
 			cert_type m_sig_cert;
 			cert_type m_enc_cert;
 			hash_type m_sig_hash;
+			key_type m_sig_key;
+			key_type m_enc_key;
+			boost::array<hash_type, VERIFIED_SIGNATURE_CACHE_SIZE> m_verified_signatures;
+			size_t m_verified_signature_count;
+			size_t m_verified_signature_index;
 	};
+
+	inline bool presentation_store::is_signature_verified(const hash_type& digest) const
+	{
+		return std::find(m_verified_signatures.begin(), m_verified_signatures.begin() + m_verified_signature_count, digest) != m_verified_signatures.begin() + m_verified_signature_count;
+	}
+
+	inline void presentation_store::set_signature_verified(const hash_type& digest)
+	{
+		m_verified_signatures[m_verified_signature_index] = digest;
+		m_verified_signature_index = (m_verified_signature_index + 1) % m_verified_signatures.size();
+		m_verified_signature_count = std::min(m_verified_signature_count + 1, m_verified_signatures.size());
+	}
 }
 
 #endif /* FSCP_PRESENTATION_STORE_HPP */
@@ -0,0 +1,86 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+
+/**
+ * \file random_pool.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A per-thread buffered random source.
+ */
+
+#ifndef FSCP_RANDOM_POOL_HPP
+#define FSCP_RANDOM_POOL_HPP
+
+#include <cstddef>
+
+namespace fscp
+{
+	namespace random_pool
+	{
+		/**
+		 * \brief The count of random bytes drawn from the underlying generator at each refill.
+		 */
+		const size_t POOL_SIZE = 4096;
+
+		/**
+		 * \brief The biggest request that is served from the pool.
+		 *
+		 * Bigger requests go straight to the underlying generator, so that they don't drain the pool for the small ones.
+		 */
+		const size_t MAX_POOLED_REQUEST_SIZE = 256;
+
+		/**
+		 * \brief Get cryptographically secure random bytes.
+		 * \param buf The buffer to fill. Cannot be NULL if buf_len is not zero.
+		 * \param buf_len The count of random bytes to write to buf.
+		 *
+		 * Small requests are served from a pool owned by the calling thread, which is refilled by chunks of POOL_SIZE bytes: no lock is taken. The served bytes are wiped from the pool so they can never be served twice.
+		 *
+		 * On error, a cryptoplus::error::cryptographic_exception is thrown.
+		 */
+		void get_random_bytes(void* buf, size_t buf_len);
+
+		/**
+		 * \brief Discard the random bytes remaining in the pool of the calling thread.
+		 *
+		 * This is done automatically in a child process after a fork(), so that it does not serve the same bytes as its parent.
+		 */
+		void discard();
+	}
+}
+
+#endif /* FSCP_RANDOM_POOL_HPP */
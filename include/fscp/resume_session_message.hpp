@@ -0,0 +1,195 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file resume_session_message.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A resume session message class.
+ */
+
+#ifndef FSCP_RESUME_SESSION_MESSAGE_HPP
+#define FSCP_RESUME_SESSION_MESSAGE_HPP
+
+#include "message.hpp"
+#include "resumption_ticket.hpp"
+
+namespace fscp
+{
+	/**
+	 * \brief A resume session message class.
+	 *
+	 * RESUME_SESSION_REQUEST and RESUME_SESSION messages share the same format.
+	 */
+	class resume_session_message : public message
+	{
+		public:
+
+			/**
+			 * \brief The session number type.
+			 */
+			typedef session_store::session_number_type session_number_type;
+
+			/**
+			 * \brief Write a resume session message to a buffer.
+			 * \param buf The buffer to write to.
+			 * \param buf_len The length of buf.
+			 * \param type The message type. Must be MESSAGE_TYPE_RESUME_SESSION_REQUEST or MESSAGE_TYPE_RESUME_SESSION.
+			 * \param ticket The resumption ticket.
+			 * \param session_number The session number.
+			 * \param challenge The challenge.
+			 * \param nonce The nonce. Must be null for requests.
+			 * \param authenticated_channels The channels whose data is only authenticated, not encrypted. Must be 0 for requests.
+			 * \param session_flags The session flags the sender asks for (requests) or enabled (responses).
+			 * \return The count of bytes written.
+			 */
+			static size_t write(void* buf, size_t buf_len, message_type type, const resumption_ticket& ticket, session_number_type session_number, const challenge_type& challenge, const resumption_ticket::nonce_type& nonce, channel_mask_type authenticated_channels, session_flags_type session_flags);
+
+			/**
+			 * \brief Create a resume_session_message from a message.
+			 * \param message The message.
+			 */
+			resume_session_message(const message& message);
+
+			/**
+			 * \brief Get the ticket identifier.
+			 * \return The ticket identifier.
+			 */
+			resumption_ticket::ticket_id_type ticket_id() const;
+
+			/**
+			 * \brief Get the session number.
+			 * \return The session number.
+			 */
+			session_number_type session_number() const;
+
+			/**
+			 * \brief Get the challenge.
+			 * \return The challenge.
+			 */
+			challenge_type challenge() const;
+
+			/**
+			 * \brief Get the nonce.
+			 * \return The nonce.
+			 */
+			resumption_ticket::nonce_type nonce() const;
+
+			/**
+			 * \brief Get the channels whose data is only authenticated, not encrypted.
+			 * \return The channel mask.
+			 */
+			channel_mask_type authenticated_channels() const;
+
+			/**
+			 * \brief Get the session flags the sender asks for (requests) or enabled (responses).
+			 * \return The session flags.
+			 */
+			session_flags_type session_flags() const;
+
+			/**
+			 * \brief Check if the MAC matches with a given ticket.
+			 * \param ticket The ticket.
+			 * \warning If the check fails, an exception is thrown.
+			 */
+			void check_mac(const resumption_ticket& ticket) const;
+
+		protected:
+
+			/**
+			 * \brief The length of the fields covered by the MAC.
+			 */
+			static const size_t FIELDS_LENGTH = resumption_ticket::TICKET_ID_LENGTH + sizeof(session_number_type) + challenge_type::static_size + resumption_ticket::NONCE_LENGTH + sizeof(channel_mask_type) + sizeof(session_flags_type);
+
+			/**
+			 * \brief The length of the body.
+			 */
+			static const size_t BODY_LENGTH = FIELDS_LENGTH + resumption_ticket::MAC_LENGTH;
+
+			/**
+			 * \brief Compute the MAC of a message.
+			 * \param mac The buffer that receives the MAC.
+			 * \param type The message type.
+			 * \param fields The fields.
+			 * \param ticket The ticket.
+			 */
+			static void compute_mac(void* mac, message_type type, const void* fields, const resumption_ticket& ticket);
+	};
+
+	inline resumption_ticket::ticket_id_type resume_session_message::ticket_id() const
+	{
+		resumption_ticket::ticket_id_type result;
+
+		std::memcpy(result.c_array(), payload(), result.size());
+
+		return result;
+	}
+
+	inline resume_session_message::session_number_type resume_session_message::session_number() const
+	{
+		return ntohl(buffer_tools::get<session_number_type>(payload(), resumption_ticket::TICKET_ID_LENGTH));
+	}
+
+	inline challenge_type resume_session_message::challenge() const
+	{
+		challenge_type result;
+
+		std::memcpy(result.c_array(), payload() + resumption_ticket::TICKET_ID_LENGTH + sizeof(session_number_type), result.size());
+
+		return result;
+	}
+
+	inline resumption_ticket::nonce_type resume_session_message::nonce() const
+	{
+		resumption_ticket::nonce_type result;
+
+		std::memcpy(result.c_array(), payload() + resumption_ticket::TICKET_ID_LENGTH + sizeof(session_number_type) + challenge_type::static_size, result.size());
+
+		return result;
+	}
+
+	inline channel_mask_type resume_session_message::authenticated_channels() const
+	{
+		return ntohs(buffer_tools::get<channel_mask_type>(payload(), FIELDS_LENGTH - sizeof(session_flags_type) - sizeof(channel_mask_type)));
+	}
+
+	inline session_flags_type resume_session_message::session_flags() const
+	{
+		return ntohs(buffer_tools::get<session_flags_type>(payload(), FIELDS_LENGTH - sizeof(session_flags_type)));
+	}
+}
+
+#endif /* FSCP_RESUME_SESSION_MESSAGE_HPP */
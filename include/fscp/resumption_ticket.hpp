@@ -0,0 +1,177 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file resumption_ticket.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A session resumption ticket class.
+ */
+
+#ifndef FSCP_RESUMPTION_TICKET_HPP
+#define FSCP_RESUMPTION_TICKET_HPP
+
+#include "session_store.hpp"
+
+#include <boost/array.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <stdint.h>
+
+namespace fscp
+{
+	/**
+	 * \brief A session resumption ticket class.
+	 *
+	 * Both hosts derive the same ticket from the keys of a session. A ticket lets the host that received the session keys request a new session with one symmetric round trip.
+	 */
+	class resumption_ticket
+	{
+		public:
+
+			/**
+			 * \brief The ticket identifier length.
+			 */
+			static const size_t TICKET_ID_LENGTH = 16;
+
+			/**
+			 * \brief The ticket identifier type.
+			 */
+			typedef boost::array<uint8_t, TICKET_ID_LENGTH> ticket_id_type;
+
+			/**
+			 * \brief The nonce length.
+			 */
+			static const size_t NONCE_LENGTH = 32;
+
+			/**
+			 * \brief The nonce type.
+			 */
+			typedef boost::array<uint8_t, NONCE_LENGTH> nonce_type;
+
+			/**
+			 * \brief The MAC length.
+			 */
+			static const size_t MAC_LENGTH = 32;
+
+			/**
+			 * \brief Derive a ticket from a session.
+			 * \param session The session.
+			 * \param peer_certificate_hash The hash of the signature certificate of the remote host.
+			 * \param expiration_date The date after which the ticket cannot be used anymore.
+			 */
+			resumption_ticket(const session_store& session, const hash_type& peer_certificate_hash, const boost::posix_time::ptime& expiration_date);
+
+			/**
+			 * \brief Destroy the ticket.
+			 */
+			~resumption_ticket();
+
+			/**
+			 * \brief Get the ticket identifier.
+			 * \return The ticket identifier.
+			 */
+			const ticket_id_type& id() const;
+
+			/**
+			 * \brief Get the hash of the signature certificate of the remote host.
+			 * \return The certificate hash.
+			 */
+			const hash_type& peer_certificate_hash() const;
+
+			/**
+			 * \brief Get the expiration date.
+			 * \return The expiration date.
+			 */
+			const boost::posix_time::ptime& expiration_date() const;
+
+			/**
+			 * \brief Check if the ticket has expired.
+			 * \return true if the ticket has expired.
+			 */
+			bool has_expired() const;
+
+			/**
+			 * \brief Compute the MAC of a buffer.
+			 * \param mac The buffer that receives the MAC. Must be at least MAC_LENGTH bytes long.
+			 * \param mac_len The length of mac.
+			 * \param buf The buffer.
+			 * \param buf_len The length of buf.
+			 */
+			void compute_mac(void* mac, size_t mac_len, const void* buf, size_t buf_len) const;
+
+			/**
+			 * \brief Derive a new session from the ticket.
+			 * \param session_number The session number.
+			 * \param challenge The challenge of the resumption request.
+			 * \param nonce The nonce of the resumption response.
+			 * \return The session.
+			 */
+			session_store derive_session(session_store::session_number_type session_number, const challenge_type& challenge, const nonce_type& nonce) const;
+
+		private:
+
+			typedef boost::array<uint8_t, session_store::KEY_LENGTH> key_type;
+
+			ticket_id_type m_id;
+			key_type m_secret;
+			key_type m_mac_key;
+			hash_type m_peer_certificate_hash;
+			boost::posix_time::ptime m_expiration_date;
+	};
+
+	inline const resumption_ticket::ticket_id_type& resumption_ticket::id() const
+	{
+		return m_id;
+	}
+
+	inline const hash_type& resumption_ticket::peer_certificate_hash() const
+	{
+		return m_peer_certificate_hash;
+	}
+
+	inline const boost::posix_time::ptime& resumption_ticket::expiration_date() const
+	{
+		return m_expiration_date;
+	}
+
+	inline bool resumption_ticket::has_expired() const
+	{
+		return (boost::posix_time::microsec_clock::local_time() > m_expiration_date);
+	}
+}
+
+#endif /* FSCP_RESUMPTION_TICKET_HPP */
@@ -50,28 +50,42 @@
 #include "presentation_store.hpp"
 #include "session_pair.hpp"
 #include "data_store.hpp"
+#include "submission_queue.hpp"
+#include "background_worker.hpp"
+#include "callback_queue.hpp"
+#include "snapshot_map.hpp"
+#include "crypto_scheduler.hpp"
 
 #include <boost/asio.hpp>
+#include <boost/array.hpp>
+#include <boost/atomic.hpp>
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <stdint.h>
+#include <set>
 
 namespace fscp
 {
+	class message;
 	class hello_message;
 	class presentation_message;
 	class session_request_message;
 	class clear_session_request_message;
 	class session_message;
 	class clear_session_message;
+	class ecdhe_session_message;
+	class resume_session_message;
 	class data_message;
 
 	/**
 	 * \brief A FSCP server.
 	 *
-	 * This class is *NOT* thread-safe !
+	 * All the handlers of the server run through a strand: io_service::run() can be called from several threads.
 	 *
-	 * Once an instance is running into a io_service, calling any method (except close()) is undefined behavior.
+	 * Once an instance is running into a io_service, only the following methods can be called, from any thread: close(), set_identity(), get_presentation(), set_presentation(), clear_presentation(), has_session(), get_session_endpoints(), the *_count() statistics and the async_*() methods. The other methods configure the server and must be called before the io_service runs.
 	 */
 	class server
 	{
@@ -121,6 +135,48 @@ namespace fscp
 			 */
 			typedef boost::function<bool (const ep_type& sender, bool default_accept)> session_message_callback;
 
+			/**
+			 * \brief The handle through which an asynchronous callback answers.
+			 * \param accept The answer.
+			 *
+			 * It can be called from any thread, once. Answers that come after the decision timeout are ignored.
+			 */
+			typedef boost::function<void (bool accept)> decision_handler;
+
+			/**
+			 * \brief Asynchronous hello message callback type.
+			 * \param sender The endpoint that sent the hello message.
+			 * \param default_accept The default answer.
+			 * \param handler The handler to call with true to reply to the hello message, or false to ignore it.
+			 */
+			typedef boost::function<void (const ep_type& sender, bool default_accept, decision_handler handler)> async_hello_message_callback;
+
+			/**
+			 * \brief Asynchronous presentation message callback type.
+			 * \param sender The endpoint that sent the presentation message.
+			 * \param sig_cert The signature certificate.
+			 * \param enc_cert The encryption certificate.
+			 * \param is_new True if the host is not currently known.
+			 * \param handler The handler to call with true to accept the presentation message for the originating host.
+			 */
+			typedef boost::function<void (const ep_type& sender, cert_type sig_cert, cert_type enc_cert, bool is_new, decision_handler handler)> async_presentation_message_callback;
+
+			/**
+			 * \brief Asynchronous session request message callback type.
+			 * \param sender The endpoint that sent the session request message.
+			 * \param default_accept The default answer.
+			 * \param handler The handler to call with true to accept the session request.
+			 */
+			typedef boost::function<void (const ep_type& sender, bool default_accept, decision_handler handler)> async_session_request_message_callback;
+
+			/**
+			 * \brief Asynchronous session message callback type.
+			 * \param sender The endpoint that sent the session message.
+			 * \param default_accept The default answer.
+			 * \param handler The handler to call with true to accept the session.
+			 */
+			typedef boost::function<void (const ep_type& sender, bool default_accept, decision_handler handler)> async_session_message_callback;
+
 			/**
 			 * \brief Data message callback type.
 			 * \param sender The endpoint that sent the data message.
@@ -165,6 +221,11 @@ namespace fscp
 			 */
 			typedef boost::function<void (const ep_type& target, const boost::system::error_code& code)> network_error_callback;
 
+			/**
+			 * \brief An executor, to run the callbacks away from the receiving thread.
+			 */
+			typedef callback_queue::executor_type callback_executor_type;
+
 			/**
 			 * \brief Create a new FSCP server.
 			 * \param io_service The Boost Asio io_service instance to associate with the server.
@@ -172,6 +233,13 @@ namespace fscp
 			 */
 			server(boost::asio::io_service& io_service, const identity_store& identity);
 
+			/**
+			 * \brief Destroy the server.
+			 *
+			 * The callback queue may outlive the server, in the tasks still pending on the callback executor: it no longer calls back into the server once the server is destroyed.
+			 */
+			~server();
+
 			/**
 			 * \brief Open the server.
 			 * \param listen_endpoint The listen endpoint.
@@ -181,7 +249,7 @@ namespace fscp
 			/**
 			 * \brief Close the server.
 			 *
-			 * This method can be called from another thread.
+			 * This method can be called from any thread. The server is closed from its strand, once the io_service runs the closing handler: the configuration methods can only be called again after that.
 			 */
 			void close();
 
@@ -242,6 +310,12 @@ namespace fscp
 			 */
 			void set_hello_message_callback(hello_message_callback callback);
 
+			/**
+			 * \brief Set the asynchronous hello message callback.
+			 * \param callback The callback. If set, it is used instead of the hello message callback.
+			 */
+			void set_async_hello_message_callback(async_hello_message_callback callback);
+
 			/**
 			 * \brief Greet a host.
 			 * \param target The target host.
@@ -256,6 +330,12 @@ namespace fscp
 			 */
 			void set_presentation_message_callback(presentation_message_callback callback);
 
+			/**
+			 * \brief Set the asynchronous presentation message callback.
+			 * \param callback The callback. If set, it is used instead of the presentation message callback.
+			 */
+			void set_async_presentation_message_callback(async_presentation_message_callback callback);
+
 			/**
 			 * \brief Introduce to a host.
 			 * \param target The target host.
@@ -265,10 +345,10 @@ namespace fscp
 			/**
 			 * \brief Get the presentation parameters of a specified host.
 			 * \param target The target host.
-			 * \return The presentation parameters of the specified host.
+			 * \return A copy of the presentation parameters of the specified host.
 			 * \warning If no presentation parameters exist for the specified host, a std::runtime_error is thrown.
 			 */
-			const presentation_store& get_presentation(ep_type target) const;
+			presentation_store get_presentation(ep_type target) const;
 
 			/**
 			 * \brief Set the presentation parameters for a given host.
@@ -276,6 +356,8 @@ namespace fscp
 			 * \param sig_cert The signature certificate. Cannot be null.
 			 * \param enc_cert The encryption certificate. If null, the default, sig_cert is taken.
 			 * \see clear_presentation()
+			 *
+			 * get_presentation() returns the new parameters right away. The server uses them once the operations submitted before are handled.
 			 */
 			void set_presentation(ep_type target, cert_type sig_cert, cert_type enc_cert = cert_type());
 
@@ -298,6 +380,14 @@ namespace fscp
 			 */
 			void set_session_request_message_callback(session_request_message_callback callback);
 
+			/**
+			 * \brief Set the asynchronous session request message callback.
+			 * \param callback The callback. If set, it is used instead of the session request message callback.
+			 *
+			 * Until the answer comes, the request is kept aside: the session is only negotiated if it is accepted.
+			 */
+			void set_async_session_request_message_callback(async_session_request_message_callback callback);
+
 			/**
 			 * \brief Request a session to a host.
 			 * \param target The target host.
@@ -316,6 +406,50 @@ namespace fscp
 			 */
 			void set_session_message_callback(session_message_callback callback);
 
+			/**
+			 * \brief Set the asynchronous session message callback.
+			 * \param callback The callback. If set, it is used instead of the session message callback.
+			 *
+			 * Until the answer comes, the message is kept aside: it is only used if it is accepted and still matches the last request sent to the host.
+			 */
+			void set_async_session_message_callback(async_session_message_callback callback);
+
+			/**
+			 * \brief Set the time the asynchronous callbacks have to answer.
+			 * \param timeout The timeout. Default is DEFAULT_DECISION_TIMEOUT.
+			 *
+			 * A message whose callback did not answer in time is ignored: the host will send it again.
+			 */
+			void set_decision_timeout(const boost::posix_time::time_duration& timeout);
+
+			/**
+			 * \brief Get the time the asynchronous callbacks have to answer.
+			 * \return The timeout.
+			 */
+			const boost::posix_time::time_duration& decision_timeout() const;
+
+			/**
+			 * \brief Set the count of incoming messages that may wait for the answer of an asynchronous callback.
+			 * \param size The count of messages. Default is DEFAULT_DECISION_QUEUE_SIZE.
+			 *
+			 * Once the queue is full, the messages that need an asynchronous decision are dropped without calling their callback: the hosts will send them again. A message is also dropped if one of the same type, from the same host, is still waiting.
+			 */
+			void set_decision_queue_size(size_t size);
+
+			/**
+			 * \brief Get the count of incoming messages that may wait for the answer of an asynchronous callback.
+			 * \return The count of messages.
+			 */
+			size_t decision_queue_size() const;
+
+			/**
+			 * \brief Get the count of incoming messages dropped because of the decision queue.
+			 * \return The count of messages.
+			 *
+			 * This method can be called from any thread.
+			 */
+			size_t dropped_decision_count() const;
+
 			/**
 			 * \brief Set the session established callback.
 			 * \param callback The callback.
@@ -334,6 +468,211 @@ namespace fscp
 			 */
 			void set_data_message_callback(data_message_callback callback);
 
+			/**
+			 * \brief Set the channels whose data is only authenticated, not encrypted.
+			 * \param channels The channel mask. Default is 0: all channels are encrypted.
+			 *
+			 * Only use this for channels whose data is already encrypted by an upper layer. A channel is authenticated-only between two hosts if both have it in their mask. The change applies to the sessions negotiated afterwards.
+			 */
+			void set_authenticated_only_channels(channel_mask_type channels);
+
+			/**
+			 * \brief Get the channels whose data is only authenticated, not encrypted.
+			 * \return The channel mask.
+			 */
+			channel_mask_type authenticated_only_channels() const;
+
+			/**
+			 * \brief Set whether the sessions use 64-bit sequence numbers.
+			 * \param enabled true to ask for, and accept, extended sequence numbers. Default is false.
+			 *
+			 * A session uses extended sequence numbers only if both hosts enabled them. Only the low 32 bits of a sequence number are sent: the receiver reconstructs the high bits from the last sequence number it accepted. Such sessions are renewed after EXTENDED_SESSION_LIFESPAN instead of every 2^31 messages. The change applies to the sessions negotiated afterwards.
+			 */
+			void set_extended_sequence_numbers(bool enabled);
+
+			/**
+			 * \brief Check whether the sessions use 64-bit sequence numbers.
+			 * \return true if extended sequence numbers are asked for and accepted.
+			 */
+			bool extended_sequence_numbers() const;
+
+			/**
+			 * \brief Set the size of the replay window.
+			 * \param size The count of sequence numbers, below the highest one received, whose data messages are still accepted once. Default is DEFAULT_REPLAY_WINDOW_SIZE. Cannot exceed session_store::MAX_REPLAY_WINDOW_SIZE.
+			 *
+			 * A window lets reordered messages through, while still rejecting replayed ones. A size of 0 only accepts increasing sequence numbers. The change applies immediately, to all sessions.
+			 */
+			void set_replay_window_size(size_t size);
+
+			/**
+			 * \brief Get the size of the replay window.
+			 * \return The size of the replay window.
+			 */
+			size_t replay_window_size() const;
+
+			/**
+			 * \brief Set the count of threads that check and decipher the incoming data messages.
+			 * \param count The count of threads. Default is 0: the data messages are handled on the thread that receives them.
+			 *
+			 * With one thread or more, the DATA messages are checked and deciphered in parallel, then delivered to the data message callback in the order they were received from each host. The keep-alive and contact messages are checked by the same threads, and handled in turn with the DATA messages. This method must be called before open().
+			 */
+			void set_receive_worker_count(size_t count);
+
+			/**
+			 * \brief Get the count of threads that check and decipher the incoming data messages.
+			 * \return The count of threads.
+			 */
+			size_t receive_worker_count() const;
+
+			/**
+			 * \brief Set the CPUs of the threads that check and decipher the incoming data messages.
+			 * \param cpus The CPUs: one thread is started per entry, and pinned to it. A CPU may appear more than once.
+			 * \see set_receive_worker_count()
+			 *
+			 * The threads allocate the buffers they fill themselves, on the NUMA node of their CPU. This method must be called before open().
+			 */
+			void set_receive_worker_cpus(const std::vector<unsigned int>& cpus);
+
+			/**
+			 * \brief Set the count of incoming data messages that may be in the receive pipeline.
+			 * \param size The count of messages. Default is DEFAULT_RECEIVE_QUEUE_SIZE.
+			 *
+			 * A message stays in the pipeline from the moment it is handed to a receive worker until it is delivered, or rejected, in turn. Once the pipeline is full, the incoming data, keep-alive and contact messages are dropped. Only used when there are receive workers.
+			 */
+			void set_receive_queue_size(size_t size);
+
+			/**
+			 * \brief Get the count of incoming data messages that may be in the receive pipeline.
+			 * \return The count of messages.
+			 */
+			size_t receive_queue_size() const;
+
+			/**
+			 * \brief Get the count of incoming data messages dropped because of the receive pipeline.
+			 * \return The count of messages.
+			 *
+			 * This method can be called from any thread.
+			 */
+			size_t dropped_receive_count() const;
+
+			/**
+			 * \brief Set the count of threads that cipher the data sent to all the hosts.
+			 * \param count The count of threads. Default is 0: the data is ciphered on the thread that sends it, one host after the other.
+			 *
+			 * With one thread or more, async_send_data_to_all() reserves a sequence number for each host, splits the hosts between the threads, and sends all the messages at once when they are ready. This method must be called before open().
+			 */
+			void set_send_worker_count(size_t count);
+
+			/**
+			 * \brief Get the count of threads that cipher the data sent to all the hosts.
+			 * \return The count of threads.
+			 */
+			size_t send_worker_count() const;
+
+			/**
+			 * \brief Set the CPUs of the threads that cipher the data sent to all the hosts.
+			 * \param cpus The CPUs: one thread is started per entry, and pinned to it. A CPU may appear more than once.
+			 * \see set_send_worker_count()
+			 *
+			 * This method must be called before open().
+			 */
+			void set_send_worker_cpus(const std::vector<unsigned int>& cpus);
+
+			/**
+			 * \brief Set the count of threads that run the RSA operations of the handshakes.
+			 * \param count The count of threads. Default is 0: the handshakes are handled on the thread that receives them.
+			 *
+			 * With one thread or more, the SESSION_REQUEST and SESSION messages are verified and deciphered, and the SESSION messages signed, away from the receiving thread, so that the data messages never wait for them. This method must be called before open().
+			 */
+			void set_handshake_worker_count(size_t count);
+
+			/**
+			 * \brief Get the count of threads that run the RSA operations of the handshakes.
+			 * \return The count of threads.
+			 */
+			size_t handshake_worker_count() const;
+
+			/**
+			 * \brief Set the CPUs of the threads that run the RSA operations of the handshakes.
+			 * \param cpus The CPUs: one thread is started per entry, and pinned to it. A CPU may appear more than once.
+			 * \see set_handshake_worker_count()
+			 *
+			 * This method must be called before open().
+			 */
+			void set_handshake_worker_cpus(const std::vector<unsigned int>& cpus);
+
+			/**
+			 * \brief Set the count of incoming handshake messages that may wait for a handshake worker.
+			 * \param size The count of messages. Default is DEFAULT_HANDSHAKE_QUEUE_SIZE.
+			 *
+			 * Once the queue is full, the incoming handshake messages are dropped: the hosts will send them again. A message is also dropped if one of the same type, from the same host, is still waiting. Only used when there are handshake workers.
+			 */
+			void set_handshake_queue_size(size_t size);
+
+			/**
+			 * \brief Get the count of incoming handshake messages that may wait for a handshake worker.
+			 * \return The count of messages.
+			 */
+			size_t handshake_queue_size() const;
+
+			/**
+			 * \brief Get the count of incoming handshake messages dropped because of the handshake queue.
+			 * \return The count of messages.
+			 *
+			 * This method can be called from any thread.
+			 */
+			size_t dropped_handshake_count() const;
+
+			/**
+			 * \brief Set the crypto scheduler.
+			 * \param scheduler The scheduler, that other servers may share. Default is null: the server runs its jobs on its own workers.
+			 *
+			 * With a scheduler, the receive, send and handshake workers of the server are left unused: the same jobs run on the threads of the scheduler instead, the handshake ones first. This method must be called before open().
+			 */
+			void set_crypto_scheduler(boost::shared_ptr<crypto_scheduler> scheduler);
+
+			/**
+			 * \brief Set whether the sessions are requested with the ECDHE handshake.
+			 * \param enabled true to send ECDHE_SESSION_REQUEST messages instead of SESSION_REQUEST messages. Default is false.
+			 *
+			 * ECDHE session requests are always answered, whatever the value of this setting. If the library was built without ECDHE support, enabling it throws a std::runtime_error.
+			 */
+			void set_ecdhe_handshake(bool enabled);
+
+			/**
+			 * \brief Check whether the sessions are requested with the ECDHE handshake.
+			 * \return true if the sessions are requested with the ECDHE handshake.
+			 */
+			bool ecdhe_handshake() const;
+
+			/**
+			 * \brief Set the lifetime of the session resumption tickets.
+			 * \param lifetime The lifetime. Default is zero: no ticket is issued.
+			 *
+			 * Each session negotiated with a SESSION or ECDHE_SESSION message yields a ticket that lets the host who received the session keys request the next session with one symmetric round trip. A resumed session yields a new ticket that expires at the same date as the original one. The change applies to the tickets issued afterwards.
+			 */
+			void set_resumption_ticket_lifetime(const boost::posix_time::time_duration& lifetime);
+
+			/**
+			 * \brief Get the lifetime of the session resumption tickets.
+			 * \return The lifetime.
+			 */
+			boost::posix_time::time_duration resumption_ticket_lifetime() const;
+
+			/**
+			 * \brief Set when the next local session is prepared.
+			 * \param threshold The fraction of the session lifespan after which the next session is prepared in the background. Default is 0.75. A value of 0 disables the preparation.
+			 *
+			 * Once a session gets old, the prepared SESSION message is sent as is, instead of being generated and ciphered on the receive path.
+			 */
+			void set_session_pregeneration_threshold(double threshold);
+
+			/**
+			 * \brief Get when the next local session is prepared.
+			 * \return The fraction of the session lifespan after which the next session is prepared.
+			 */
+			double session_pregeneration_threshold() const;
+
 			/**
 			 * \brief Set the contact request callback.
 			 * \param callback The callback.
@@ -352,6 +691,42 @@ namespace fscp
 			 */
 			void set_network_error_callback(network_error_callback callback);
 
+			/**
+			 * \brief Set the executor that runs the callbacks.
+			 * \param executor The executor. An empty executor runs the callbacks on the receiving thread, which is the default.
+			 * \param queue_size The count of data message callbacks that may wait for the executor. Cannot be 0.
+			 * \param policy What to do with a data message callback once queue_size of them are waiting. Default is callback_queue::OVERFLOW_DROP.
+			 *
+			 * Only the callbacks that return nothing are given to the executor: the data message, session established, session lost, contact and network error callbacks. They are still run in order, one at a time, and the data message callback gets a copy of the data. The threads of the executor can be pinned with set_current_thread_cpu(). This method must be called before open().
+			 *
+			 * With callback_queue::OVERFLOW_BLOCK, the server never waits: it stops reading from its socket until the executor makes room in the queue, and lets the socket buffer absorb the traffic meanwhile. The messages that were already received are still delivered, so the queue may briefly hold more than queue_size callbacks.
+			 */
+			void set_callback_executor(callback_executor_type executor, size_t queue_size = DEFAULT_CALLBACK_QUEUE_SIZE, callback_queue::overflow_policy policy = callback_queue::OVERFLOW_DROP);
+
+			/**
+			 * \brief Get the count of data message callbacks dropped because the callback queue was full.
+			 * \return The count of callbacks.
+			 *
+			 * This method can be called from any thread.
+			 */
+			size_t dropped_callback_count() const;
+
+			/**
+			 * \brief Get the count of data message callbacks replaced by newer ones because the callback queue was full.
+			 * \return The count of callbacks.
+			 *
+			 * This method can be called from any thread.
+			 */
+			size_t coalesced_callback_count() const;
+
+			/**
+			 * \brief Get the count of data message callbacks queued while the callback queue was full, with callback_queue::OVERFLOW_BLOCK.
+			 * \return The count of callbacks.
+			 *
+			 * This method can be called from any thread.
+			 */
+			size_t blocked_callback_count() const;
+
 			/**
 			 * \brief Check if a session is established with the specified host.
 			 * \param host The host.
@@ -415,80 +790,340 @@ namespace fscp
 
 		private: // Generic network stuff
 
+			void do_close();
 			void async_receive();
 			void handle_receive_from(const boost::system::error_code&, size_t);
+			void resume_receive();
+
+			/**
+			 * \brief Spread the endpoints between the shards of the snapshot maps.
+			 */
+			struct endpoint_hash
+			{
+				size_t operator()(const ep_type&) const;
+			};
 
 			void* m_data;
+			boost::asio::io_service::strand m_strand;
 			boost::asio::ip::udp::socket m_socket;
 			boost::array<uint8_t, 65536> m_recv_buffer;
 			boost::array<uint8_t, 65536> m_send_buffer;
 			ep_type m_sender_endpoint;
 			identity_store m_identity_store;
+			bool m_receiving;
+			bool m_receive_paused;
 
 		private: // HELLO messages
 
 			void do_greet(const ep_type& target, hello_request::callback_type callback, const boost::posix_time::time_duration& timeout);
-			void handle_hello_message_from(const hello_message&, const ep_type&);
+			void handle_hello_message_from(const hello_message&, const ep_type&, bool = false);
 
 			hello_request_list m_hello_request_list;
 			uint32_t m_hello_current_unique_number;
 			bool m_accept_hello_messages_default;
 			hello_message_callback m_hello_message_callback;
+			async_hello_message_callback m_async_hello_message_callback;
 
 		private: // PRESENTATION messages
 
 			typedef std::map<ep_type, presentation_store> presentation_store_map;
 
 			void do_introduce_to(const ep_type&);
-			void handle_presentation_message_from(const presentation_message&, const ep_type&);
+			void handle_presentation_message_from(const presentation_message&, const ep_type&, bool = false);
+			void do_set_presentation(const ep_type&, const presentation_store&);
+			void do_clear_presentation(const ep_type&);
+			void set_presentation_snapshot(const ep_type&, const presentation_store*);
 
 			presentation_message_callback m_presentation_message_callback;
+			async_presentation_message_callback m_async_presentation_message_callback;
 			presentation_store_map m_presentation_map;
 
+			/**
+			 * \brief A copy of the presentation map, for the callers outside of the strand.
+			 */
+			typedef snapshot_map<ep_type, presentation_store, endpoint_hash> presentation_snapshot_map;
+
+			presentation_snapshot_map m_presentation_snapshot;
+
 		private: // SESSION_REQUEST messages
 
 			typedef std::map<ep_type, session_pair> session_pair_map;
 
 			void do_request_session(const ep_type&);
 			void handle_session_request_message_from(const session_request_message&, const ep_type&);
-			void handle_clear_session_request_message_from(const clear_session_request_message&, const ep_type&);
+			void handle_clear_session_request_message_from(const clear_session_request_message&, const ep_type&, bool = false);
 
 			session_pair_map m_session_map;
 			bool m_accept_session_request_messages_default;
 			session_request_message_callback m_session_request_message_callback;
+			async_session_request_message_callback m_async_session_request_message_callback;
+
+		private: // ECDHE_SESSION_REQUEST and ECDHE_SESSION messages
+
+			void do_request_ecdhe_session(const ep_type&);
+			void handle_ecdhe_session_request_message_from(const ecdhe_session_message&, const ep_type&, bool = false);
+			void do_send_ecdhe_session(const ep_type&, session_store::session_number_type, const ecdhe::key_type&);
+			void handle_ecdhe_session_message_from(const ecdhe_session_message&, const ep_type&, bool = false);
+
+			bool m_ecdhe_handshake;
+
+		private: // RESUME_SESSION_REQUEST and RESUME_SESSION messages
+
+			typedef std::map<hash_type, resumption_ticket> outgoing_ticket_map;
+			typedef std::map<resumption_ticket::ticket_id_type, resumption_ticket> incoming_ticket_map;
+
+			bool do_request_resumed_session(const ep_type&);
+			void handle_resume_session_request_message_from(const resume_session_message&, const ep_type&, bool = false);
+			void do_send_resumed_session(const ep_type&, session_store::session_number_type, const resumption_ticket&);
+			void handle_resume_session_message_from(const resume_session_message&, const ep_type&, bool = false);
+			void issue_resumption_ticket(const ep_type&, const session_store&, bool);
+			void add_incoming_ticket(const resumption_ticket&);
+			void add_outgoing_ticket(const resumption_ticket&);
+
+			boost::posix_time::time_duration m_resumption_ticket_lifetime;
+			outgoing_ticket_map m_outgoing_ticket_map;
+			incoming_ticket_map m_incoming_ticket_map;
 
 		private: // SESSION messages
 
 			void do_send_session(const ep_type&, session_store::session_number_type);
+			session_flags_type get_session_flags(const session_pair&) const;
+			session_flags_type get_requested_session_flags() const;
 			void handle_session_message_from(const session_message&, const ep_type&);
-			void handle_clear_session_message_from(const clear_session_message&, const ep_type&);
+			void handle_clear_session_message_from(const clear_session_message&, const ep_type&, bool = false);
 			void session_established(const ep_type&);
 			void session_lost(const ep_type&);
 			void do_close_session(const ep_type&);
 
+			/**
+			 * \brief A SESSION message prepared ahead of time.
+			 */
+			struct prepared_session
+			{
+				prepared_session(const session_store& _session, const challenge_type& _challenge, const hash_type& _peer_certificate_hash, channel_mask_type _authenticated_channels, session_flags_type _session_flags) :
+					session(_session),
+					challenge(_challenge),
+					peer_certificate_hash(_peer_certificate_hash),
+					authenticated_channels(_authenticated_channels),
+					session_flags(_session_flags)
+				{
+				}
+
+				session_store session;
+				challenge_type challenge;
+				hash_type peer_certificate_hash;
+				channel_mask_type authenticated_channels;
+				session_flags_type session_flags;
+				std::vector<uint8_t> message;
+			};
+
+			typedef std::map<ep_type, boost::shared_ptr<prepared_session> > prepared_session_map;
+
+			void do_prepare_session(const ep_type&);
+			void prepare_session(const ep_type&, boost::shared_ptr<prepared_session>, cryptoplus::pkey::pkey, cryptoplus::pkey::pkey);
+			void handle_prepared_session(const ep_type&, boost::shared_ptr<prepared_session>);
+			bool do_send_prepared_session(const ep_type&);
+
+			double m_session_pregeneration_threshold;
+			prepared_session_map m_prepared_session_map;
+			background_worker m_session_pregeneration_worker;
+
 			bool m_accept_session_messages_default;
 			session_message_callback m_session_message_callback;
+			async_session_message_callback m_async_session_message_callback;
 			session_established_callback m_session_established_callback;
 			session_lost_callback m_session_lost_callback;
 
+			/**
+			 * \brief The hosts with which a session is established, for the callers outside of the strand.
+			 *
+			 * Only the keys matter: the values are always true.
+			 */
+			snapshot_map<ep_type, bool, endpoint_hash> m_session_endpoints;
+
 		private: // DATA messages
 
 			typedef std::map<ep_type, data_store> data_store_map;
 
+			struct data_submission
+			{
+				ep_type target;
+				channel_number_type channel_number;
+				data_store::pointer_data_type data;
+			};
+
+			typedef submission_queue<data_submission, 4096> data_submission_queue;
+
+			void do_drain_data_submissions();
 			void do_send_data(const ep_type&, channel_number_type);
 			void handle_data_message_from(const data_message&, const ep_type&);
+			void do_send_data_to_all(channel_number_type, data_store::pointer_data_type);
+			void deliver_data_message(const data_message&, const ep_type&, session_pair&, session_store&, extended_sequence_number_type, uint8_t*, size_t);
 
 			boost::array<uint8_t, 65536> m_data_buffer;
+			std::vector<uint8_t> m_batch_send_buffer;
 			data_store_map m_data_map;
+			boost::mutex m_data_map_mutex;
+			data_submission_queue m_data_submission_queue;
+			boost::atomic<bool> m_data_submission_drain_pending;
 			data_message_callback m_data_message_callback;
+			channel_mask_type m_authenticated_only_channels;
+			bool m_extended_sequence_numbers;
+			size_t m_replay_window_size;
+
+		private: // Handshake pool
+
+			/**
+			 * \brief An incoming handshake message being opened by a handshake worker.
+			 */
+			struct handshake_job
+			{
+				ep_type sender;
+				message_type type;
+				std::vector<uint8_t> message;
+				size_t pkey_size;
+				cryptoplus::pkey::pkey signature_key;
+				cryptoplus::pkey::pkey encryption_key;
+				hash_type digest;
+				bool signature_verified;
+				std::vector<uint8_t> cleartext;
+				bool succeeded;
+			};
+
+			typedef std::pair<ep_type, message_type> pending_handshake_type;
+
+			void dispatch_handshake_message(const message&, const hash_type&, const ep_type&);
+			void open_handshake_message(boost::shared_ptr<handshake_job>);
+			void handle_opened_handshake_message(boost::shared_ptr<handshake_job>);
+			void write_session_message(const ep_type&, std::vector<uint8_t>, cryptoplus::pkey::pkey, cryptoplus::pkey::pkey);
+			void handle_written_session_message(const ep_type&, const std::vector<uint8_t>&);
+
+			std::vector<boost::shared_ptr<background_worker> > m_handshake_workers;
+			size_t m_next_handshake_worker;
+			size_t m_handshake_queue_size;
+			std::set<pending_handshake_type> m_pending_handshakes;
+			boost::atomic<size_t> m_dropped_handshake_count;
+
+		private: // Fan-out
+
+			/**
+			 * \brief A data message to cipher for one of the hosts of a fan-out.
+			 */
+			struct fanout_message
+			{
+				fanout_message(const ep_type& _target, const session_store& _session, extended_sequence_number_type _sequence_number, bool _authenticated_only) :
+					target(_target),
+					session(_session),
+					sequence_number(_sequence_number),
+					authenticated_only(_authenticated_only)
+				{
+				}
+
+				ep_type target;
+				session_store session;
+				extended_sequence_number_type sequence_number;
+				bool authenticated_only;
+				std::vector<uint8_t> buffer;
+			};
+
+			/**
+			 * \brief The same data, sent to several hosts.
+			 */
+			struct fanout
+			{
+				fanout(channel_number_type _channel_number, data_store::pointer_data_type _data) :
+					channel_number(_channel_number),
+					data(_data),
+					pending_slices(0)
+				{
+				}
+
+				channel_number_type channel_number;
+				data_store::pointer_data_type data;
+				std::vector<fanout_message> messages;
+				boost::atomic<size_t> pending_slices;
+			};
+
+			void cipher_fanout(boost::shared_ptr<fanout>, size_t, size_t);
+			void handle_ciphered_fanout(boost::shared_ptr<fanout>);
+
+			std::vector<boost::shared_ptr<background_worker> > m_send_workers;
+
+		private: // Receive pipeline
+
+			struct receive_order;
+
+			/**
+			 * \brief A data message being checked and deciphered by a receive worker.
+			 */
+			struct receive_job
+			{
+				ep_type sender;
+				boost::shared_ptr<receive_order> order;
+				uint64_t ticket;
+				/**
+				 * \brief A session the message may belong to.
+				 */
+				struct candidate_session
+				{
+					boost::shared_ptr<const session_keys> keys;
+					extended_sequence_number_type sequence_number;
+				};
+
+				std::vector<uint8_t> message;
+				boost::array<candidate_session, 2> sessions;
+				size_t session_count;
+				size_t session_index;
+				std::vector<uint8_t> cleartext;
+				size_t cleartext_size;
+			};
+
+			/**
+			 * \brief The delivery order of the data messages of a host.
+			 */
+			struct receive_order
+			{
+				receive_order() : next_ticket(0), next_delivery(0) {}
+
+				uint64_t next_ticket;
+				uint64_t next_delivery;
+				std::map<uint64_t, boost::shared_ptr<receive_job> > completed_jobs;
+			};
+
+			typedef std::map<ep_type, boost::shared_ptr<receive_order> > receive_order_map;
+
+			void dispatch_data_message(const data_message&, const ep_type&);
+			void check_data_message(boost::shared_ptr<receive_job>);
+			void handle_checked_data_message(boost::shared_ptr<receive_job>);
+
+			std::vector<boost::shared_ptr<background_worker> > m_receive_workers;
+			size_t m_next_receive_worker;
+			receive_order_map m_receive_order_map;
+			size_t m_receive_queue_size;
+			size_t m_receive_job_count;
+			boost::atomic<size_t> m_dropped_receive_count;
+
+		private: // Crypto scheduler
+
+			typedef std::vector<boost::shared_ptr<background_worker> > worker_pool_type;
+
+			bool has_crypto_workers(const worker_pool_type&) const;
+			size_t crypto_worker_count(const worker_pool_type&) const;
+			void post_crypto_job(worker_pool_type&, size_t&, crypto_scheduler::priority_type, background_worker::task_type);
+
+			// Destroyed before the worker pools: this waits for the jobs of the server that are still running.
+			boost::scoped_ptr<crypto_scheduler::client> m_crypto_scheduler_client;
 
 		private: // CONTACT_REQUEST messages
 
 			typedef std::map<ep_type, hash_list_type> hash_list_map;
 
 			bool has_session(const hash_type&) const;
+			void do_request_contact(const ep_type&, cert_type);
+			void do_request_contact_from_all(cert_type);
 			void do_send_contact_request(const ep_type&);
 
+			boost::array<hash_type, 65536 / hash_type::static_size> m_hash_list_buffer;
 			hash_list_map m_hash_list_map;
 			std::map<hash_type, cert_type> m_hash_to_cert;
 			contact_request_message_callback m_contact_request_message_callback;
@@ -511,6 +1146,44 @@ namespace fscp
 			ep_type to_socket_format(const ep_type&);
 			template <typename ConstBufferSequence>
 			std::size_t send_to(const ConstBufferSequence&, const ep_type&);
+
+		private: // Asynchronous decisions
+
+			/**
+			 * \brief A message waiting for the answer of an asynchronous callback.
+			 */
+			typedef std::pair<ep_type, message_type> pending_decision_key_type;
+
+			struct pending_decision
+			{
+				pending_decision_key_type key;
+				boost::function<void ()> on_accept;
+				boost::shared_ptr<boost::asio::deadline_timer> timer;
+			};
+
+			typedef std::map<uint64_t, pending_decision> pending_decision_map;
+
+			decision_handler make_decision(const ep_type&, message_type, boost::function<void ()>);
+			void clear_pending_decisions();
+			void post_decision(uint64_t, bool);
+			void handle_decision(uint64_t, bool);
+			void handle_decision_timeout(uint64_t, const boost::system::error_code&);
+			void replay_message(const std::vector<uint8_t>&, const ep_type&);
+			void replay_clear_session_request_message(const std::vector<uint8_t>&, const ep_type&);
+			void replay_clear_session_message(const std::vector<uint8_t>&, const ep_type&);
+
+			boost::posix_time::time_duration m_decision_timeout;
+			uint64_t m_next_decision_id;
+			pending_decision_map m_pending_decisions;
+			std::set<pending_decision_key_type> m_pending_decision_keys;
+			size_t m_decision_queue_size;
+			boost::atomic<size_t> m_dropped_decision_count;
+
+		private: // Callback executor
+
+			void run_callback(callback_queue::task_type);
+
+			boost::shared_ptr<callback_queue> m_callback_queue;
 	};
 
 	inline bool server::is_open() const
@@ -555,11 +1228,21 @@ namespace fscp
 		m_hello_message_callback = callback;
 	}
 
+	inline void server::set_async_hello_message_callback(async_hello_message_callback callback)
+	{
+		m_async_hello_message_callback = callback;
+	}
+
 	inline void server::set_presentation_message_callback(presentation_message_callback callback)
 	{
 		m_presentation_message_callback = callback;
 	}
 
+	inline void server::set_async_presentation_message_callback(async_presentation_message_callback callback)
+	{
+		m_async_presentation_message_callback = callback;
+	}
+
 	inline void server::set_accept_session_request_messages_default(bool value)
 	{
 		m_accept_session_request_messages_default = value;
@@ -570,6 +1253,11 @@ namespace fscp
 		m_session_request_message_callback = callback;
 	}
 
+	inline void server::set_async_session_request_message_callback(async_session_request_message_callback callback)
+	{
+		m_async_session_request_message_callback = callback;
+	}
+
 	inline void server::set_accept_session_messages_default(bool value)
 	{
 		m_accept_session_messages_default = value;
@@ -580,6 +1268,36 @@ namespace fscp
 		m_session_message_callback = callback;
 	}
 
+	inline void server::set_async_session_message_callback(async_session_message_callback callback)
+	{
+		m_async_session_message_callback = callback;
+	}
+
+	inline void server::set_decision_timeout(const boost::posix_time::time_duration& timeout)
+	{
+		m_decision_timeout = timeout;
+	}
+
+	inline const boost::posix_time::time_duration& server::decision_timeout() const
+	{
+		return m_decision_timeout;
+	}
+
+	inline void server::set_decision_queue_size(size_t size)
+	{
+		m_decision_queue_size = size;
+	}
+
+	inline size_t server::decision_queue_size() const
+	{
+		return m_decision_queue_size;
+	}
+
+	inline size_t server::dropped_decision_count() const
+	{
+		return m_dropped_decision_count;
+	}
+
 	inline void server::set_session_established_callback(session_established_callback callback)
 	{
 		m_session_established_callback = callback;
@@ -590,6 +1308,136 @@ namespace fscp
 		m_session_lost_callback = callback;
 	}
 
+	inline void server::set_authenticated_only_channels(channel_mask_type channels)
+	{
+		m_authenticated_only_channels = channels;
+	}
+
+	inline channel_mask_type server::authenticated_only_channels() const
+	{
+		return m_authenticated_only_channels;
+	}
+
+	inline void server::set_extended_sequence_numbers(bool enabled)
+	{
+		m_extended_sequence_numbers = enabled;
+	}
+
+	inline bool server::extended_sequence_numbers() const
+	{
+		return m_extended_sequence_numbers;
+	}
+
+	inline void server::set_replay_window_size(size_t size)
+	{
+		if (size > session_store::MAX_REPLAY_WINDOW_SIZE)
+		{
+			throw std::runtime_error("replay window too large");
+		}
+
+		m_replay_window_size = size;
+	}
+
+	inline size_t server::replay_window_size() const
+	{
+		return m_replay_window_size;
+	}
+
+	inline size_t server::receive_worker_count() const
+	{
+		return m_receive_workers.size();
+	}
+
+	inline void server::set_receive_queue_size(size_t size)
+	{
+		m_receive_queue_size = size;
+	}
+
+	inline size_t server::receive_queue_size() const
+	{
+		return m_receive_queue_size;
+	}
+
+	inline size_t server::dropped_receive_count() const
+	{
+		return m_dropped_receive_count;
+	}
+
+	inline size_t server::send_worker_count() const
+	{
+		return m_send_workers.size();
+	}
+
+	inline size_t server::handshake_worker_count() const
+	{
+		return m_handshake_workers.size();
+	}
+
+	inline void server::set_handshake_queue_size(size_t size)
+	{
+		m_handshake_queue_size = size;
+	}
+
+	inline size_t server::handshake_queue_size() const
+	{
+		return m_handshake_queue_size;
+	}
+
+	inline size_t server::dropped_handshake_count() const
+	{
+		return m_dropped_handshake_count;
+	}
+
+	inline size_t server::dropped_callback_count() const
+	{
+		return m_callback_queue ? m_callback_queue->dropped_count() : 0;
+	}
+
+	inline size_t server::coalesced_callback_count() const
+	{
+		return m_callback_queue ? m_callback_queue->coalesced_count() : 0;
+	}
+
+	inline size_t server::blocked_callback_count() const
+	{
+		return m_callback_queue ? m_callback_queue->blocked_count() : 0;
+	}
+
+	inline void server::set_ecdhe_handshake(bool enabled)
+	{
+		if (enabled && !ecdhe::is_supported())
+		{
+			throw std::runtime_error("ECDHE handshake not supported");
+		}
+
+		m_ecdhe_handshake = enabled;
+	}
+
+	inline bool server::ecdhe_handshake() const
+	{
+		return m_ecdhe_handshake;
+	}
+
+	inline void server::set_resumption_ticket_lifetime(const boost::posix_time::time_duration& lifetime)
+	{
+		m_resumption_ticket_lifetime = lifetime;
+	}
+
+	inline boost::posix_time::time_duration server::resumption_ticket_lifetime() const
+	{
+		return m_resumption_ticket_lifetime;
+	}
+
+	inline void server::set_session_pregeneration_threshold(double threshold)
+	{
+		m_session_pregeneration_threshold = threshold;
+	}
+
+	inline double server::session_pregeneration_threshold() const
+	{
+		return m_session_pregeneration_threshold;
+	}
+
 	inline void server::set_data_message_callback(data_message_callback callback)
 	{
 		m_data_message_callback = callback;
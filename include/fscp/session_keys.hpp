@@ -0,0 +1,159 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+
+/**
+ * \file session_keys.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief The keys of a session.
+ */
+
+#ifndef FSCP_SESSION_KEYS_HPP
+#define FSCP_SESSION_KEYS_HPP
+
+#include "constants.hpp"
+#include "context_pool.hpp"
+#include "data_message.hpp"
+
+#include <boost/array.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <stdint.h>
+
+namespace fscp
+{
+	/**
+	 * \brief The keys of a session, and the cryptographic contexts built from them.
+	 *
+	 * The keys never change: the copies of a session share them. The cipher and HMAC contexts are created the first time a thread needs them, then kept for the next messages of the session. The keys are wiped and the contexts freed when the last copy of the session is destroyed.
+	 */
+	class session_keys : public boost::noncopyable
+	{
+		public:
+
+			/**
+			 * \brief The key length.
+			 */
+			static const size_t KEY_LENGTH = 32;
+
+			/**
+			 * \brief Create the keys of a session.
+			 * \param session_number The session number.
+			 * \param seal_key The seal key.
+			 * \param seal_key_len The seal key length. Must be KEY_LENGTH.
+			 * \param enc_key The encryption key.
+			 * \param enc_key_len The encryption key length. Must be KEY_LENGTH.
+			 */
+			session_keys(session_number_type session_number, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+
+			/**
+			 * \brief Wipe the keys.
+			 */
+			~session_keys();
+
+			/**
+			 * \brief Get the session number.
+			 * \return The session number.
+			 */
+			session_number_type session_number() const;
+
+			/**
+			 * \brief Get the seal key.
+			 * \return The seal key.
+			 */
+			const uint8_t* seal_key() const;
+
+			/**
+			 * \brief Get the seal key size.
+			 * \return The seal key size.
+			 */
+			size_t seal_key_size() const;
+
+			/**
+			 * \brief Get the encryption key.
+			 * \return The encryption key.
+			 */
+			const uint8_t* encryption_key() const;
+
+			/**
+			 * \brief Get the encryption key size.
+			 * \return The encryption key size.
+			 */
+			size_t encryption_key_size() const;
+
+		private:
+
+			typedef boost::array<uint8_t, KEY_LENGTH> key_type;
+
+			const session_number_type m_session_number;
+			key_type m_seal_key;
+			key_type m_enc_key;
+
+			// The contexts are not part of the keys: they are used from const sessions.
+			mutable context_pool<data_message::message_writer<default_cipher_suite> > m_writers;
+			mutable context_pool<data_message::message_reader<default_cipher_suite> > m_readers;
+
+			friend class data_message;
+	};
+
+	inline session_number_type session_keys::session_number() const
+	{
+		return m_session_number;
+	}
+
+	inline const uint8_t* session_keys::seal_key() const
+	{
+		return m_seal_key.data();
+	}
+
+	inline size_t session_keys::seal_key_size() const
+	{
+		return m_seal_key.size();
+	}
+
+	inline const uint8_t* session_keys::encryption_key() const
+	{
+		return m_enc_key.data();
+	}
+
+	inline size_t session_keys::encryption_key_size() const
+	{
+		return m_enc_key.size();
+	}
+}
+
+#endif /* FSCP_SESSION_KEYS_HPP */
@@ -46,10 +46,14 @@
 #define FSCP_SESSION_PAIR_HPP
 
 #include "session_store.hpp"
+#include "ecdhe.hpp"
+#include "resumption_ticket.hpp"
 
 #include <boost/optional.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <vector>
+
 namespace fscp
 {
 	/**
@@ -90,6 +94,19 @@ namespace fscp
 			 */
 			const session_store& local_session() const;
 
+			/**
+			 * \brief Check if the session_pair has a previous local session that is still in its grace period.
+			 * \return true if the data messages of the previous local session are still accepted.
+			 */
+			bool has_previous_local_session() const;
+
+			/**
+			 * \brief Get the previous local session.
+			 * \return The previous local session.
+			 * \warning If has_previous_local_session() is false, the behavior is undefined.
+			 */
+			session_store& previous_local_session();
+
 			/**
 			 * \brief Get the remote session.
 			 * \return The remote session.
@@ -111,6 +128,19 @@ namespace fscp
 			 */
 			bool renew_local_session(session_store::session_number_type session_number);
 
+			/**
+			 * \brief Get the number of the next local session.
+			 * \param session_number The requested session number.
+			 * \return The session number to use for a new local session.
+			 */
+			session_store::session_number_type next_local_session_number(session_store::session_number_type session_number) const;
+
+			/**
+			 * \brief Set the local session.
+			 * \param session The local session.
+			 */
+			void set_local_session(const session_store& session);
+
 			/**
 			 * \brief Set the remote session.
 			 * \param session The remote session.
@@ -167,17 +197,146 @@ namespace fscp
 				m_remote_challenge = challenge;
 			}
 
+			/**
+			 * \brief Get the session flags the remote host asked for in its last session request.
+			 * \return The session flags.
+			 */
+			session_flags_type remote_session_flags() const
+			{
+				return m_remote_session_flags;
+			}
+
+			/**
+			 * \brief Set the session flags the remote host asked for in its last session request.
+			 * \param session_flags The session flags.
+			 */
+			void set_remote_session_flags(session_flags_type session_flags)
+			{
+				m_remote_session_flags = session_flags;
+			}
+
+			/**
+			 * \brief Check if the session_pair has a pending ephemeral key.
+			 * \return true if an ECDHE session request is pending.
+			 */
+			bool has_local_ephemeral_key() const;
+
+			/**
+			 * \brief Get the pending ephemeral key.
+			 * \return The pending ephemeral key.
+			 * \warning If has_local_ephemeral_key() is false, the behavior is undefined.
+			 */
+			const ecdhe::ephemeral_key& local_ephemeral_key() const;
+
+			/**
+			 * \brief Get the session number of the pending ECDHE session request.
+			 * \return The session number the request asks for.
+			 * \warning If has_local_ephemeral_key() is false, the behavior is undefined.
+			 */
+			session_store::session_number_type local_ephemeral_key_session_number() const;
+
+			/**
+			 * \brief Generate a new ephemeral key for an ECDHE session request.
+			 * \param session_number The session number the request asks for.
+			 * \return The ephemeral key.
+			 */
+			const ecdhe::ephemeral_key& generate_local_ephemeral_key(session_store::session_number_type session_number);
+
+			/**
+			 * \brief Destroy the pending ephemeral key.
+			 */
+			void clear_local_ephemeral_key();
+
+			/**
+			 * \brief Check if the session_pair has a pending resumption ticket.
+			 * \return true if a RESUME_SESSION_REQUEST is pending.
+			 */
+			bool has_pending_resumption_ticket() const;
+
+			/**
+			 * \brief Get the pending resumption ticket.
+			 * \return The pending resumption ticket.
+			 * \warning If has_pending_resumption_ticket() is false, the behavior is undefined.
+			 */
+			const resumption_ticket& pending_resumption_ticket() const;
+
+			/**
+			 * \brief Set the pending resumption ticket.
+			 * \param ticket The ticket used by the last RESUME_SESSION_REQUEST.
+			 */
+			void set_pending_resumption_ticket(const resumption_ticket& ticket);
+
+			/**
+			 * \brief Destroy the pending resumption ticket.
+			 */
+			void clear_pending_resumption_ticket();
+
+			/**
+			 * \brief Check if an ECDHE session request was answered.
+			 * \return true if an ECDHE_SESSION message was sent for the current remote session.
+			 */
+			bool has_ecdhe_session_answer() const;
+
+			/**
+			 * \brief Get the session number of the last answered ECDHE session request.
+			 * \return The session number that the request asked for.
+			 * \warning If has_ecdhe_session_answer() is false, the behavior is undefined.
+			 */
+			session_store::session_number_type ecdhe_session_answer_session_number() const;
+
+			/**
+			 * \brief Check if an ECDHE session request is the one that was answered last.
+			 * \param session_number The session number that the request asks for.
+			 * \param challenge The challenge of the request.
+			 * \param public_key The ephemeral public key of the request.
+			 * \return true if has_ecdhe_session_answer() is true and the request matches the answered one.
+			 */
+			bool is_ecdhe_session_answer_for(session_store::session_number_type session_number, const challenge_type& challenge, const ecdhe::key_type& public_key) const;
+
+			/**
+			 * \brief Get the ECDHE_SESSION message sent in answer to the last ECDHE session request.
+			 * \return The message.
+			 * \warning If has_ecdhe_session_answer() is false, the behavior is undefined.
+			 */
+			const std::vector<uint8_t>& ecdhe_session_answer() const;
+
+			/**
+			 * \brief Set the answer to an ECDHE session request.
+			 * \param session_number The session number that the request asked for.
+			 * \param challenge The challenge of the request.
+			 * \param public_key The ephemeral public key of the request.
+			 * \param answer The ECDHE_SESSION message sent in answer.
+			 * \param answer_len The length of answer.
+			 *
+			 * The answer is forgotten when the remote session is cleared.
+			 */
+			void set_ecdhe_session_answer(session_store::session_number_type session_number, const challenge_type& challenge, const ecdhe::key_type& public_key, const void* answer, size_t answer_len);
+
 		private:
 
+			void retire_local_session();
+
 			boost::optional<session_store> m_local_session;
+			boost::optional<session_store> m_previous_local_session;
+			boost::posix_time::ptime m_previous_local_session_end;
 			boost::optional<session_store> m_remote_session;
 			boost::posix_time::ptime m_last_sign_of_life;
 			challenge_type m_local_challenge;
 			challenge_type m_remote_challenge;
+			session_flags_type m_remote_session_flags;
+			boost::optional<ecdhe::ephemeral_key> m_local_ephemeral_key;
+			session_store::session_number_type m_local_ephemeral_key_session_number;
+			boost::optional<resumption_ticket> m_pending_resumption_ticket;
+			boost::optional<session_store::session_number_type> m_ecdhe_session_answer_session_number;
+			challenge_type m_ecdhe_session_answer_challenge;
+			ecdhe::key_type m_ecdhe_session_answer_public_key;
+			std::vector<uint8_t> m_ecdhe_session_answer;
 	};
 
 	inline session_pair::session_pair() :
-		m_last_sign_of_life(boost::posix_time::microsec_clock::local_time())
+		m_last_sign_of_life(boost::posix_time::microsec_clock::local_time()),
+		m_remote_session_flags(0),
+		m_local_ephemeral_key_session_number(0)
 	{
 	}
 
@@ -201,6 +360,16 @@ namespace fscp
 		return *m_local_session;
 	}
 
+	inline bool session_pair::has_previous_local_session() const
+	{
+		return m_previous_local_session && (boost::posix_time::microsec_clock::local_time() <= m_previous_local_session_end);
+	}
+
+	inline session_store& session_pair::previous_local_session()
+	{
+		return *m_previous_local_session;
+	}
+
 	inline session_store& session_pair::remote_session()
 	{
 		return *m_remote_session;
@@ -216,6 +385,8 @@ namespace fscp
 		bool cleared = has_remote_session();
 
 		m_remote_session.reset();
+		m_ecdhe_session_answer_session_number.reset();
+		m_ecdhe_session_answer.clear();
 
 		return cleared;
 	}
@@ -229,6 +400,77 @@ namespace fscp
 	{
 		m_last_sign_of_life = boost::posix_time::microsec_clock::local_time();
 	}
+
+	inline bool session_pair::has_local_ephemeral_key() const
+	{
+		return static_cast<bool>(m_local_ephemeral_key);
+	}
+
+	inline const ecdhe::ephemeral_key& session_pair::local_ephemeral_key() const
+	{
+		return *m_local_ephemeral_key;
+	}
+
+	inline session_store::session_number_type session_pair::local_ephemeral_key_session_number() const
+	{
+		return m_local_ephemeral_key_session_number;
+	}
+
+	inline void session_pair::clear_local_ephemeral_key()
+	{
+		m_local_ephemeral_key.reset();
+	}
+
+	inline bool session_pair::has_pending_resumption_ticket() const
+	{
+		return static_cast<bool>(m_pending_resumption_ticket);
+	}
+
+	inline const resumption_ticket& session_pair::pending_resumption_ticket() const
+	{
+		return *m_pending_resumption_ticket;
+	}
+
+	inline void session_pair::set_pending_resumption_ticket(const resumption_ticket& ticket)
+	{
+		m_pending_resumption_ticket = ticket;
+	}
+
+	inline void session_pair::clear_pending_resumption_ticket()
+	{
+		m_pending_resumption_ticket.reset();
+	}
+
+	inline bool session_pair::has_ecdhe_session_answer() const
+	{
+		return static_cast<bool>(m_ecdhe_session_answer_session_number);
+	}
+
+	inline session_store::session_number_type session_pair::ecdhe_session_answer_session_number() const
+	{
+		return *m_ecdhe_session_answer_session_number;
+	}
+
+	inline bool session_pair::is_ecdhe_session_answer_for(session_store::session_number_type session_number, const challenge_type& challenge, const ecdhe::key_type& public_key) const
+	{
+		return has_ecdhe_session_answer() &&
+		       (session_number == ecdhe_session_answer_session_number()) &&
+		       (challenge == m_ecdhe_session_answer_challenge) &&
+		       (public_key == m_ecdhe_session_answer_public_key);
+	}
+
+	inline const std::vector<uint8_t>& session_pair::ecdhe_session_answer() const
+	{
+		return m_ecdhe_session_answer;
+	}
+
+	inline void session_pair::set_ecdhe_session_answer(session_store::session_number_type session_number, const challenge_type& challenge, const ecdhe::key_type& public_key, const void* answer, size_t answer_len)
+	{
+		m_ecdhe_session_answer_session_number = session_number;
+		m_ecdhe_session_answer_challenge = challenge;
+		m_ecdhe_session_answer_public_key = public_key;
+		m_ecdhe_session_answer.assign(static_cast<const uint8_t*>(answer), static_cast<const uint8_t*>(answer) + answer_len);
+	}
 }
 
 #endif /* FSCP_SESSION_PAIR_HPP */
@@ -75,6 +75,7 @@ namespace fscp
 			 */
 			session_request_message(const message& message, size_t pkey_size);
 
+			using session_message::digest;
 			using session_message::ciphertext;
 			using session_message::ciphertext_size;
 			using session_message::ciphertext_signature;
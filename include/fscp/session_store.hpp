@@ -46,8 +46,11 @@
 #define FSCP_SESSION_STORE_HPP
 
 #include "constants.hpp"
+#include "session_keys.hpp"
 
 #include <boost/array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <stdint.h>
 
@@ -68,7 +71,12 @@ namespace fscp
 			/**
 			 * \brief The key length.
 			 */
-			static const size_t KEY_LENGTH = 32;
+			static const size_t KEY_LENGTH = session_keys::KEY_LENGTH;
+
+			/**
+			 * \brief The maximum size of the replay window.
+			 */
+			static const size_t MAX_REPLAY_WINDOW_SIZE = 1024;
 
 			/**
 			 * \brief Create a new random session store.
@@ -92,6 +100,12 @@ namespace fscp
 			 */
 			session_number_type session_number() const;
 
+			/**
+			 * \brief Get the keys.
+			 * \return The keys, shared with the copies of the session.
+			 */
+			const boost::shared_ptr<const session_keys>& keys() const;
+
 			/**
 			 * \brief Get the seal key.
 			 * \return The seal key.
@@ -120,13 +134,38 @@ namespace fscp
 			 * \brief Get the sequence number.
 			 * \return The sequence number.
 			 */
-			sequence_number_type sequence_number() const;
+			extended_sequence_number_type sequence_number() const;
 
 			/**
 			 * \brief Set the sequence number.
 			 * \param sequence_number The new sequence number.
+			 *
+			 * The replay window is cleared.
+			 */
+			void set_sequence_number(extended_sequence_number_type sequence_number);
+
+			/**
+			 * \brief Check if a received sequence number can be accepted.
+			 * \param sequence_number The extended sequence number of the received message.
+			 * \param replay_window_size The count of sequence numbers, below the highest one received, that are still accepted if they were not received yet. Cannot exceed MAX_REPLAY_WINDOW_SIZE. 0 only accepts increasing sequence numbers.
+			 * \return true if sequence_number is higher than the highest received sequence number, or inside the replay window and not received yet.
+			 */
+			bool can_accept_sequence_number(extended_sequence_number_type sequence_number, size_t replay_window_size) const;
+
+			/**
+			 * \brief Record a received sequence number.
+			 * \param sequence_number The extended sequence number of the received message. Should have been checked with can_accept_sequence_number() first.
+			 *
+			 * If sequence_number is higher than the highest received sequence number, it becomes the new sequence number and the replay window slides.
 			 */
-			void set_sequence_number(sequence_number_type sequence_number);
+			void accept_sequence_number(extended_sequence_number_type sequence_number);
+
+			/**
+			 * \brief Reconstruct the extended sequence number of a received message.
+			 * \param sequence_number The sequence number of the message, as sent on the wire.
+			 * \return The extended sequence number closest to the current sequence number. If extended sequence numbers are not used, sequence_number is returned as is.
+			 */
+			extended_sequence_number_type extend_sequence_number(sequence_number_type sequence_number) const;
 
 			/**
 			 * \brief Increment the sequence number by a certain amount.
@@ -137,66 +176,130 @@ namespace fscp
 			/**
 			 * \brief Check if the session is old.
 			 * \return true if the function is old.
+			 *
+			 * A session that uses extended sequence numbers gets old after EXTENDED_SESSION_LIFESPAN instead of after 2^31 messages.
 			 */
 			bool is_old() const;
 
-		private:
+			/**
+			 * \brief Get how much of the session lifespan was used.
+			 * \return The ratio between the sequence number and the sequence number after which the session is old.
+			 */
+			double lifespan_usage() const;
+
+			/**
+			 * \brief Get the channels whose data is only authenticated, not encrypted.
+			 * \return The channel mask.
+			 */
+			channel_mask_type authenticated_channels() const;
+
+			/**
+			 * \brief Set the channels whose data is only authenticated, not encrypted.
+			 * \param channels The channel mask.
+			 */
+			void set_authenticated_channels(channel_mask_type channels);
 
 			/**
-			 * \brief The key type.
+			 * \brief Check if the session uses extended sequence numbers.
+			 * \return true if the session uses extended sequence numbers.
 			 */
-			typedef boost::array<uint8_t, KEY_LENGTH> key_type;
+			bool extended_sequence_numbers() const;
 
-			session_number_type m_session_number;
-			key_type m_seal_key;
-			key_type m_enc_key;
-			sequence_number_type m_sequence_number;
+			/**
+			 * \brief Set whether the session uses extended sequence numbers.
+			 * \param enabled true to use 64-bit sequence numbers.
+			 */
+			void set_extended_sequence_numbers(bool enabled);
+
+		private:
+
+			/**
+			 * \brief The replay bitmap type.
+			 *
+			 * It is a ring of words: the extra word lets the window span a partial word on each end.
+			 */
+			typedef boost::array<uint32_t, MAX_REPLAY_WINDOW_SIZE / 32 + 1> replay_bitmap_type;
+
+			boost::shared_ptr<const session_keys> m_keys;
+			extended_sequence_number_type m_sequence_number;
+			channel_mask_type m_authenticated_channels;
+			bool m_extended_sequence_numbers;
+			boost::posix_time::ptime m_creation_date;
+			replay_bitmap_type m_replay_bitmap;
 	};
 
 	inline session_store::session_number_type session_store::session_number() const
 	{
-		return m_session_number;
+		return m_keys->session_number();
+	}
+
+	inline const boost::shared_ptr<const session_keys>& session_store::keys() const
+	{
+		return m_keys;
 	}
 
 	inline const uint8_t* session_store::seal_key() const
 	{
-		return m_seal_key.data();
+		return m_keys->seal_key();
 	}
 
 	inline size_t session_store::seal_key_size() const
 	{
-		return m_seal_key.size();
+		return m_keys->seal_key_size();
 	}
 
 	inline const uint8_t* session_store::encryption_key() const
 	{
-		return m_enc_key.data();
+		return m_keys->encryption_key();
 	}
 
 	inline size_t session_store::encryption_key_size() const
 	{
-		return m_enc_key.size();
+		return m_keys->encryption_key_size();
 	}
 
-	inline sequence_number_type session_store::sequence_number() const
+	inline extended_sequence_number_type session_store::sequence_number() const
 	{
 		return m_sequence_number;
 	}
 
-	inline void session_store::set_sequence_number(sequence_number_type _sequence_number)
+	inline void session_store::set_sequence_number(extended_sequence_number_type _sequence_number)
 	{
 		m_sequence_number = _sequence_number;
+		m_replay_bitmap.assign(0);
 	}
 
 	inline void session_store::increment_sequence_number(size_t cnt)
 	{
-		if (m_sequence_number + cnt < m_sequence_number)
+		const extended_sequence_number_type max_sequence_number = m_extended_sequence_numbers ? static_cast<extended_sequence_number_type>(-1) : static_cast<sequence_number_type>(-1);
+
+		if (max_sequence_number - m_sequence_number < cnt)
 		{
 			throw std::runtime_error("sequence_number overflow");
 		}
 
 		m_sequence_number += cnt;
 	}
+
+	inline channel_mask_type session_store::authenticated_channels() const
+	{
+		return m_authenticated_channels;
+	}
+
+	inline void session_store::set_authenticated_channels(channel_mask_type channels)
+	{
+		m_authenticated_channels = channels;
+	}
+
+	inline bool session_store::extended_sequence_numbers() const
+	{
+		return m_extended_sequence_numbers;
+	}
+
+	inline void session_store::set_extended_sequence_numbers(bool enabled)
+	{
+		m_extended_sequence_numbers = enabled;
+	}
 }
 
 #endif /* FSCP_SESSION_STORE_HPP */
@@ -0,0 +1,229 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file snapshot_map.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A sharded map whose readers never wait for the writers.
+ */
+
+#ifndef FSCP_SNAPSHOT_MAP_HPP
+#define FSCP_SNAPSHOT_MAP_HPP
+
+#include <boost/array.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+
+namespace fscp
+{
+	/**
+	 * \brief A sharded map whose readers never wait for the writers.
+	 *
+	 * Each shard is an immutable map, replaced as a whole on every write: readers grab the current version of a shard with boost::atomic_load(), and keep it alive for as long as they use it. The last reader of an old version frees it. Writers on the same shard are serialized, writers on different shards are not.
+	 *
+	 * Reads are not lock-free: boost::atomic_load() and boost::atomic_store() on a boost::shared_ptr take a spinlock from a pool shared by the whole process, for the time it takes to copy the pointer. A reader never waits for a writer to copy its shard, but it may briefly contend with the other readers and writers that hash to the same spinlock.
+	 */
+	template <typename Key, typename Value, typename Hash, size_t ShardCount = 16>
+	class snapshot_map : public boost::noncopyable
+	{
+		public:
+
+			/**
+			 * \brief The map type of a shard.
+			 */
+			typedef std::map<Key, Value> map_type;
+
+			/**
+			 * \brief A version of a shard.
+			 */
+			typedef boost::shared_ptr<const map_type> snapshot_type;
+
+			/**
+			 * \brief The count of shards.
+			 */
+			static const size_t shard_count = ShardCount;
+
+			/**
+			 * \brief Create an empty map.
+			 */
+			snapshot_map();
+
+			/**
+			 * \brief Get the current version of a shard.
+			 * \param index The index of the shard. Must be lower than shard_count.
+			 * \return The current version of the shard.
+			 *
+			 * Only the copy of the pointer to the version is done under a spinlock: the version itself can then be read without any lock.
+			 */
+			snapshot_type shard(size_t index) const;
+
+			/**
+			 * \brief Get the current version of the shard of a key.
+			 * \param key The key.
+			 * \return The current version of the shard that holds key, if it is present.
+			 */
+			snapshot_type shard_of(const Key& key) const;
+
+			/**
+			 * \brief Check if a key is present.
+			 * \param key The key.
+			 * \return true if key is present.
+			 */
+			bool contains(const Key& key) const;
+
+			/**
+			 * \brief Copy all the keys.
+			 * \param out The output iterator to copy the keys to.
+			 * \return The output iterator past the last copied key.
+			 *
+			 * The shards are read one after the other: a write that happens meanwhile may or may not be seen.
+			 */
+			template <typename OutputIterator>
+			OutputIterator copy_keys(OutputIterator out) const;
+
+			/**
+			 * \brief Set the value of a key.
+			 * \param key The key.
+			 * \param value The value.
+			 *
+			 * The shard is copied under its write mutex, and the new version published under a spinlock: the readers only contend with the publication.
+			 */
+			void set(const Key& key, const Value& value);
+
+			/**
+			 * \brief Erase a key.
+			 * \param key The key.
+			 */
+			void erase(const Key& key);
+
+		private:
+
+			size_t shard_index(const Key&) const;
+
+			boost::array<snapshot_type, ShardCount> m_shards;
+			boost::array<boost::mutex, ShardCount> m_write_mutexes;
+	};
+
+	template <typename Key, typename Value, typename Hash, size_t ShardCount>
+	inline snapshot_map<Key, Value, Hash, ShardCount>::snapshot_map()
+	{
+		for (size_t i = 0; i < ShardCount; ++i)
+		{
+			m_shards[i] = boost::make_shared<const map_type>();
+		}
+	}
+
+	template <typename Key, typename Value, typename Hash, size_t ShardCount>
+	inline typename snapshot_map<Key, Value, Hash, ShardCount>::snapshot_type snapshot_map<Key, Value, Hash, ShardCount>::shard(size_t index) const
+	{
+		return boost::atomic_load(&m_shards[index]);
+	}
+
+	template <typename Key, typename Value, typename Hash, size_t ShardCount>
+	inline typename snapshot_map<Key, Value, Hash, ShardCount>::snapshot_type snapshot_map<Key, Value, Hash, ShardCount>::shard_of(const Key& key) const
+	{
+		return shard(shard_index(key));
+	}
+
+	template <typename Key, typename Value, typename Hash, size_t ShardCount>
+	inline bool snapshot_map<Key, Value, Hash, ShardCount>::contains(const Key& key) const
+	{
+		return (shard_of(key)->count(key) > 0);
+	}
+
+	template <typename Key, typename Value, typename Hash, size_t ShardCount>
+	template <typename OutputIterator>
+	inline OutputIterator snapshot_map<Key, Value, Hash, ShardCount>::copy_keys(OutputIterator out) const
+	{
+		for (size_t i = 0; i < ShardCount; ++i)
+		{
+			const snapshot_type snapshot = shard(i);
+
+			for (typename map_type::const_iterator it = snapshot->begin(); it != snapshot->end(); ++it)
+			{
+				*out++ = it->first;
+			}
+		}
+
+		return out;
+	}
+
+	template <typename Key, typename Value, typename Hash, size_t ShardCount>
+	inline void snapshot_map<Key, Value, Hash, ShardCount>::set(const Key& key, const Value& value)
+	{
+		const size_t index = shard_index(key);
+
+		boost::mutex::scoped_lock lock(m_write_mutexes[index]);
+
+		boost::shared_ptr<map_type> version = boost::make_shared<map_type>(*shard(index));
+
+		(*version)[key] = value;
+
+		boost::atomic_store(&m_shards[index], snapshot_type(version));
+	}
+
+	template <typename Key, typename Value, typename Hash, size_t ShardCount>
+	inline void snapshot_map<Key, Value, Hash, ShardCount>::erase(const Key& key)
+	{
+		const size_t index = shard_index(key);
+
+		boost::mutex::scoped_lock lock(m_write_mutexes[index]);
+
+		const snapshot_type current = shard(index);
+
+		if (current->count(key) > 0)
+		{
+			boost::shared_ptr<map_type> version = boost::make_shared<map_type>(*current);
+
+			version->erase(key);
+
+			boost::atomic_store(&m_shards[index], snapshot_type(version));
+		}
+	}
+
+	template <typename Key, typename Value, typename Hash, size_t ShardCount>
+	inline size_t snapshot_map<Key, Value, Hash, ShardCount>::shard_index(const Key& key) const
+	{
+		return Hash()(key) % ShardCount;
+	}
+}
+
+#endif /* FSCP_SNAPSHOT_MAP_HPP */
@@ -0,0 +1,189 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file submission_queue.hpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A lock-free multiple producers, single consumer queue.
+ */
+
+#ifndef FSCP_SUBMISSION_QUEUE_HPP
+#define FSCP_SUBMISSION_QUEUE_HPP
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/static_assert.hpp>
+
+#include <cstddef>
+
+namespace fscp
+{
+	/**
+	 * \brief A bounded, lock-free, multiple producers and single consumer queue.
+	 *
+	 * Each cell carries a sequence number that tells whether it is free for the producers or ready for the consumer: producers only compete for the enqueue position, and the consumer never writes to it.
+	 */
+	template <typename T, size_t Capacity>
+	class submission_queue : public boost::noncopyable
+	{
+		BOOST_STATIC_ASSERT((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0));
+
+		public:
+
+			/**
+			 * \brief The value type.
+			 */
+			typedef T value_type;
+
+			/**
+			 * \brief Create an empty queue.
+			 */
+			submission_queue();
+
+			/**
+			 * \brief Queue a value.
+			 * \param value The value.
+			 * \return false if the queue is full.
+			 *
+			 * This method can be called from any thread.
+			 */
+			bool push(const value_type& value);
+
+			/**
+			 * \brief Dequeue a value.
+			 * \param value The value. Only set if the call succeeds.
+			 * \return false if the queue is empty.
+			 *
+			 * Only one thread at a time can call this method.
+			 */
+			bool pop(value_type& value);
+
+		private:
+
+			struct cell
+			{
+				boost::atomic<size_t> sequence;
+				value_type value;
+			};
+
+			/**
+			 * \brief The size of a cache line, to keep the producers and the consumer positions apart.
+			 */
+			static const size_t CACHE_LINE_SIZE = 64;
+
+			boost::scoped_array<cell> m_cells;
+			char m_padding0[CACHE_LINE_SIZE];
+			boost::atomic<size_t> m_enqueue_position;
+			char m_padding1[CACHE_LINE_SIZE];
+			size_t m_dequeue_position;
+	};
+
+	template <typename T, size_t Capacity>
+	inline submission_queue<T, Capacity>::submission_queue() :
+		m_cells(new cell[Capacity]),
+		m_enqueue_position(0),
+		m_dequeue_position(0)
+	{
+		for (size_t i = 0; i < Capacity; ++i)
+		{
+			m_cells[i].sequence.store(i, boost::memory_order_relaxed);
+		}
+	}
+
+	template <typename T, size_t Capacity>
+	inline bool submission_queue<T, Capacity>::push(const value_type& value)
+	{
+		size_t position = m_enqueue_position.load(boost::memory_order_relaxed);
+		cell* _cell = NULL;
+
+		for (;;)
+		{
+			_cell = &m_cells[position & (Capacity - 1)];
+
+			const size_t sequence = _cell->sequence.load(boost::memory_order_acquire);
+			const ptrdiff_t difference = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(position);
+
+			if (difference == 0)
+			{
+				// The cell is free: claim it.
+				if (m_enqueue_position.compare_exchange_weak(position, position + 1, boost::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (difference < 0)
+			{
+				// The consumer did not release the cell yet: the queue is full.
+				return false;
+			}
+			else
+			{
+				// Another producer claimed the cell.
+				position = m_enqueue_position.load(boost::memory_order_relaxed);
+			}
+		}
+
+		_cell->value = value;
+		_cell->sequence.store(position + 1, boost::memory_order_release);
+
+		return true;
+	}
+
+	template <typename T, size_t Capacity>
+	inline bool submission_queue<T, Capacity>::pop(value_type& value)
+	{
+		cell& _cell = m_cells[m_dequeue_position & (Capacity - 1)];
+
+		if (_cell.sequence.load(boost::memory_order_acquire) != m_dequeue_position + 1)
+		{
+			return false;
+		}
+
+		value = _cell.value;
+
+		// The cell must not keep the resources of the value alive.
+		_cell.value = value_type();
+		_cell.sequence.store(m_dequeue_position + Capacity, boost::memory_order_release);
+
+		++m_dequeue_position;
+
+		return true;
+	}
+}
+
+#endif /* FSCP_SUBMISSION_QUEUE_HPP */
@@ -0,0 +1,374 @@
+/**
+ * \file benchmark.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A data path micro-benchmark.
+ */
+
+#include <fscp/fscp.hpp>
+#include <fscp/data_message.hpp>
+#include <fscp/data_path.hpp>
+#include <fscp/session_store.hpp>
+
+#include <cryptoplus/cryptoplus.hpp>
+#include <cryptoplus/error/error_strings.hpp>
+#include <cryptoplus/cipher/cipher_context.hpp>
+#include <cryptoplus/hash/hmac.hpp>
+#include <cryptoplus/random/random.hpp>
+
+#include <boost/array.hpp>
+
+#include <openssl/crypto.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+namespace
+{
+	/**
+	 * \brief The count of heap allocations done so far, by the C++ code and by OpenSSL.
+	 */
+	size_t allocation_count = 0;
+
+	void* counting_malloc(size_t size, const char*, int)
+	{
+		++allocation_count;
+
+		return std::malloc(size);
+	}
+
+	void* counting_realloc(void* ptr, size_t size, const char*, int)
+	{
+		++allocation_count;
+
+		return std::realloc(ptr, size);
+	}
+
+	void counting_free(void* ptr, const char*, int)
+	{
+		std::free(ptr);
+	}
+}
+
+void* operator new(std::size_t size)
+{
+	++allocation_count;
+
+	void* result = std::malloc(size ? size : 1);
+
+	if (!result)
+	{
+		throw std::bad_alloc();
+	}
+
+	return result;
+}
+
+void operator delete(void* ptr) throw ()
+{
+	std::free(ptr);
+}
+
+namespace
+{
+	const size_t ITERATIONS = 100000;
+
+	const size_t KEY_LENGTH = 32;
+
+	/**
+	 * \brief The count of sessions the allocation check cycles through, like a host that talks to many peers.
+	 */
+	const size_t SESSION_COUNT = 32;
+
+	/**
+	 * \brief Gives access to the two-pass reference implementation.
+	 */
+	class reference_data_message : public fscp::data_message
+	{
+		public:
+
+			/**
+			 * \brief Write a data message by ciphering the whole cleartext first, then sealing the whole ciphertext.
+			 *
+			 * This is how data messages were written before the stitched implementation.
+			 */
+			static size_t two_pass_write(void* buf, size_t buf_len, fscp::session_number_type session_number, fscp::sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+			{
+				const cryptoplus::cipher::cipher_algorithm cipher_algorithm(fscp::CIPHER_ALGORITHM);
+				const cryptoplus::hash::message_digest_algorithm message_digest_algorithm(fscp::MESSAGE_DIGEST_ALGORITHM);
+
+				const size_t hmac_size = message_digest_algorithm.result_size();
+
+				uint8_t* const payload = static_cast<uint8_t*>(buf) + HEADER_LENGTH;
+				const size_t payload_len = buf_len - HEADER_LENGTH;
+				uint8_t* const ciphertext = payload + sizeof(fscp::sequence_number_type);
+				const size_t ciphertext_len = payload_len - sizeof(fscp::sequence_number_type);
+
+				const std::vector<uint8_t> iv = compute_initialization_vector<uint8_t>(session_number, sequence_number, enc_key, enc_key_len);
+
+				cryptoplus::cipher::cipher_context cipher_context;
+				cipher_context.initialize(cipher_algorithm, cryptoplus::cipher::cipher_context::encrypt, enc_key, enc_key_len, &iv[0], iv.size());
+				cipher_context.set_padding(false);
+
+				const cryptoplus::buffer padded_cleartext = cipher_context.get_iso_10126_padded_buffer(cleartext, cleartext_len);
+
+				size_t cnt = cipher_context.update(ciphertext, ciphertext_len, padded_cleartext);
+				cnt += cipher_context.finalize(ciphertext + cnt, ciphertext_len - cnt);
+
+				fscp::buffer_tools::set<fscp::sequence_number_type>(payload, 0, htonl(sequence_number));
+
+				const size_t length = sizeof(fscp::sequence_number_type) + cnt + hmac_size / 2;
+
+				cryptoplus::hash::hmac(ciphertext + cnt, hmac_size, seal_key, seal_key_len, payload, length - hmac_size / 2, message_digest_algorithm);
+
+				return message::write(buf, buf_len, fscp::CURRENT_PROTOCOL_VERSION, fscp::MESSAGE_TYPE_DATA_0, length) + length;
+			}
+	};
+
+	struct keys
+	{
+		boost::array<uint8_t, KEY_LENGTH> seal_key;
+		boost::array<uint8_t, KEY_LENGTH> enc_key;
+	};
+
+	double nanoseconds_per_iteration(const boost::posix_time::ptime& start)
+	{
+		const boost::posix_time::time_duration duration = boost::posix_time::microsec_clock::universal_time() - start;
+
+		return static_cast<double>(duration.total_microseconds()) * 1000.0 / ITERATIONS;
+	}
+
+	void report(const std::string& name, size_t size, double reference, double candidate)
+	{
+		std::cout
+		    << std::setw(8) << name
+		    << std::setw(8) << size << " B"
+		    << std::setw(12) << std::fixed << std::setprecision(1) << reference << " ns"
+		    << std::setw(12) << candidate << " ns"
+		    << std::setw(10) << std::setprecision(1) << (reference / candidate - 1.0) * 100.0 << " %"
+		    << std::endl;
+	}
+
+	void check_cleartext(const boost::array<uint8_t, 65536>& cleartext, size_t cnt, const std::vector<uint8_t>& expected)
+	{
+		if ((cnt != expected.size()) || (std::memcmp(cleartext.data(), &expected[0], cnt) != 0))
+		{
+			throw std::runtime_error("cleartext mismatch");
+		}
+	}
+
+	/**
+	 * \brief Run every step of the data path once.
+	 */
+	void run_data_path(size_t size, const fscp::session_keys& session, fscp::sequence_number_type sequence_number)
+	{
+		static boost::array<uint8_t, 65536> message_buffer;
+		static boost::array<uint8_t, 65536> cleartext_buffer;
+		static boost::array<uint8_t, 65536> cleartext;
+		static boost::array<fscp::hash_type, 16> hash_list;
+
+		size_t message_size = fscp::data_message::write(message_buffer.data(), message_buffer.size(), fscp::CHANNEL_NUMBER_0, sequence_number, cleartext.data(), size, session);
+		fscp::data_message data_message(message_buffer.data(), message_size);
+		data_message.check_seal_and_get_cleartext(cleartext_buffer.data(), cleartext_buffer.size(), session);
+
+		message_size = fscp::data_message::write_authenticated(message_buffer.data(), message_buffer.size(), fscp::CHANNEL_NUMBER_0, sequence_number, cleartext.data(), size, session);
+		fscp::data_message authenticated_message(message_buffer.data(), message_size);
+		authenticated_message.check_seal(session, 0);
+
+		message_size = fscp::data_message::write_keep_alive(message_buffer.data(), message_buffer.size(), sequence_number, size, session);
+		fscp::data_message keep_alive_message(message_buffer.data(), message_size);
+		keep_alive_message.check_seal_and_get_cleartext(cleartext_buffer.data(), cleartext_buffer.size(), session);
+		keep_alive_message.check_seal(session, 0);
+
+		fscp::data_message::parse_hash_list(cleartext.data(), hash_list.size() * fscp::hash_type::static_size, hash_list.c_array(), hash_list.size());
+	}
+
+	/**
+	 * \brief Make sure the data path does not allocate anything on the heap, in the C++ code or in OpenSSL.
+	 */
+	void check_allocations(size_t size, const std::vector<fscp::session_store>& sessions)
+	{
+		// The first run creates the random pool of the thread and the cryptographic contexts of every session.
+		for (size_t i = 0; i < sessions.size(); ++i)
+		{
+			run_data_path(size, *sessions[i].keys(), 0);
+		}
+
+		const size_t before = allocation_count;
+
+		// The sessions are used in turn, like when sending to every peer: each of them must keep its contexts.
+		for (size_t i = 0; i < sessions.size(); ++i)
+		{
+			run_data_path(size, *sessions[i].keys(), 1);
+		}
+
+		const size_t after = allocation_count;
+
+		if (after != before)
+		{
+			std::cerr << (after - before) << " heap allocation(s) on the data path for " << size << " B and " << sessions.size() << " sessions" << std::endl;
+
+			throw std::runtime_error("the data path allocates");
+		}
+	}
+
+	void run(size_t size, const keys& k)
+	{
+		static boost::array<uint8_t, 65536> message_buffer;
+		static boost::array<uint8_t, 65536> cleartext_buffer;
+
+		const fscp::session_number_type session_number = 42;
+		const fscp::session_keys session(session_number, k.seal_key.data(), k.seal_key.size(), k.enc_key.data(), k.enc_key.size());
+		std::vector<uint8_t> cleartext(size);
+		cryptoplus::random::get_random_bytes(&cleartext[0], cleartext.size());
+
+		// Both implementations must produce messages the other one can read.
+		size_t message_size = reference_data_message::two_pass_write(message_buffer.data(), message_buffer.size(), session_number, 1, &cleartext[0], cleartext.size(), k.seal_key.data(), k.seal_key.size(), k.enc_key.data(), k.enc_key.size());
+		check_cleartext(cleartext_buffer, fscp::data_message(message_buffer.data(), message_size).check_seal_and_get_cleartext(cleartext_buffer.data(), cleartext_buffer.size(), session), cleartext);
+
+		message_size = fscp::data_message::write(message_buffer.data(), message_buffer.size(), fscp::CHANNEL_NUMBER_0, 1, &cleartext[0], cleartext.size(), session);
+		const fscp::data_message data_message(message_buffer.data(), message_size);
+		data_message.check_seal(cleartext_buffer.data(), cleartext_buffer.size(), k.seal_key.data(), k.seal_key.size());
+		check_cleartext(cleartext_buffer, data_message.get_cleartext(cleartext_buffer.data(), cleartext_buffer.size(), session_number, k.enc_key.data(), k.enc_key.size()), cleartext);
+
+		// Write
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+		for (size_t i = 0; i < ITERATIONS; ++i)
+		{
+			reference_data_message::two_pass_write(message_buffer.data(), message_buffer.size(), session_number, i, &cleartext[0], cleartext.size(), k.seal_key.data(), k.seal_key.size(), k.enc_key.data(), k.enc_key.size());
+		}
+
+		const double two_pass_write = nanoseconds_per_iteration(start);
+
+		start = boost::posix_time::microsec_clock::universal_time();
+
+		for (size_t i = 0; i < ITERATIONS; ++i)
+		{
+			fscp::data_message::write(message_buffer.data(), message_buffer.size(), fscp::CHANNEL_NUMBER_0, i, &cleartext[0], cleartext.size(), session);
+		}
+
+		const double stitched_write = nanoseconds_per_iteration(start);
+
+		report("write", size, two_pass_write, stitched_write);
+
+		// Authenticated-only, compared to the encrypted stitched write
+		start = boost::posix_time::microsec_clock::universal_time();
+
+		for (size_t i = 0; i < ITERATIONS; ++i)
+		{
+			fscp::data_message::write_authenticated(message_buffer.data(), message_buffer.size(), fscp::CHANNEL_NUMBER_0, i, &cleartext[0], cleartext.size(), session);
+		}
+
+		report("auth", size, stitched_write, nanoseconds_per_iteration(start));
+
+		// Read
+		start = boost::posix_time::microsec_clock::universal_time();
+
+		for (size_t i = 0; i < ITERATIONS; ++i)
+		{
+			data_message.check_seal(cleartext_buffer.data(), cleartext_buffer.size(), k.seal_key.data(), k.seal_key.size());
+			data_message.get_cleartext(cleartext_buffer.data(), cleartext_buffer.size(), session_number, k.enc_key.data(), k.enc_key.size());
+		}
+
+		const double two_pass_read = nanoseconds_per_iteration(start);
+
+		start = boost::posix_time::microsec_clock::universal_time();
+
+		for (size_t i = 0; i < ITERATIONS; ++i)
+		{
+			data_message.check_seal_and_get_cleartext(cleartext_buffer.data(), cleartext_buffer.size(), session);
+		}
+
+		const double stitched_read = nanoseconds_per_iteration(start);
+
+		report("read", size, two_pass_read, stitched_read);
+
+		// Batch writes, compared to one stitched call per message
+		static boost::array<uint8_t, fscp::data_message::MAX_BATCH_SIZE * 2048> batch_buffer;
+
+		const size_t slot_size = batch_buffer.size() / fscp::data_message::MAX_BATCH_SIZE;
+
+		fscp::data_message::write_operation write_operations[fscp::data_message::MAX_BATCH_SIZE];
+
+		for (size_t j = 0; j < fscp::data_message::MAX_BATCH_SIZE; ++j)
+		{
+			write_operations[j].buf = &batch_buffer[j * slot_size];
+			write_operations[j].buf_len = slot_size;
+			write_operations[j].channel_number = fscp::CHANNEL_NUMBER_0;
+			write_operations[j].sequence_number = static_cast<fscp::sequence_number_type>(j);
+			write_operations[j].cleartext = &cleartext[0];
+			write_operations[j].cleartext_len = cleartext.size();
+			write_operations[j].authenticated_only = false;
+		}
+
+		start = boost::posix_time::microsec_clock::universal_time();
+
+		for (size_t i = 0; i < ITERATIONS; i += fscp::data_message::MAX_BATCH_SIZE)
+		{
+			fscp::data_message::write_batch(write_operations, fscp::data_message::MAX_BATCH_SIZE, session);
+		}
+
+		report("bwrite", size, stitched_write, nanoseconds_per_iteration(start));
+	}
+}
+
+int main()
+{
+	// Must come before anything allocates through OpenSSL.
+	if (!CRYPTO_set_mem_functions(&counting_malloc, &counting_realloc, &counting_free))
+	{
+		std::cerr << "Error: unable to count the OpenSSL allocations" << std::endl;
+
+		return EXIT_FAILURE;
+	}
+
+	cryptoplus::crypto_initializer crypto_initializer;
+	cryptoplus::algorithms_initializer algorithms_initializer;
+	cryptoplus::error::error_strings_initializer error_strings_initializer;
+
+	try
+	{
+		keys k;
+		cryptoplus::random::get_random_bytes(k.seal_key.data(), k.seal_key.size());
+		cryptoplus::random::get_random_bytes(k.enc_key.data(), k.enc_key.size());
+
+		const fscp::data_path_report& report = fscp::select_data_path_kernel();
+
+		std::cout << "AES-NI: " << report.features.aes_ni << ", PCLMUL: " << report.features.pclmul << ", SHA-NI: " << report.features.sha_ni << ", AVX2: " << report.features.avx2 << ", AVX-512: " << report.features.avx512 << std::endl;
+		std::cout << "Data path kernel: " << fscp::to_string(report.kernel) << " (stitched: " << report.stitched_duration << " ns, two-pass: " << report.two_pass_duration << " ns)" << std::endl;
+
+		std::cout << std::setw(8) << "path" << std::setw(10) << "size" << std::setw(15) << "reference" << std::setw(15) << "candidate" << std::setw(12) << "gain" << std::endl;
+
+		std::vector<fscp::session_store> sessions;
+
+		for (size_t i = 0; i < SESSION_COUNT; ++i)
+		{
+			sessions.push_back(fscp::session_store(static_cast<fscp::session_number_type>(i)));
+		}
+
+		const size_t sizes[] = { 64, 512, 1400 };
+
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		{
+			check_allocations(sizes[i], sessions);
+		}
+
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		{
+			run(sizes[i], k);
+		}
+	}
+	catch (std::exception& ex)
+	{
+		std::cerr << "Error: " << ex.what() << std::endl;
+
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file background_worker.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A background worker class.
+ */
+
+#include "background_worker.hpp"
+
+#include "cpu_affinity.hpp"
+
+#include <boost/bind.hpp>
+
+namespace fscp
+{
+	background_worker::background_worker() :
+		m_stopping(false)
+	{
+	}
+
+	background_worker::background_worker(unsigned int cpu) :
+		m_stopping(false),
+		m_cpu(cpu)
+	{
+	}
+
+	background_worker::~background_worker()
+	{
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+
+			m_stopping = true;
+			m_tasks.clear();
+		}
+
+		m_condition.notify_one();
+
+		if (m_thread)
+		{
+			m_thread->join();
+		}
+	}
+
+	void background_worker::post(task_type task)
+	{
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+
+			m_tasks.push_back(task);
+
+			if (!m_thread)
+			{
+				m_thread.reset(new boost::thread(boost::bind(&background_worker::run, this)));
+			}
+		}
+
+		m_condition.notify_one();
+	}
+
+	void background_worker::run()
+	{
+		// Pinned first, so that everything the tasks allocate lands on the NUMA node of the CPU.
+		if (m_cpu)
+		{
+			set_current_thread_cpu(*m_cpu);
+		}
+
+		for (;;)
+		{
+			task_type task;
+
+			{
+				boost::mutex::scoped_lock lock(m_mutex);
+
+				while (m_tasks.empty() && !m_stopping)
+				{
+					m_condition.wait(lock);
+				}
+
+				if (m_stopping)
+				{
+					return;
+				}
+
+				task.swap(m_tasks.front());
+				m_tasks.pop_front();
+			}
+
+			task();
+		}
+	}
+}
@@ -0,0 +1,256 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file callback_queue.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A bounded queue of callbacks, run by an executor.
+ */
+
+#include "callback_queue.hpp"
+
+#include <boost/bind.hpp>
+
+namespace fscp
+{
+	callback_queue::callback_queue(executor_type executor, size_t capacity, overflow_policy policy, task_type room_handler) :
+		m_executor(executor),
+		m_capacity(capacity),
+		m_policy(policy),
+		m_room_handler(room_handler),
+		m_bounded_count(0),
+		m_running(false),
+		m_full(false),
+		m_dropped_count(0),
+		m_coalesced_count(0),
+		m_blocked_count(0)
+	{
+	}
+
+	void callback_queue::post(task_type task)
+	{
+		push(entry(task, false, key_type()));
+	}
+
+	bool callback_queue::post(task_type task, const key_type& key)
+	{
+		return push(entry(task, true, key));
+	}
+
+	size_t callback_queue::dropped_count() const
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		return m_dropped_count;
+	}
+
+	size_t callback_queue::coalesced_count() const
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		return m_coalesced_count;
+	}
+
+	size_t callback_queue::blocked_count() const
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		return m_blocked_count;
+	}
+
+	void callback_queue::detach_room_handler()
+	{
+		boost::mutex::scoped_lock lock(m_room_handler_mutex);
+
+		m_room_handler.clear();
+	}
+
+	bool callback_queue::push(const entry& _entry)
+	{
+		bool start = false;
+		bool has_room = true;
+
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+
+			if (_entry.bounded && (m_bounded_count >= m_capacity))
+			{
+				switch (m_policy)
+				{
+					case OVERFLOW_DROP:
+						{
+							++m_dropped_count;
+
+							return true;
+						}
+					case OVERFLOW_COALESCE:
+						{
+							for (std::deque<entry>::reverse_iterator it = m_entries.rbegin(); it != m_entries.rend(); ++it)
+							{
+								if (it->bounded && (it->key == _entry.key))
+								{
+									it->task = _entry.task;
+									++m_coalesced_count;
+
+									return true;
+								}
+							}
+
+							++m_dropped_count;
+
+							return true;
+						}
+					case OVERFLOW_BLOCK:
+						{
+							// Waiting here could deadlock the caller: the callback is kept, and the caller told to stop.
+							++m_blocked_count;
+
+							break;
+						}
+				}
+			}
+
+			m_entries.push_back(_entry);
+
+			if (_entry.bounded)
+			{
+				++m_bounded_count;
+
+				if ((m_policy == OVERFLOW_BLOCK) && (m_bounded_count >= m_capacity))
+				{
+					m_full = true;
+					has_room = false;
+				}
+			}
+
+			// Only one task runs the callbacks at a time, or they could be run out of order.
+			if (!m_running)
+			{
+				m_running = true;
+				start = true;
+			}
+		}
+
+		if (start)
+		{
+			m_executor(boost::bind(&callback_queue::run, shared_from_this()));
+		}
+
+		return has_room;
+	}
+
+	void callback_queue::run()
+	{
+		for (;;)
+		{
+			task_type task;
+			bool room_made = false;
+
+			{
+				boost::mutex::scoped_lock lock(m_mutex);
+
+				if (m_entries.empty())
+				{
+					m_running = false;
+
+					return;
+				}
+
+				task.swap(m_entries.front().task);
+
+				if (m_entries.front().bounded)
+				{
+					--m_bounded_count;
+
+					if (m_full && (m_bounded_count < m_capacity))
+					{
+						m_full = false;
+						room_made = true;
+					}
+				}
+
+				m_entries.pop_front();
+			}
+
+			try
+			{
+				if (room_made)
+				{
+					call_room_handler();
+				}
+
+				task();
+			}
+			catch (...)
+			{
+				bool restart = false;
+
+				{
+					boost::mutex::scoped_lock lock(m_mutex);
+
+					// The queue would never run again if it stayed marked as running.
+					if (m_entries.empty())
+					{
+						m_running = false;
+					}
+					else
+					{
+						restart = true;
+					}
+				}
+
+				if (restart)
+				{
+					m_executor(boost::bind(&callback_queue::run, shared_from_this()));
+				}
+
+				throw;
+			}
+		}
+	}
+
+	void callback_queue::call_room_handler()
+	{
+		// The lock is held during the call, so that the room handler is never called once detached.
+		boost::mutex::scoped_lock lock(m_room_handler_mutex);
+
+		if (m_room_handler)
+		{
+			m_room_handler();
+		}
+	}
+}
@@ -49,9 +49,9 @@
 
 namespace fscp
 {
-	size_t clear_session_message::write(void* buf, size_t buf_len, session_number_type _session_number, const challenge_type& _challenge, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+	size_t clear_session_message::write(void* buf, size_t buf_len, session_number_type _session_number, const challenge_type& _challenge, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len, channel_mask_type _authenticated_channels, session_flags_type _session_flags)
 	{
-		if (buf_len < BODY_LENGTH)
+		if (buf_len < BODY_LENGTH + EXTENSION_LENGTH)
 		{
 			throw std::runtime_error("buf_len");
 		}
@@ -63,11 +63,16 @@ namespace fscp
 		buffer_tools::set<uint16_t>(buf, sizeof(session_number_type) + challenge_type::static_size + sizeof(uint16_t) + seal_key_len, htons(static_cast<uint16_t>(enc_key_len)));
 		std::memcpy(static_cast<uint8_t*>(buf) + sizeof(session_number_type) + challenge_type::static_size + sizeof(uint16_t) + seal_key_len + sizeof(uint16_t), enc_key, enc_key_len);
 
-		return BODY_LENGTH;
+		buffer_tools::set<uint32_t>(buf, BODY_LENGTH, htonl(EXTENSION_MAGIC));
+		buffer_tools::set<channel_mask_type>(buf, BODY_LENGTH + sizeof(uint32_t), htons(_authenticated_channels));
+		buffer_tools::set<session_flags_type>(buf, BODY_LENGTH + sizeof(uint32_t) + sizeof(channel_mask_type), htons(_session_flags));
+
+		return BODY_LENGTH + EXTENSION_LENGTH;
 	}
 
 	clear_session_message::clear_session_message(const void* buf, size_t buf_len) :
-		m_data(buf)
+		m_data(buf),
+		m_data_len(buf_len)
 	{
 		if (buf_len < BODY_LENGTH)
 		{
@@ -51,9 +51,9 @@
 
 namespace fscp
 {
-	size_t clear_session_request_message::write(void* buf, size_t buf_len, session_number_type _session_number, const challenge_type& _challenge)
+	size_t clear_session_request_message::write(void* buf, size_t buf_len, session_number_type _session_number, const challenge_type& _challenge, session_flags_type _session_flags)
 	{
-		if (buf_len < BODY_LENGTH)
+		if (buf_len < BODY_LENGTH + EXTENSION_LENGTH)
 		{
 			throw std::runtime_error("buf_len");
 		}
@@ -61,11 +61,15 @@ namespace fscp
 		buffer_tools::set<session_number_type>(buf, 0, htonl(_session_number));
 		std::copy(_challenge.begin(), _challenge.end(), static_cast<char*>(buf) + sizeof(_session_number));
 
-		return BODY_LENGTH;
+		buffer_tools::set<uint32_t>(buf, BODY_LENGTH, htonl(EXTENSION_MAGIC));
+		buffer_tools::set<session_flags_type>(buf, BODY_LENGTH + sizeof(uint32_t), htons(_session_flags));
+
+		return BODY_LENGTH + EXTENSION_LENGTH;
 	}
 
 	clear_session_request_message::clear_session_request_message(const void* buf, size_t buf_len) :
-		m_data(buf)
+		m_data(buf),
+		m_data_len(buf_len)
 	{
 		if (buf_len < BODY_LENGTH)
 		{
@@ -52,7 +52,7 @@ namespace fscp
 {
 	channel_number_type to_channel_number(message_type type)
 	{
-		assert(is_data_message_type(type));
+		assert(is_data_message_type(type) || is_authenticated_data_message_type(type));
 
 		return static_cast<channel_number_type>(static_cast<uint8_t>(type) & 0x0F);
 	}
@@ -65,6 +65,14 @@ namespace fscp
 		return static_cast<message_type>(static_cast<uint8_t>(MESSAGE_TYPE_DATA_0) + static_cast<uint8_t>(channel_number));
 	}
 
+	message_type to_authenticated_data_message_type(channel_number_type channel_number)
+	{
+		assert(channel_number >= CHANNEL_NUMBER_0);
+		assert(channel_number <= CHANNEL_NUMBER_15);
+
+		return static_cast<message_type>(static_cast<uint8_t>(MESSAGE_TYPE_AUTHENTICATED_DATA_0) + static_cast<uint8_t>(channel_number));
+	}
+
 	void get_certificate_hash(void* buf, size_t buflen, cryptoplus::x509::certificate cert)
 	{
 		cryptoplus::hash::message_digest_context mdctx;
@@ -0,0 +1,326 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file crypto_scheduler.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A pool of threads that several servers share for their cryptographic work.
+ */
+
+#include "crypto_scheduler.hpp"
+
+#include "cpu_affinity.hpp"
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace fscp
+{
+	crypto_scheduler::client::client(boost::shared_ptr<crypto_scheduler> scheduler) :
+		m_scheduler(scheduler),
+		m_id(scheduler->add_client())
+	{
+	}
+
+	crypto_scheduler::client::~client()
+	{
+		m_scheduler->remove_client(m_id);
+	}
+
+	void crypto_scheduler::client::post(priority_type priority, task_type task)
+	{
+		m_scheduler->post(m_id, priority, task);
+	}
+
+	crypto_scheduler::crypto_scheduler(size_t thread_count) :
+		m_next_queue(0),
+		m_pending_count(0),
+		m_pending_handshake_count(0),
+		m_next_client_id(0),
+		m_stopping(false)
+	{
+		start(thread_count);
+	}
+
+	crypto_scheduler::crypto_scheduler(const std::vector<unsigned int>& cpus) :
+		m_cpus(cpus),
+		m_next_queue(0),
+		m_pending_count(0),
+		m_pending_handshake_count(0),
+		m_next_client_id(0),
+		m_stopping(false)
+	{
+		start(cpus.size());
+	}
+
+	crypto_scheduler::~crypto_scheduler()
+	{
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+
+			m_stopping = true;
+		}
+
+		m_condition.notify_all();
+		m_threads.join_all();
+	}
+
+	void crypto_scheduler::start(size_t thread_count)
+	{
+		if (thread_count == 0)
+		{
+			throw std::runtime_error("a crypto scheduler needs at least one thread");
+		}
+
+		// All the queues must exist before any thread may steal from them.
+		for (size_t i = 0; i < thread_count; ++i)
+		{
+			m_queues.push_back(boost::shared_ptr<queue>(new queue()));
+		}
+
+		for (size_t i = 0; i < thread_count; ++i)
+		{
+			m_threads.create_thread(boost::bind(&crypto_scheduler::run, this, i));
+		}
+	}
+
+	size_t crypto_scheduler::add_client()
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		return m_next_client_id++;
+	}
+
+	void crypto_scheduler::remove_client(size_t id)
+	{
+		for (size_t i = 0; i < m_queues.size(); ++i)
+		{
+			queue& q = *m_queues[i];
+
+			boost::mutex::scoped_lock queue_lock(q.mutex);
+
+			client_task_map::iterator entry = q.client_tasks.find(id);
+
+			if (entry != q.client_tasks.end())
+			{
+				const size_t count = entry->second[PRIORITY_HANDSHAKE].size() + entry->second[PRIORITY_DATA].size();
+
+				m_pending_handshake_count -= entry->second[PRIORITY_HANDSHAKE].size();
+				q.client_tasks.erase(entry);
+				q.clients.erase(std::find(q.clients.begin(), q.clients.end(), id));
+
+				boost::mutex::scoped_lock lock(m_mutex);
+
+				m_pending_count -= count;
+			}
+		}
+
+		// A task is counted as running before it leaves its queue: none of ours can start after this point.
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		while (m_running_counts.find(id) != m_running_counts.end())
+		{
+			m_idle_condition.wait(lock);
+		}
+	}
+
+	void crypto_scheduler::post(size_t id, priority_type priority, task_type task)
+	{
+		queue& q = *m_queues[m_next_queue++ % m_queues.size()];
+
+		{
+			boost::mutex::scoped_lock queue_lock(q.mutex);
+
+			client_task_map::iterator entry = q.client_tasks.find(id);
+
+			if (entry == q.client_tasks.end())
+			{
+				entry = q.client_tasks.insert(client_task_map::value_type(id, client_task_map::mapped_type())).first;
+				q.clients.push_back(id);
+			}
+
+			entry->second[priority].push_back(task);
+
+			if (priority == PRIORITY_HANDSHAKE)
+			{
+				++m_pending_handshake_count;
+			}
+
+			boost::mutex::scoped_lock lock(m_mutex);
+
+			++m_pending_count;
+		}
+
+		m_condition.notify_one();
+	}
+
+	bool crypto_scheduler::take(size_t index, size_t& id, task_type& task)
+	{
+		// The handshake tasks of all the queues first, then the data tasks: our own queue first each time, then steal from the others.
+		if (m_pending_handshake_count > 0)
+		{
+			for (size_t i = 0; i < m_queues.size(); ++i)
+			{
+				if (take_from(*m_queues[(index + i) % m_queues.size()], PRIORITY_HANDSHAKE, id, task))
+				{
+					return true;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < m_queues.size(); ++i)
+		{
+			if (take_from(*m_queues[(index + i) % m_queues.size()], PRIORITY_DATA, id, task))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool crypto_scheduler::take_from(queue& q, priority_type lowest_priority, size_t& id, task_type& task)
+	{
+		boost::mutex::scoped_lock queue_lock(q.mutex);
+
+		if (q.clients.empty())
+		{
+			return false;
+		}
+
+		// The first client, in turn, that has a handshake task; or else the first client, if data tasks are allowed.
+		std::deque<size_t>::iterator client = q.clients.end();
+		priority_type priority = PRIORITY_DATA;
+
+		for (std::deque<size_t>::iterator it = q.clients.begin(); it != q.clients.end(); ++it)
+		{
+			if (!q.client_tasks[*it][PRIORITY_HANDSHAKE].empty())
+			{
+				client = it;
+				priority = PRIORITY_HANDSHAKE;
+
+				break;
+			}
+		}
+
+		if (client == q.clients.end())
+		{
+			if (lowest_priority == PRIORITY_HANDSHAKE)
+			{
+				return false;
+			}
+
+			client = q.clients.begin();
+		}
+
+		if (priority == PRIORITY_HANDSHAKE)
+		{
+			--m_pending_handshake_count;
+		}
+
+		id = *client;
+		q.clients.erase(client);
+
+		client_task_map::iterator entry = q.client_tasks.find(id);
+		std::deque<task_type>& tasks = entry->second[priority];
+
+		task.swap(tasks.front());
+		tasks.pop_front();
+
+		if (entry->second[PRIORITY_HANDSHAKE].empty() && entry->second[PRIORITY_DATA].empty())
+		{
+			q.client_tasks.erase(entry);
+		}
+		else
+		{
+			q.clients.push_back(id);
+		}
+
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		--m_pending_count;
+		++m_running_counts[id];
+
+		return true;
+	}
+
+	void crypto_scheduler::run(size_t index)
+	{
+		if (!m_cpus.empty())
+		{
+			set_current_thread_cpu(m_cpus[index]);
+		}
+
+		for (;;)
+		{
+			size_t id = 0;
+			task_type task;
+
+			if (!take(index, id, task))
+			{
+				boost::mutex::scoped_lock lock(m_mutex);
+
+				while ((m_pending_count == 0) && !m_stopping)
+				{
+					m_condition.wait(lock);
+				}
+
+				if (m_stopping)
+				{
+					return;
+				}
+
+				continue;
+			}
+
+			task();
+			task.clear();
+
+			boost::mutex::scoped_lock lock(m_mutex);
+
+			std::map<size_t, size_t>::iterator running = m_running_counts.find(id);
+
+			if (--running->second == 0)
+			{
+				m_running_counts.erase(running);
+				m_idle_condition.notify_all();
+			}
+		}
+	}
+}
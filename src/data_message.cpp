@@ -44,90 +44,664 @@
 
 #include "data_message.hpp"
 
+#include "random_pool.hpp"
+#include "data_path.hpp"
+#include "session_keys.hpp"
+
 #include <cryptoplus/cipher/cipher_context.hpp>
 #include <cryptoplus/hash/hmac.hpp>
-#include <cryptoplus/random/random.hpp>
+#include <cryptoplus/hash/hmac_context.hpp>
+
+#include <boost/static_assert.hpp>
+#include <boost/make_shared.hpp>
+
+#include <openssl/crypto.h>
+
 #include <cassert>
 #include <stdexcept>
+#include <algorithm>
+#include <limits>
 
 namespace fscp
 {
-	size_t data_message::write(void* buf, size_t buf_len, channel_number_type channel_number, session_number_type _session_number, sequence_number_type _sequence_number, const void* _cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+	namespace
 	{
-		return raw_write(buf, buf_len, _session_number, _sequence_number, _cleartext, cleartext_len, seal_key, seal_key_len, enc_key, enc_key_len, to_data_message_type(channel_number));
+		/**
+		 * \brief The count of bytes ciphered (or deciphered) and sealed at each step of the stitched loops.
+		 *
+		 * It must be a multiple of the cipher block size. Four cache lines are small enough for a chunk to still be in the L1 cache when the HMAC reads it, and big enough to amortize the calls.
+		 */
+		const size_t STITCH_CHUNK_SIZE = 256;
+
+		size_t get_chunk_size(data_path_kernel kernel)
+		{
+			return (kernel == DATA_PATH_KERNEL_TWO_PASS) ? std::numeric_limits<size_t>::max() : STITCH_CHUNK_SIZE;
+		}
 	}
 
-	size_t data_message::write_keep_alive(void* buf, size_t buf_len, session_number_type _session_number, sequence_number_type _sequence_number, size_t random_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+	/**
+	 * \brief Writes the data messages of a session, sharing the cryptographic contexts between them.
+	 *
+	 * The key schedules and the HMAC pads are computed once: each message only resets the initialization vector and the HMAC state. A writer created without an encryption key can only write authenticated-only messages.
+	 *
+	 * The sizes come from the CipherSuite traits, so that the loops are specialized at compile time: the algorithms are only looked up once per writer.
+	 */
+	template <typename CipherSuite>
+	class data_message::message_writer
+	{
+		BOOST_STATIC_ASSERT((STITCH_CHUNK_SIZE % CipherSuite::block_size) == 0);
+
+		public:
+
+			message_writer(data_path_kernel kernel, session_number_type session_number, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+
+			size_t write(void* buf, size_t buf_len, extended_sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, message_type type);
+
+		private:
+
+			size_t write_authenticated(void* buf, size_t buf_len, extended_sequence_number_type sequence_number, const void* cleartext, size_t cleartext_len, message_type type);
+
+			const cryptoplus::cipher::cipher_algorithm m_cipher_algorithm;
+			const cryptoplus::hash::message_digest_algorithm m_message_digest_algorithm;
+			const size_t m_chunk_size;
+			const session_number_type m_session_number;
+			cryptoplus::cipher::cipher_context m_iv_cipher_context;
+			cryptoplus::cipher::cipher_context m_cipher_context;
+			cryptoplus::hash::hmac_context m_hmac_context;
+			bool m_hmac_context_fresh;
+			cryptoplus::hash::hmac_context m_authentication_hmac_context;
+			bool m_authentication_hmac_context_fresh;
+			bool m_can_encrypt;
+	};
+
+	/**
+	 * \brief Checks and deciphers the data messages of a session, sharing the cryptographic contexts between them.
+	 *
+	 * The seal of a message can also be checked alone, without deciphering it.
+	 */
+	template <typename CipherSuite>
+	class data_message::message_reader
 	{
-		const cryptoplus::buffer random = cryptoplus::random::get_random_bytes(random_len);
+		BOOST_STATIC_ASSERT((STITCH_CHUNK_SIZE % CipherSuite::block_size) == 0);
 
-		return raw_write(buf, buf_len, _session_number, _sequence_number, cryptoplus::buffer_cast<uint8_t>(random), cryptoplus::buffer_size(random), seal_key, seal_key_len, enc_key, enc_key_len, MESSAGE_TYPE_KEEP_ALIVE);
-	}
+		public:
 
-	size_t data_message::write_contact_request(void* buf, size_t buf_len, session_number_type session_number, sequence_number_type sequence_number, const hash_list_type& hash_list, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
-	{
-		return raw_write(buf, buf_len, session_number, sequence_number, reinterpret_cast<const char*>(&hash_list[0]), hash_list.size() * hash_type::static_size, seal_key, seal_key_len, enc_key, enc_key_len, MESSAGE_TYPE_CONTACT_REQUEST);
-	}
+			message_reader(data_path_kernel kernel, session_number_type session_number, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len);
+
+			size_t read(const data_message& message, void* buf, size_t buf_len, sequence_number_type sequence_number_high);
+
+			void check(const data_message& message, sequence_number_type sequence_number_high);
+
+		private:
 
-	size_t data_message::write_contact(void* buf, size_t buf_len, session_number_type session_number, sequence_number_type _sequence_number, const contact_map_type& contact_map, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+			size_t read_authenticated(const data_message& message, void* buf, size_t buf_len, sequence_number_type sequence_number_high);
+
+			const cryptoplus::cipher::cipher_algorithm m_cipher_algorithm;
+			const cryptoplus::hash::message_digest_algorithm m_message_digest_algorithm;
+			const size_t m_chunk_size;
+			const session_number_type m_session_number;
+			cryptoplus::cipher::cipher_context m_iv_cipher_context;
+			cryptoplus::cipher::cipher_context m_cipher_context;
+			cryptoplus::hash::hmac_context m_hmac_context;
+			bool m_hmac_context_fresh;
+			cryptoplus::hash::hmac_context m_authentication_hmac_context;
+			bool m_authentication_hmac_context_fresh;
+	};
+
+	namespace
 	{
-		std::vector<uint8_t> cleartext;
-		cleartext.resize(contact_map.size() * 49);
+		const unsigned char NULL_IV[EVP_MAX_IV_LENGTH] = {};
+
+		void initialize_iv_cipher_context(cryptoplus::cipher::cipher_context& iv_cipher_context, const cryptoplus::cipher::cipher_algorithm& iv_cipher_algorithm, const void* enc_key, size_t enc_key_len)
+		{
+			iv_cipher_context.initialize(iv_cipher_algorithm, cryptoplus::cipher::cipher_context::encrypt, enc_key, enc_key_len, NULL_IV, sizeof(NULL_IV));
+			iv_cipher_context.set_padding(false);
+		}
 
-		std::vector<uint8_t>::iterator ptr = cleartext.begin();
+		sequence_number_type low_part(extended_sequence_number_type sequence_number)
+		{
+			return static_cast<sequence_number_type>(sequence_number);
+		}
 
-		for (contact_map_type::const_iterator it = contact_map.begin(); it != contact_map.end(); ++it)
+		sequence_number_type high_part(extended_sequence_number_type sequence_number)
 		{
-			// We copy the hash
-			ptr = std::copy(it->first.begin(), it->first.end(), ptr);
+			return static_cast<sequence_number_type>(sequence_number >> 32);
+		}
 
-			if (it->second.address().is_v4())
+		void reset_initialization_vector(cryptoplus::cipher::cipher_context& cipher_context, const void* iv)
+		{
+			// Only the IV is reset: the key schedule is kept.
+			if (EVP_CipherInit_ex(&cipher_context.raw(), NULL, NULL, NULL, static_cast<const unsigned char*>(iv), -1) != 1)
 			{
-				*(ptr++) = static_cast<uint8_t>(ENDPOINT_TYPE_IPV4);
+				throw std::runtime_error("unable to reset the initialization vector");
+			}
+		}
+
+		size_t compute_shared_initialization_vector(cryptoplus::cipher::cipher_context& iv_cipher_context, void* buf, size_t buf_len, session_number_type session_number, extended_sequence_number_type sequence_number)
+		{
+			static const char must_be_zero_padding[4] = {};
+
+			uint8_t block[sizeof(session_number) + sizeof(sequence_number) + sizeof(must_be_zero_padding)];
 
-				boost::asio::ip::address_v4::bytes_type bytes = it->second.address().to_v4().to_bytes();
+			// The high part takes the place of what used to be padding: it is zero for 32-bit sequence numbers.
+			buffer_tools::set<session_number_type>(block, 0, htonl(session_number));
+			buffer_tools::set<sequence_number_type>(block, sizeof(session_number), htonl(low_part(sequence_number)));
+			buffer_tools::set<sequence_number_type>(block, sizeof(session_number) + sizeof(sequence_number_type), htonl(high_part(sequence_number)));
+			std::memcpy(block + sizeof(session_number) + sizeof(sequence_number), must_be_zero_padding, sizeof(must_be_zero_padding));
 
-				ptr = std::copy(bytes.begin(), bytes.end(), ptr);
+			reset_initialization_vector(iv_cipher_context, NULL_IV);
 
-				*(reinterpret_cast<uint16_t*>(&*ptr)) = htons(it->second.port());
+			size_t cnt = iv_cipher_context.update(buf, buf_len, block, sizeof(block));
+			cnt += iv_cipher_context.finalize(static_cast<uint8_t*>(buf) + cnt, buf_len - cnt);
 
-				ptr += sizeof(uint16_t);
+			return cnt;
+		}
+
+		const char AUTHENTICATION_KEY_LABEL[] = "FSCP authenticated data";
+
+		/**
+		 * \brief Initialize the HMAC context of the authenticated-only messages.
+		 *
+		 * Their key is derived from the seal key: sealed with the seal key itself, a DATA message whose sequence number reads as a valid header would also seal an authenticated-only message.
+		 */
+		void initialize_authentication_hmac_context(cryptoplus::hash::hmac_context& hmac_context, const cryptoplus::hash::message_digest_algorithm& message_digest_algorithm, const void* seal_key, size_t seal_key_len)
+		{
+			uint8_t authentication_key[EVP_MAX_MD_SIZE];
+
+			hmac_context.initialize(seal_key, seal_key_len, &message_digest_algorithm);
+			hmac_context.update(AUTHENTICATION_KEY_LABEL, sizeof(AUTHENTICATION_KEY_LABEL) - 1);
+			const size_t authentication_key_len = hmac_context.finalize(authentication_key, sizeof(authentication_key));
+
+			hmac_context.initialize(authentication_key, authentication_key_len, &message_digest_algorithm);
+
+			OPENSSL_cleanse(authentication_key, sizeof(authentication_key));
+		}
+
+		void reset_hmac_context(cryptoplus::hash::hmac_context& hmac_context, bool& fresh, sequence_number_type sequence_number_high)
+		{
+			// A NULL key and algorithm reuse the already computed pads.
+			if (!fresh)
+			{
+				hmac_context.initialize(NULL, 0, NULL);
 			}
-			else if (it->second.address().is_v6())
+
+			fresh = false;
+
+			// The high part of an extended sequence number is not sent but it is sealed, so that a message cannot be replayed in another epoch. It is skipped while zero, which keeps those messages identical to 32-bit ones.
+			if (sequence_number_high != 0)
 			{
-				*(ptr++) = static_cast<uint8_t>(ENDPOINT_TYPE_IPV6);
+				const sequence_number_type value = htonl(sequence_number_high);
 
-				boost::asio::ip::address_v6::bytes_type bytes = it->second.address().to_v6().to_bytes();
+				hmac_context.update(&value, sizeof(value));
+			}
+		}
+	}
+
+	namespace
+	{
+		/**
+		 * \brief Takes a context from the pool of a session for the duration of a message.
+		 *
+		 * Creating the cipher and HMAC contexts allocates inside OpenSSL: a context is only created when all the contexts of the session are in use, and it then joins the pool.
+		 */
+		template <typename Context>
+		class scoped_context : public boost::noncopyable
+		{
+			public:
+
+				scoped_context(context_pool<Context>& pool, const session_keys& keys) :
+					m_pool(pool),
+					m_context(pool.take())
+				{
+					if (!m_context)
+					{
+						m_context = boost::make_shared<Context>(get_data_path_kernel(), keys.session_number(), keys.seal_key(), keys.seal_key_size(), keys.encryption_key(), keys.encryption_key_size());
+					}
+				}
+
+				~scoped_context()
+				{
+					try
+					{
+						m_pool.give_back(m_context);
+					}
+					catch (...)
+					{
+						// Losing the context is harmless: the pool creates another one when it needs it.
+					}
+				}
 
-				ptr = std::copy(bytes.begin(), bytes.end(), ptr);
+				Context* operator->() const
+				{
+					return m_context.get();
+				}
 
-				*(reinterpret_cast<uint16_t*>(&*ptr)) = htons(it->second.port());
+			private:
 
-				ptr += sizeof(uint16_t);
+				context_pool<Context>& m_pool;
+				typename context_pool<Context>::context_ptr m_context;
+		};
+
+		uint8_t* write_contact_map(uint8_t* ptr, const contact_map_type& contact_map)
+		{
+			for (contact_map_type::const_iterator it = contact_map.begin(); it != contact_map.end(); ++it)
+			{
+				// We copy the hash
+				ptr = std::copy(it->first.begin(), it->first.end(), ptr);
+
+				if (it->second.address().is_v4())
+				{
+					*(ptr++) = static_cast<uint8_t>(ENDPOINT_TYPE_IPV4);
+
+					boost::asio::ip::address_v4::bytes_type bytes = it->second.address().to_v4().to_bytes();
+
+					ptr = std::copy(bytes.begin(), bytes.end(), ptr);
+
+					*(reinterpret_cast<uint16_t*>(&*ptr)) = htons(it->second.port());
+
+					ptr += sizeof(uint16_t);
+				}
+				else if (it->second.address().is_v6())
+				{
+					*(ptr++) = static_cast<uint8_t>(ENDPOINT_TYPE_IPV6);
+
+					boost::asio::ip::address_v6::bytes_type bytes = it->second.address().to_v6().to_bytes();
+
+					ptr = std::copy(bytes.begin(), bytes.end(), ptr);
+
+					*(reinterpret_cast<uint16_t*>(&*ptr)) = htons(it->second.port());
+
+					ptr += sizeof(uint16_t);
+				}
 			}
+
+			return ptr;
 		}
+	}
 
-		cleartext.resize(std::distance(cleartext.begin(), ptr));
+	template <typename CipherSuite>
+	data_message::message_writer<CipherSuite>::message_writer(data_path_kernel kernel, session_number_type session_number, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len) :
+		m_cipher_algorithm(CipherSuite::cipher_algorithm),
+		m_message_digest_algorithm(CipherSuite::message_digest_algorithm),
+		m_chunk_size(get_chunk_size(kernel)),
+		m_session_number(session_number),
+		m_hmac_context_fresh(true),
+		m_authentication_hmac_context_fresh(true),
+		m_can_encrypt(enc_key != NULL)
+	{
+		assert(seal_key);
+		assert(m_cipher_algorithm.block_size() == CipherSuite::block_size);
+		assert(m_cipher_algorithm.iv_length() == CipherSuite::iv_length);
+		assert(m_message_digest_algorithm.result_size() == CipherSuite::digest_size);
 
-		return raw_write(buf, buf_len, session_number, _sequence_number, &cleartext[0], cleartext.size(), seal_key, seal_key_len, enc_key, enc_key_len, MESSAGE_TYPE_CONTACT);
+		m_hmac_context.initialize(seal_key, seal_key_len, &m_message_digest_algorithm);
+		initialize_authentication_hmac_context(m_authentication_hmac_context, m_message_digest_algorithm, seal_key, seal_key_len);
+
+		// Authenticated-only writers don't need the cipher contexts.
+		if (!m_can_encrypt)
+		{
+			return;
+		}
+
+		initialize_iv_cipher_context(m_iv_cipher_context, cryptoplus::cipher::cipher_algorithm(CipherSuite::iv_cipher_algorithm), enc_key, enc_key_len);
+
+		m_cipher_context.initialize(m_cipher_algorithm, cryptoplus::cipher::cipher_context::encrypt, enc_key, enc_key_len, NULL_IV, sizeof(NULL_IV));
+		m_cipher_context.set_padding(false);
 	}
 
-	std::vector<hash_type> data_message::parse_hash_list(void* buf, size_t buflen)
+	template <typename CipherSuite>
+	size_t data_message::message_writer<CipherSuite>::write(void* buf, size_t buf_len, extended_sequence_number_type _sequence_number, const void* _cleartext, size_t cleartext_len, message_type type)
+	{
+		if (is_authenticated_data_message_type(type))
+		{
+			return write_authenticated(buf, buf_len, _sequence_number, _cleartext, cleartext_len, type);
+		}
+
+		assert(m_can_encrypt);
+
+		const size_t block_size = CipherSuite::block_size;
+
+		if (buf_len < HEADER_LENGTH + CipherSuite::iv_length + cleartext_len + block_size + CipherSuite::digest_size)
+		{
+			throw std::runtime_error("buf_len");
+		}
+
+		uint8_t* const payload = static_cast<uint8_t*>(buf) + HEADER_LENGTH;
+		const size_t payload_len = buf_len - HEADER_LENGTH;
+		uint8_t* const ciphertext = payload + sizeof(sequence_number_type);
+		const size_t ciphertext_len = payload_len - sizeof(sequence_number_type);
+
+		buffer_tools::set<sequence_number_type>(payload, 0, htonl(low_part(_sequence_number)));
+
+		uint8_t iv[2 * CipherSuite::iv_length];
+		compute_shared_initialization_vector(m_iv_cipher_context, iv, sizeof(iv), m_session_number, _sequence_number);
+
+		reset_initialization_vector(m_cipher_context, iv);
+
+		reset_hmac_context(m_hmac_context, m_hmac_context_fresh, high_part(_sequence_number));
+		m_hmac_context.update(payload, sizeof(sequence_number_type));
+
+		// Each chunk is sealed right after being ciphered, while it is still hot in the cache. The two-pass kernel uses a single chunk.
+		const uint8_t* const cleartext = static_cast<const uint8_t*>(_cleartext);
+		const size_t full_blocks_len = cleartext_len - cleartext_len % block_size;
+		size_t cnt = 0;
+
+		for (size_t offset = 0; offset < full_blocks_len; offset += m_chunk_size)
+		{
+			const size_t chunk_len = std::min(m_chunk_size, full_blocks_len - offset);
+			const size_t chunk_cnt = m_cipher_context.update(ciphertext + cnt, ciphertext_len - cnt, cleartext + offset, chunk_len);
+
+			m_hmac_context.update(ciphertext + cnt, chunk_cnt);
+			cnt += chunk_cnt;
+		}
+
+		// The ISO 10126 padding is applied on the last block only, so that the cleartext never gets copied.
+		uint8_t last_block[CipherSuite::block_size];
+		const size_t remaining_len = cleartext_len - full_blocks_len;
+		const size_t padding_len = block_size - remaining_len;
+
+		std::memcpy(last_block, cleartext + full_blocks_len, remaining_len);
+		random_pool::get_random_bytes(last_block + remaining_len, padding_len - 1);
+		last_block[block_size - 1] = static_cast<uint8_t>(padding_len);
+
+		size_t chunk_cnt = m_cipher_context.update(ciphertext + cnt, ciphertext_len - cnt, last_block, block_size);
+		chunk_cnt += m_cipher_context.finalize(ciphertext + cnt + chunk_cnt, ciphertext_len - cnt - chunk_cnt);
+
+		m_hmac_context.update(ciphertext + cnt, chunk_cnt);
+		cnt += chunk_cnt;
+
+		uint8_t digest[CipherSuite::digest_size];
+		m_hmac_context.finalize(digest, sizeof(digest));
+
+		// The HMAC is cut in half
+		std::memcpy(ciphertext + cnt, digest, CipherSuite::hmac_size);
+
+		const size_t length = sizeof(sequence_number_type) + cnt + CipherSuite::hmac_size;
+
+		return message::write(buf, buf_len, CURRENT_PROTOCOL_VERSION, type, length) + length;
+	}
+
+	template <typename CipherSuite>
+	size_t data_message::message_writer<CipherSuite>::write_authenticated(void* buf, size_t buf_len, extended_sequence_number_type _sequence_number, const void* cleartext, size_t cleartext_len, message_type type)
+	{
+		if (buf_len < HEADER_LENGTH + sizeof(sequence_number_type) + cleartext_len + CipherSuite::hmac_size)
+		{
+			throw std::runtime_error("buf_len");
+		}
+
+		uint8_t* const payload = static_cast<uint8_t*>(buf) + HEADER_LENGTH;
+		const size_t length = sizeof(sequence_number_type) + cleartext_len + CipherSuite::hmac_size;
+
+		// The header is sealed too, so that the message cannot be replayed on another channel.
+		message::write(buf, buf_len, CURRENT_PROTOCOL_VERSION, type, length);
+		buffer_tools::set<sequence_number_type>(payload, 0, htonl(low_part(_sequence_number)));
+
+		if (cleartext_len > 0)
+		{
+			std::memmove(payload + sizeof(sequence_number_type), cleartext, cleartext_len);
+		}
+
+		reset_hmac_context(m_authentication_hmac_context, m_authentication_hmac_context_fresh, high_part(_sequence_number));
+		m_authentication_hmac_context.update(buf, HEADER_LENGTH + sizeof(sequence_number_type) + cleartext_len);
+
+		uint8_t digest[CipherSuite::digest_size];
+		m_authentication_hmac_context.finalize(digest, sizeof(digest));
+
+		// The HMAC is cut in half
+		std::memcpy(payload + sizeof(sequence_number_type) + cleartext_len, digest, CipherSuite::hmac_size);
+
+		return HEADER_LENGTH + length;
+	}
+
+	template <typename CipherSuite>
+	data_message::message_reader<CipherSuite>::message_reader(data_path_kernel kernel, session_number_type session_number, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len) :
+		m_cipher_algorithm(CipherSuite::cipher_algorithm),
+		m_message_digest_algorithm(CipherSuite::message_digest_algorithm),
+		m_chunk_size(get_chunk_size(kernel)),
+		m_session_number(session_number),
+		m_hmac_context_fresh(true),
+		m_authentication_hmac_context_fresh(true)
+	{
+		assert(seal_key);
+		assert(enc_key);
+		assert(m_cipher_algorithm.block_size() == CipherSuite::block_size);
+		assert(m_cipher_algorithm.iv_length() == CipherSuite::iv_length);
+		assert(m_message_digest_algorithm.result_size() == CipherSuite::digest_size);
+
+		initialize_iv_cipher_context(m_iv_cipher_context, cryptoplus::cipher::cipher_algorithm(CipherSuite::iv_cipher_algorithm), enc_key, enc_key_len);
+
+		m_cipher_context.initialize(m_cipher_algorithm, cryptoplus::cipher::cipher_context::decrypt, enc_key, enc_key_len, NULL_IV, sizeof(NULL_IV));
+		m_cipher_context.set_padding(false);
+
+		m_hmac_context.initialize(seal_key, seal_key_len, &m_message_digest_algorithm);
+		initialize_authentication_hmac_context(m_authentication_hmac_context, m_message_digest_algorithm, seal_key, seal_key_len);
+	}
+
+	template <typename CipherSuite>
+	size_t data_message::message_reader<CipherSuite>::read(const data_message& message, void* buf, size_t buf_len, sequence_number_type sequence_number_high)
+	{
+		if (is_authenticated_data_message_type(message.type()))
+		{
+			return read_authenticated(message, buf, buf_len, sequence_number_high);
+		}
+
+		const size_t ciphertext_size = message.ciphertext_size();
+
+		if ((ciphertext_size % CipherSuite::block_size != 0) || (buf_len < ciphertext_size))
+		{
+			throw std::runtime_error("bad ciphertext length");
+		}
+
+		uint8_t iv[2 * CipherSuite::iv_length];
+		compute_shared_initialization_vector(m_iv_cipher_context, iv, sizeof(iv), m_session_number, (static_cast<extended_sequence_number_type>(sequence_number_high) << 32) | message.sequence_number());
+
+		reset_initialization_vector(m_cipher_context, iv);
+
+		reset_hmac_context(m_hmac_context, m_hmac_context_fresh, sequence_number_high);
+		m_hmac_context.update(message.payload(), sizeof(sequence_number_type));
+
+		// Each chunk is sealed then deciphered while it is still hot in the cache. The two-pass kernel uses a single chunk.
+		uint8_t* const cleartext = static_cast<uint8_t*>(buf);
+		size_t cnt = 0;
+
+		for (size_t offset = 0; offset < ciphertext_size; offset += m_chunk_size)
+		{
+			const size_t chunk_len = std::min(m_chunk_size, ciphertext_size - offset);
+
+			m_hmac_context.update(message.ciphertext() + offset, chunk_len);
+			cnt += m_cipher_context.update(cleartext + cnt, buf_len - cnt, message.ciphertext() + offset, chunk_len);
+		}
+
+		cnt += m_cipher_context.finalize(cleartext + cnt, buf_len - cnt);
+
+		uint8_t digest[CipherSuite::digest_size];
+		m_hmac_context.finalize(digest, sizeof(digest));
+
+		// The HMAC is cut in half
+		if (std::memcmp(message.hmac(), digest, CipherSuite::hmac_size) != 0)
+		{
+			throw std::runtime_error("hmac mismatch");
+		}
+
+		try
+		{
+			cnt = m_cipher_context.verify_iso_10126_padding(cleartext, cnt);
+		}
+		catch (std::logic_error&)
+		{
+			throw std::runtime_error("Incorrect padding in the ciphertext");
+		}
+
+		return cnt;
+	}
+
+	template <typename CipherSuite>
+	void data_message::message_reader<CipherSuite>::check(const data_message& message, sequence_number_type sequence_number_high)
+	{
+		const bool authenticated_only = is_authenticated_data_message_type(message.type());
+		cryptoplus::hash::hmac_context& hmac_context = authenticated_only ? m_authentication_hmac_context : m_hmac_context;
+
+		reset_hmac_context(hmac_context, authenticated_only ? m_authentication_hmac_context_fresh : m_hmac_context_fresh, sequence_number_high);
+
+		// The authenticated-only messages seal their header too.
+		const uint8_t* const sealed = authenticated_only ? message.data() : message.payload();
+
+		hmac_context.update(sealed, message.hmac() - sealed);
+
+		uint8_t digest[CipherSuite::digest_size];
+		hmac_context.finalize(digest, sizeof(digest));
+
+		// The HMAC is cut in half
+		if (std::memcmp(message.hmac(), digest, CipherSuite::hmac_size) != 0)
+		{
+			throw std::runtime_error("hmac mismatch");
+		}
+	}
+
+	template <typename CipherSuite>
+	size_t data_message::message_reader<CipherSuite>::read_authenticated(const data_message& message, void* buf, size_t buf_len, sequence_number_type sequence_number_high)
+	{
+		const size_t cleartext_size = message.ciphertext_size();
+
+		if (buf_len < cleartext_size)
+		{
+			throw std::runtime_error("bad cleartext length");
+		}
+
+		reset_hmac_context(m_authentication_hmac_context, m_authentication_hmac_context_fresh, sequence_number_high);
+		m_authentication_hmac_context.update(message.data(), HEADER_LENGTH + sizeof(sequence_number_type) + cleartext_size);
+
+		uint8_t digest[CipherSuite::digest_size];
+		m_authentication_hmac_context.finalize(digest, sizeof(digest));
+
+		// The HMAC is cut in half
+		if (std::memcmp(message.hmac(), digest, CipherSuite::hmac_size) != 0)
+		{
+			throw std::runtime_error("hmac mismatch");
+		}
+
+		std::memcpy(buf, message.ciphertext(), cleartext_size);
+
+		return cleartext_size;
+	}
+
+	size_t data_message::write(void* buf, size_t buf_len, channel_number_type channel_number, session_number_type _session_number, extended_sequence_number_type _sequence_number, const void* _cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+	{
+		return raw_write(buf, buf_len, _session_number, _sequence_number, _cleartext, cleartext_len, seal_key, seal_key_len, enc_key, enc_key_len, to_data_message_type(channel_number));
+	}
+
+	size_t data_message::write(void* buf, size_t buf_len, channel_number_type channel_number, extended_sequence_number_type _sequence_number, const void* _cleartext, size_t cleartext_len, const session_keys& keys)
+	{
+		return raw_write(buf, buf_len, _sequence_number, _cleartext, cleartext_len, keys, to_data_message_type(channel_number));
+	}
+
+	size_t data_message::write_authenticated(void* buf, size_t buf_len, channel_number_type channel_number, extended_sequence_number_type _sequence_number, const void* _cleartext, size_t cleartext_len, const session_keys& keys)
+	{
+		return raw_write(buf, buf_len, _sequence_number, _cleartext, cleartext_len, keys, to_authenticated_data_message_type(channel_number));
+	}
+
+	size_t data_message::write_keep_alive(void* buf, size_t buf_len, session_number_type _session_number, extended_sequence_number_type _sequence_number, size_t random_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+	{
+		// The random content is generated where its ciphertext goes: it gets ciphered in place.
+		uint8_t* const random = static_cast<uint8_t*>(buf) + HEADER_LENGTH + sizeof(sequence_number_type);
+
+		if (buf_len < HEADER_LENGTH + sizeof(sequence_number_type) + random_len)
+		{
+			throw std::runtime_error("buf_len");
+		}
+
+		random_pool::get_random_bytes(random, random_len);
+
+		return raw_write(buf, buf_len, _session_number, _sequence_number, random, random_len, seal_key, seal_key_len, enc_key, enc_key_len, MESSAGE_TYPE_KEEP_ALIVE);
+	}
+
+	size_t data_message::write_keep_alive(void* buf, size_t buf_len, extended_sequence_number_type _sequence_number, size_t random_len, const session_keys& keys)
+	{
+		uint8_t* const random = static_cast<uint8_t*>(buf) + HEADER_LENGTH + sizeof(sequence_number_type);
+
+		if (buf_len < HEADER_LENGTH + sizeof(sequence_number_type) + random_len)
+		{
+			throw std::runtime_error("buf_len");
+		}
+
+		random_pool::get_random_bytes(random, random_len);
+
+		return raw_write(buf, buf_len, _sequence_number, random, random_len, keys, MESSAGE_TYPE_KEEP_ALIVE);
+	}
+
+	size_t data_message::write_contact_request(void* buf, size_t buf_len, session_number_type session_number, extended_sequence_number_type sequence_number, const hash_list_type& hash_list, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+	{
+		return raw_write(buf, buf_len, session_number, sequence_number, reinterpret_cast<const char*>(&hash_list[0]), hash_list.size() * hash_type::static_size, seal_key, seal_key_len, enc_key, enc_key_len, MESSAGE_TYPE_CONTACT_REQUEST);
+	}
+
+	size_t data_message::write_contact_request(void* buf, size_t buf_len, extended_sequence_number_type sequence_number, const hash_list_type& hash_list, const session_keys& keys)
+	{
+		return raw_write(buf, buf_len, sequence_number, reinterpret_cast<const char*>(&hash_list[0]), hash_list.size() * hash_type::static_size, keys, MESSAGE_TYPE_CONTACT_REQUEST);
+	}
+
+	size_t data_message::write_contact(void* buf, size_t buf_len, session_number_type session_number, extended_sequence_number_type _sequence_number, const contact_map_type& contact_map, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len)
+	{
+		// The contact map is serialized where its ciphertext goes: it gets ciphered in place.
+		uint8_t* const cleartext = static_cast<uint8_t*>(buf) + HEADER_LENGTH + sizeof(sequence_number_type);
+
+		if (buf_len < HEADER_LENGTH + sizeof(sequence_number_type) + contact_map.size() * 49)
+		{
+			throw std::runtime_error("buf_len");
+		}
+
+		const uint8_t* const end = write_contact_map(cleartext, contact_map);
+
+		return raw_write(buf, buf_len, session_number, _sequence_number, cleartext, std::distance<const uint8_t*>(cleartext, end), seal_key, seal_key_len, enc_key, enc_key_len, MESSAGE_TYPE_CONTACT);
+	}
+
+	size_t data_message::write_contact(void* buf, size_t buf_len, extended_sequence_number_type _sequence_number, const contact_map_type& contact_map, const session_keys& keys)
+	{
+		uint8_t* const cleartext = static_cast<uint8_t*>(buf) + HEADER_LENGTH + sizeof(sequence_number_type);
+
+		if (buf_len < HEADER_LENGTH + sizeof(sequence_number_type) + contact_map.size() * 49)
+		{
+			throw std::runtime_error("buf_len");
+		}
+
+		const uint8_t* const end = write_contact_map(cleartext, contact_map);
+
+		return raw_write(buf, buf_len, _sequence_number, cleartext, std::distance<const uint8_t*>(cleartext, end), keys, MESSAGE_TYPE_CONTACT);
+	}
+
+	size_t data_message::parse_hash_list(const void* buf, size_t buflen, hash_type* hash_list, size_t hash_list_len)
 	{
 		if ((buflen / hash_type::static_size) * hash_type::static_size != buflen)
 		{
 			throw std::runtime_error("Invalid message structure");
 		}
 
-		std::vector<hash_type> result;
+		const size_t count = buflen / hash_type::static_size;
 
-		for (const uint8_t* ptr = static_cast<const uint8_t*>(buf); ptr < static_cast<const uint8_t*>(buf) + buflen; ptr += hash_type::static_size)
+		if (hash_list)
 		{
-			hash_type hash;
+			if (hash_list_len < count)
+			{
+				throw std::runtime_error("hash_list_len");
+			}
 
-			std::copy(ptr, ptr + hash_type::static_size, hash.begin());
+			const uint8_t* ptr = static_cast<const uint8_t*>(buf);
+
+			for (hash_type* hash = hash_list; hash != hash_list + count; ++hash, ptr += hash_type::static_size)
+			{
+				std::copy(ptr, ptr + hash_type::static_size, hash->begin());
+			}
+		}
+
+		return count;
+	}
+
+	std::vector<hash_type> data_message::parse_hash_list(void* buf, size_t buflen)
+	{
+		std::vector<hash_type> result(parse_hash_list(buf, buflen, NULL, 0));
 
-			result.push_back(hash);
+		if (!result.empty())
+		{
+			parse_hash_list(buf, buflen, &result[0], result.size());
 		}
 
 		return result;
@@ -246,6 +820,25 @@ namespace fscp
 		}
 	}
 
+	void data_message::check_seal(const session_keys& keys, sequence_number_type sequence_number_high) const
+	{
+		scoped_context<message_reader<default_cipher_suite> > reader(keys.m_readers, keys);
+
+		reader->check(*this, sequence_number_high);
+	}
+
+	size_t data_message::check_seal_and_get_cleartext(void* buf, size_t buf_len, const session_keys& keys, sequence_number_type sequence_number_high) const
+	{
+		if (!buf)
+		{
+			return ciphertext_size();
+		}
+
+		scoped_context<message_reader<default_cipher_suite> > reader(keys.m_readers, keys);
+
+		return reader->read(*this, buf, buf_len, sequence_number_high);
+	}
+
 	size_t data_message::get_cleartext(void* buf, size_t buf_len, session_number_type session_number, const void* enc_key, size_t enc_key_len) const
 	{
 		assert(enc_key);
@@ -254,10 +847,11 @@ namespace fscp
 		{
 			cryptoplus::cipher::cipher_algorithm cipher_algorithm(CIPHER_ALGORITHM);
 
-			const std::vector<uint8_t> iv = compute_initialization_vector<uint8_t>(session_number, sequence_number(), enc_key, enc_key_len);
+			uint8_t iv[2 * EVP_MAX_IV_LENGTH];
+			const size_t iv_len = compute_initialization_vector(iv, sizeof(iv), session_number, sequence_number(), enc_key, enc_key_len);
 
 			cryptoplus::cipher::cipher_context cipher_context;
-			cipher_context.initialize(cipher_algorithm, cryptoplus::cipher::cipher_context::decrypt, enc_key, enc_key_len, &iv[0], iv.size());
+			cipher_context.initialize(cipher_algorithm, cryptoplus::cipher::cipher_context::decrypt, enc_key, enc_key_len, iv, iv_len);
 			cipher_context.set_padding(false);
 			size_t cnt = cipher_context.update(buf, buf_len, ciphertext(), ciphertext_size());
 			cnt += cipher_context.finalize(static_cast<uint8_t*>(buf) + cnt, buf_len - cnt);
@@ -308,55 +902,59 @@ namespace fscp
 		}
 	}
 
-	size_t data_message::raw_write(void* buf, size_t buf_len, session_number_type _session_number, sequence_number_type _sequence_number, const void* _cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len, message_type type)
+	size_t data_message::raw_write(void* buf, size_t buf_len, session_number_type _session_number, extended_sequence_number_type _sequence_number, const void* _cleartext, size_t cleartext_len, const void* seal_key, size_t seal_key_len, const void* enc_key, size_t enc_key_len, message_type type)
 	{
-		assert(seal_key);
-		assert(enc_key);
+		message_writer<default_cipher_suite> writer(get_data_path_kernel(), _session_number, seal_key, seal_key_len, enc_key, enc_key_len);
 
-		const cryptoplus::cipher::cipher_algorithm cipher_algorithm(CIPHER_ALGORITHM);
-		const cryptoplus::hash::message_digest_algorithm message_digest_algorithm(MESSAGE_DIGEST_ALGORITHM);
+		return writer.write(buf, buf_len, _sequence_number, _cleartext, cleartext_len, type);
+	}
 
-		const size_t hmac_size = message_digest_algorithm.result_size();
+	size_t data_message::raw_write(void* buf, size_t buf_len, extended_sequence_number_type _sequence_number, const void* _cleartext, size_t cleartext_len, const session_keys& keys, message_type type)
+	{
+		scoped_context<message_writer<default_cipher_suite> > writer(keys.m_writers, keys);
 
-		if (buf_len < HEADER_LENGTH + cipher_algorithm.iv_length() + cleartext_len + cipher_algorithm.block_size() + hmac_size)
-		{
-			throw std::runtime_error("buf_len");
-		}
+		return writer->write(buf, buf_len, _sequence_number, _cleartext, cleartext_len, type);
+	}
 
-		uint8_t* const payload = static_cast<uint8_t*>(buf) + HEADER_LENGTH;
-		const size_t payload_len = buf_len - HEADER_LENGTH;
-		uint8_t* const ciphertext = payload + sizeof(sequence_number_type);
-		const size_t ciphertext_len = payload_len - sizeof(sequence_number_type);
+	double data_message::measure_kernel(data_path_kernel kernel, size_t cleartext_len, size_t iterations)
+	{
+		const session_number_type session_number = 0;
+		uint8_t seal_key[session_keys::KEY_LENGTH];
+		uint8_t enc_key[session_keys::KEY_LENGTH];
+
+		random_pool::get_random_bytes(seal_key, sizeof(seal_key));
+		random_pool::get_random_bytes(enc_key, sizeof(enc_key));
 
-		const std::vector<uint8_t> iv = compute_initialization_vector<uint8_t>(_session_number, _sequence_number, enc_key, enc_key_len);
+		std::vector<uint8_t> cleartext(cleartext_len + 1);
+		std::vector<uint8_t> message_buffer(HEADER_LENGTH + sizeof(sequence_number_type) + cleartext_len + 2 * default_cipher_suite::block_size + default_cipher_suite::digest_size);
+		std::vector<uint8_t> output_buffer(message_buffer.size());
 
-		cryptoplus::cipher::cipher_context cipher_context;
-		cipher_context.initialize(cryptoplus::cipher::cipher_algorithm(CIPHER_ALGORITHM), cryptoplus::cipher::cipher_context::encrypt, enc_key, enc_key_len, &iv[0], iv.size());
-		cipher_context.set_padding(false);
+		message_writer<default_cipher_suite> writer(kernel, session_number, seal_key, sizeof(seal_key), enc_key, sizeof(enc_key));
+		message_reader<default_cipher_suite> reader(kernel, session_number, seal_key, sizeof(seal_key), enc_key, sizeof(enc_key));
 
-		const cryptoplus::buffer cleartext = cipher_context.get_iso_10126_padded_buffer(_cleartext, cleartext_len);
+		const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
 
-		size_t cnt = cipher_context.update(ciphertext, ciphertext_len, cleartext);
-		cnt += cipher_context.finalize(ciphertext + cnt, ciphertext_len - cnt);
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			const size_t size = writer.write(&message_buffer[0], message_buffer.size(), static_cast<sequence_number_type>(i), &cleartext[0], cleartext_len, MESSAGE_TYPE_DATA_0);
 
-		buffer_tools::set<sequence_number_type>(payload, 0, htonl(_sequence_number));
+			reader.read(data_message(&message_buffer[0], size), &output_buffer[0], output_buffer.size(), 0);
+		}
 
-		// The HMAC is cut in half
-		const size_t length = sizeof(sequence_number_type) + cnt + hmac_size / 2;
+		const boost::posix_time::time_duration duration = boost::posix_time::microsec_clock::universal_time() - start;
 
-		uint8_t* hmac = ciphertext + cnt;
-		const size_t hmac_len = hmac_size;
+		return (iterations > 0) ? static_cast<double>(duration.total_microseconds()) * 1000.0 / iterations : 0.0;
+	}
 
-		cryptoplus::hash::hmac(
-		    hmac,
-		    hmac_len,
-		    seal_key,
-		    seal_key_len,
-		    payload,
-		    length - hmac_size / 2,
-		    message_digest_algorithm
-		);
+	void data_message::write_batch(write_operation* operations, size_t count, const session_keys& keys)
+	{
+		scoped_context<message_writer<default_cipher_suite> > writer(keys.m_writers, keys);
 
-		return message::write(buf, buf_len, CURRENT_PROTOCOL_VERSION, type, length) + length;
+		for (write_operation* operation = operations; operation != operations + count; ++operation)
+		{
+			const message_type type = operation->authenticated_only ? to_authenticated_data_message_type(operation->channel_number) : to_data_message_type(operation->channel_number);
+
+			operation->size = writer->write(operation->buf, operation->buf_len, operation->sequence_number, operation->cleartext, operation->cleartext_len, type);
+		}
 	}
 }
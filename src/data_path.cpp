@@ -0,0 +1,245 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+
+/**
+ * \file data_path.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief The data path kernel selection.
+ */
+
+#include "data_path.hpp"
+
+#include "data_message.hpp"
+
+#include <boost/thread/once.hpp>
+#include <boost/atomic.hpp>
+#include <boost/array.hpp>
+
+#include <algorithm>
+#include <stdint.h>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define FSCP_X86_MSVC
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#define FSCP_X86_GCC
+#endif
+
+namespace fscp
+{
+	namespace
+	{
+		/**
+		 * \brief The cleartext size used by the self-benchmark: a typical Ethernet frame.
+		 */
+		const size_t SELF_BENCHMARK_SIZE = 1400;
+
+		/**
+		 * \brief The count of messages written and read per kernel in each run of the self-benchmark.
+		 */
+		const size_t SELF_BENCHMARK_ITERATIONS = 256;
+
+		/**
+		 * \brief The count of runs of the self-benchmark. Odd, so that the median is a measured value.
+		 */
+		const size_t SELF_BENCHMARK_RUNS = 7;
+
+		/**
+		 * \brief The forced kernel value when set_data_path_kernel() was not called.
+		 */
+		const int NO_FORCED_KERNEL = -1;
+
+		/**
+		 * \brief The XCR0 bits that the operating system sets when it saves the AVX state.
+		 */
+		const uint64_t XCR0_AVX_STATE = 0x06;
+
+		/**
+		 * \brief The XCR0 bits that the operating system sets when it saves the AVX-512 state.
+		 */
+		const uint64_t XCR0_AVX512_STATE = 0xE6;
+
+		boost::once_flag selection_flag = BOOST_ONCE_INIT;
+		data_path_report selection_report;
+		boost::atomic<int> forced_kernel(NO_FORCED_KERNEL);
+
+#if defined(FSCP_X86_MSVC) || defined(FSCP_X86_GCC)
+		void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+		{
+#ifdef FSCP_X86_MSVC
+			int result[4];
+			__cpuidex(result, static_cast<int>(leaf), static_cast<int>(subleaf));
+
+			for (int i = 0; i < 4; ++i)
+			{
+				regs[i] = static_cast<unsigned int>(result[i]);
+			}
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		uint64_t xgetbv()
+		{
+#ifdef FSCP_X86_MSVC
+			return _xgetbv(0);
+#else
+			uint32_t eax;
+			uint32_t edx;
+
+			__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+			return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+		}
+#endif
+
+		template <size_t Size>
+		double median(boost::array<double, Size>& values)
+		{
+			typename boost::array<double, Size>::iterator middle = values.begin() + Size / 2;
+
+			std::nth_element(values.begin(), middle, values.end());
+
+			return *middle;
+		}
+
+		void do_select_data_path_kernel()
+		{
+			selection_report.features = detect_cpu_features();
+
+			// The first run only warms the caches up.
+			data_message::measure_kernel(DATA_PATH_KERNEL_STITCHED, SELF_BENCHMARK_SIZE, SELF_BENCHMARK_ITERATIONS);
+
+			boost::array<double, SELF_BENCHMARK_RUNS> stitched_durations;
+			boost::array<double, SELF_BENCHMARK_RUNS> two_pass_durations;
+
+			// The kernels are timed in turn, so that a frequency change or a preemption affects both.
+			for (size_t i = 0; i < SELF_BENCHMARK_RUNS; ++i)
+			{
+				stitched_durations[i] = data_message::measure_kernel(DATA_PATH_KERNEL_STITCHED, SELF_BENCHMARK_SIZE, SELF_BENCHMARK_ITERATIONS);
+				two_pass_durations[i] = data_message::measure_kernel(DATA_PATH_KERNEL_TWO_PASS, SELF_BENCHMARK_SIZE, SELF_BENCHMARK_ITERATIONS);
+			}
+
+			selection_report.stitched_duration = median(stitched_durations);
+			selection_report.two_pass_duration = median(two_pass_durations);
+
+			// The stitched kernel wins ties: it has the smallest cache footprint.
+			selection_report.kernel = (selection_report.two_pass_duration < selection_report.stitched_duration) ? DATA_PATH_KERNEL_TWO_PASS : DATA_PATH_KERNEL_STITCHED;
+		}
+	}
+
+	cpu_features detect_cpu_features()
+	{
+		cpu_features result = {};
+
+#if defined(FSCP_X86_MSVC) || defined(FSCP_X86_GCC)
+		unsigned int regs[4] = {};
+
+		cpuid(0, 0, regs);
+
+		const unsigned int max_leaf = regs[0];
+
+		if (max_leaf < 1)
+		{
+			return result;
+		}
+
+		cpuid(1, 0, regs);
+
+		const unsigned int leaf1_ecx = regs[2];
+
+		result.aes_ni = (leaf1_ecx & (1u << 25)) != 0;
+		result.pclmul = (leaf1_ecx & (1u << 1)) != 0;
+
+		const bool osxsave = (leaf1_ecx & (1u << 27)) != 0;
+		const uint64_t xcr0 = osxsave ? xgetbv() : 0;
+
+		if (max_leaf >= 7)
+		{
+			cpuid(7, 0, regs);
+
+			const unsigned int leaf7_ebx = regs[1];
+
+			result.sha_ni = (leaf7_ebx & (1u << 29)) != 0;
+			result.avx2 = ((leaf7_ebx & (1u << 5)) != 0) && ((xcr0 & XCR0_AVX_STATE) == XCR0_AVX_STATE);
+			result.avx512 = ((leaf7_ebx & (1u << 16)) != 0) && ((xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE);
+		}
+#endif
+
+		return result;
+	}
+
+	const data_path_report& select_data_path_kernel()
+	{
+		boost::call_once(selection_flag, &do_select_data_path_kernel);
+
+		return selection_report;
+	}
+
+	void set_data_path_kernel(data_path_kernel kernel)
+	{
+		forced_kernel.store(static_cast<int>(kernel));
+	}
+
+	data_path_kernel get_data_path_kernel()
+	{
+		const int kernel = forced_kernel.load();
+
+		if (kernel != NO_FORCED_KERNEL)
+		{
+			return static_cast<data_path_kernel>(kernel);
+		}
+
+		return select_data_path_kernel().kernel;
+	}
+
+	const char* to_string(data_path_kernel kernel)
+	{
+		switch (kernel)
+		{
+			case DATA_PATH_KERNEL_STITCHED:
+				return "stitched";
+			case DATA_PATH_KERNEL_TWO_PASS:
+				return "two-pass";
+		}
+
+		return "unknown";
+	}
+}
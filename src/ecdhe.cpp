@@ -0,0 +1,259 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file ecdhe.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief The elliptic-curve ephemeral key exchange primitives.
+ */
+
+#include "ecdhe.hpp"
+
+#include "buffer_tools.hpp"
+#include "random_pool.hpp"
+
+#include <boost/shared_ptr.hpp>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+
+#ifdef FSCP_HAS_ECDHE_HANDSHAKE
+#include <openssl/kdf.h>
+#endif
+
+#include <cstring>
+#include <stdexcept>
+
+namespace fscp
+{
+	namespace ecdhe
+	{
+#ifdef FSCP_HAS_ECDHE_HANDSHAKE
+		namespace
+		{
+			const char SESSION_INFO_LABEL[] = "FSCP session";
+
+			const size_t SESSION_INFO_LABEL_LENGTH = sizeof(SESSION_INFO_LABEL) - 1;
+
+			typedef boost::shared_ptr<EVP_PKEY> evp_pkey_ptr;
+			typedef boost::shared_ptr<EVP_PKEY_CTX> evp_pkey_ctx_ptr;
+			typedef boost::shared_ptr<EVP_MD_CTX> evp_md_ctx_ptr;
+
+			const EVP_MD* get_signature_digest(EVP_PKEY* key)
+			{
+				// Ed25519 hashes the message itself.
+				return (EVP_PKEY_id(key) == EVP_PKEY_ED25519) ? NULL : EVP_get_digestbynid(MESSAGE_DIGEST_ALGORITHM);
+			}
+
+			void set_signature_padding(EVP_PKEY* key, EVP_PKEY_CTX* pctx)
+			{
+				if (EVP_PKEY_id(key) == EVP_PKEY_RSA)
+				{
+					if ((EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) <= 0) || (EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, -1) <= 0))
+					{
+						throw std::runtime_error("unable to set the signature padding");
+					}
+				}
+			}
+		}
+
+		bool is_supported()
+		{
+			return true;
+		}
+
+		size_t sign(void* sig, size_t sig_len, const void* buf, size_t buf_len, cryptoplus::pkey::pkey key)
+		{
+			evp_md_ctx_ptr ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+			EVP_PKEY_CTX* pctx = NULL;
+
+			if (!ctx || (EVP_DigestSignInit(ctx.get(), &pctx, get_signature_digest(key.raw()), NULL, key.raw()) <= 0))
+			{
+				throw std::runtime_error("unable to initialize the signature");
+			}
+
+			set_signature_padding(key.raw(), pctx);
+
+			size_t len = sig ? sig_len : 0;
+
+			if (EVP_DigestSign(ctx.get(), static_cast<unsigned char*>(sig), &len, static_cast<const unsigned char*>(buf), buf_len) <= 0)
+			{
+				throw std::runtime_error("unable to sign");
+			}
+
+			return len;
+		}
+
+		void check_signature(const void* sig, size_t sig_len, const void* buf, size_t buf_len, cryptoplus::pkey::pkey key)
+		{
+			evp_md_ctx_ptr ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+			EVP_PKEY_CTX* pctx = NULL;
+
+			if (!ctx || (EVP_DigestVerifyInit(ctx.get(), &pctx, get_signature_digest(key.raw()), NULL, key.raw()) <= 0))
+			{
+				throw std::runtime_error("unable to initialize the signature check");
+			}
+
+			set_signature_padding(key.raw(), pctx);
+
+			if (EVP_DigestVerify(ctx.get(), static_cast<const unsigned char*>(sig), sig_len, static_cast<const unsigned char*>(buf), buf_len) != 1)
+			{
+				throw std::runtime_error("signature mismatch");
+			}
+		}
+
+		ephemeral_key::ephemeral_key()
+		{
+			random_pool::get_random_bytes(m_private_key.c_array(), m_private_key.size());
+
+			evp_pkey_ptr key(EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, m_private_key.data(), m_private_key.size()), EVP_PKEY_free);
+
+			size_t len = m_public_key.size();
+
+			if (!key || (EVP_PKEY_get_raw_public_key(key.get(), m_public_key.c_array(), &len) <= 0) || (len != m_public_key.size()))
+			{
+				OPENSSL_cleanse(m_private_key.c_array(), m_private_key.size());
+
+				throw std::runtime_error("unable to generate the ephemeral key");
+			}
+		}
+
+		ephemeral_key::~ephemeral_key()
+		{
+			OPENSSL_cleanse(m_private_key.c_array(), m_private_key.size());
+		}
+
+		session_store ephemeral_key::derive_session(const key_type& peer_public_key, const challenge_type& challenge, session_store::session_number_type session_number, bool is_initiator) const
+		{
+			evp_pkey_ptr key(EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, m_private_key.data(), m_private_key.size()), EVP_PKEY_free);
+			evp_pkey_ptr peer_key(EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_public_key.data(), peer_public_key.size()), EVP_PKEY_free);
+
+			if (!key || !peer_key)
+			{
+				throw std::runtime_error("invalid ephemeral key");
+			}
+
+			boost::array<uint8_t, KEY_LENGTH> shared_secret;
+			boost::array<uint8_t, 2 * session_store::KEY_LENGTH> key_material;
+			boost::array<uint8_t, SESSION_INFO_LABEL_LENGTH + sizeof(session_store::session_number_type) + 2 * KEY_LENGTH> info;
+
+			const key_type& initiator_public_key = is_initiator ? m_public_key : peer_public_key;
+			const key_type& responder_public_key = is_initiator ? peer_public_key : m_public_key;
+
+			std::memcpy(info.c_array(), SESSION_INFO_LABEL, SESSION_INFO_LABEL_LENGTH);
+			buffer_tools::set<uint32_t>(info.c_array(), SESSION_INFO_LABEL_LENGTH, htonl(session_number));
+			std::memcpy(info.c_array() + SESSION_INFO_LABEL_LENGTH + sizeof(session_number), initiator_public_key.data(), KEY_LENGTH);
+			std::memcpy(info.c_array() + SESSION_INFO_LABEL_LENGTH + sizeof(session_number) + KEY_LENGTH, responder_public_key.data(), KEY_LENGTH);
+
+			bool success = false;
+
+			{
+				// X25519 refuses to produce the all-zero secret of a small-order peer key.
+				evp_pkey_ctx_ptr ctx(EVP_PKEY_CTX_new(key.get(), NULL), EVP_PKEY_CTX_free);
+				size_t len = shared_secret.size();
+
+				success = ctx
+				          && (EVP_PKEY_derive_init(ctx.get()) > 0)
+				          && (EVP_PKEY_derive_set_peer(ctx.get(), peer_key.get()) > 0)
+				          && (EVP_PKEY_derive(ctx.get(), shared_secret.c_array(), &len) > 0)
+				          && (len == shared_secret.size());
+			}
+
+			if (success)
+			{
+				evp_pkey_ctx_ptr ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL), EVP_PKEY_CTX_free);
+				size_t len = key_material.size();
+
+				success = ctx
+				          && (EVP_PKEY_derive_init(ctx.get()) > 0)
+				          && (EVP_PKEY_CTX_set_hkdf_md(ctx.get(), EVP_get_digestbynid(MESSAGE_DIGEST_ALGORITHM)) > 0)
+				          && (EVP_PKEY_CTX_set1_hkdf_salt(ctx.get(), challenge.data(), static_cast<int>(challenge.size())) > 0)
+				          && (EVP_PKEY_CTX_set1_hkdf_key(ctx.get(), shared_secret.data(), static_cast<int>(shared_secret.size())) > 0)
+				          && (EVP_PKEY_CTX_add1_hkdf_info(ctx.get(), info.data(), static_cast<int>(info.size())) > 0)
+				          && (EVP_PKEY_derive(ctx.get(), key_material.c_array(), &len) > 0)
+				          && (len == key_material.size());
+			}
+
+			OPENSSL_cleanse(shared_secret.c_array(), shared_secret.size());
+
+			if (!success)
+			{
+				OPENSSL_cleanse(key_material.c_array(), key_material.size());
+
+				throw std::runtime_error("unable to derive the session keys");
+			}
+
+			session_store result(session_number, key_material.data(), session_store::KEY_LENGTH, key_material.data() + session_store::KEY_LENGTH, session_store::KEY_LENGTH);
+
+			OPENSSL_cleanse(key_material.c_array(), key_material.size());
+
+			return result;
+		}
+#else
+		bool is_supported()
+		{
+			return false;
+		}
+
+		size_t sign(void*, size_t, const void*, size_t, cryptoplus::pkey::pkey)
+		{
+			throw std::runtime_error("ECDHE handshake not supported");
+		}
+
+		void check_signature(const void*, size_t, const void*, size_t, cryptoplus::pkey::pkey)
+		{
+			throw std::runtime_error("ECDHE handshake not supported");
+		}
+
+		ephemeral_key::ephemeral_key()
+		{
+			throw std::runtime_error("ECDHE handshake not supported");
+		}
+
+		ephemeral_key::~ephemeral_key()
+		{
+		}
+
+		session_store ephemeral_key::derive_session(const key_type&, const challenge_type&, session_store::session_number_type, bool) const
+		{
+			throw std::runtime_error("ECDHE handshake not supported");
+		}
+#endif
+	}
+}
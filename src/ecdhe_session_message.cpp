@@ -0,0 +1,112 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file ecdhe_session_message.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief An ECDHE session message class.
+ */
+
+#include "ecdhe_session_message.hpp"
+
+#include <cassert>
+#include <stdexcept>
+
+namespace fscp
+{
+	size_t ecdhe_session_message::write(void* buf, size_t buf_len, message_type type, session_number_type _session_number, const challenge_type& _challenge, const ecdhe::key_type& _public_key, channel_mask_type _authenticated_channels, session_flags_type _session_flags, cryptoplus::pkey::pkey sig_key)
+	{
+		assert((type == MESSAGE_TYPE_ECDHE_SESSION_REQUEST) || (type == MESSAGE_TYPE_ECDHE_SESSION));
+
+		if (buf_len < HEADER_LENGTH + MIN_BODY_LENGTH)
+		{
+			throw std::runtime_error("buf_len");
+		}
+
+		uint8_t* const payload = static_cast<uint8_t*>(buf) + HEADER_LENGTH;
+
+		buffer_tools::set<session_number_type>(payload, 0, htonl(_session_number));
+		std::memcpy(payload + sizeof(session_number_type), _challenge.data(), _challenge.size());
+		std::memcpy(payload + sizeof(session_number_type) + _challenge.size(), _public_key.data(), _public_key.size());
+		buffer_tools::set<channel_mask_type>(payload, FIELDS_LENGTH - sizeof(session_flags_type) - sizeof(channel_mask_type), htons(_authenticated_channels));
+		buffer_tools::set<session_flags_type>(payload, FIELDS_LENGTH - sizeof(session_flags_type), htons(_session_flags));
+
+		const signed_data_type signed_data = get_signed_data(type, payload);
+
+		const size_t signature_len = ecdhe::sign(payload + MIN_BODY_LENGTH, buf_len - HEADER_LENGTH - MIN_BODY_LENGTH, signed_data.data(), signed_data.size(), sig_key);
+
+		buffer_tools::set<uint16_t>(payload, FIELDS_LENGTH, htons(static_cast<uint16_t>(signature_len)));
+
+		message::write(buf, buf_len, CURRENT_PROTOCOL_VERSION, type, MIN_BODY_LENGTH + signature_len);
+
+		return HEADER_LENGTH + MIN_BODY_LENGTH + signature_len;
+	}
+
+	ecdhe_session_message::ecdhe_session_message(const message& _message) :
+		message(_message)
+	{
+		if (length() < MIN_BODY_LENGTH)
+		{
+			throw std::runtime_error("bad message length");
+		}
+
+		if (length() != MIN_BODY_LENGTH + signature_size())
+		{
+			throw std::runtime_error("bad message length");
+		}
+	}
+
+	void ecdhe_session_message::check_signature(cryptoplus::pkey::pkey key) const
+	{
+		assert(key);
+
+		const signed_data_type signed_data = get_signed_data(type(), payload());
+
+		ecdhe::check_signature(signature(), signature_size(), signed_data.data(), signed_data.size(), key);
+	}
+
+	ecdhe_session_message::signed_data_type ecdhe_session_message::get_signed_data(message_type _type, const void* fields)
+	{
+		// The type is signed too, so that a request cannot be replayed as a response.
+		signed_data_type result;
+
+		result[0] = static_cast<uint8_t>(_type);
+		std::memcpy(result.c_array() + 1, fields, FIELDS_LENGTH);
+
+		return result;
+	}
+}
@@ -56,16 +56,16 @@ namespace fscp
 		}
 	}
 
-	hello_request::hello_request(boost::asio::io_service& io_service, uint32_t _unique_number, const ep_type& _target, callback_type _callback, boost::posix_time::time_duration _timeout) :
+	hello_request::hello_request(boost::asio::io_service::strand& strand, uint32_t _unique_number, const ep_type& _target, callback_type _callback, boost::posix_time::time_duration _timeout) :
 		m_unique_number(_unique_number),
 		m_target(_target),
 		m_callback(_callback),
 		m_birthdate(boost::posix_time::microsec_clock::universal_time()),
-		m_timeout_timer(io_service, _timeout),
+		m_timeout_timer(strand.get_io_service(), _timeout),
 		m_cancel_status(false),
 		m_triggered(false)
 	{
-		m_timeout_timer.async_wait(boost::bind(&hello_request::handle_timeout, this, boost::asio::placeholders::error));
+		m_timeout_timer.async_wait(strand.wrap(boost::bind(&hello_request::handle_timeout, this, boost::asio::placeholders::error)));
 	}
 
 	void hello_request::handle_timeout(const boost::system::error_code& error)
@@ -44,6 +44,10 @@
 
 #include "message.hpp"
 
+#include <cryptoplus/hash/message_digest_context.hpp>
+
+#include <boost/static_assert.hpp>
+
 #include <cassert>
 #include <stdexcept>
 
@@ -77,4 +81,17 @@ namespace fscp
 		}
 	}
 
+	hash_type message::digest() const
+	{
+		BOOST_STATIC_ASSERT(default_cipher_suite::digest_size == hash_type::static_size);
+
+		hash_type result;
+
+		cryptoplus::hash::message_digest_context mdctx;
+		mdctx.initialize(cryptoplus::hash::message_digest_algorithm(MESSAGE_DIGEST_ALGORITHM));
+		mdctx.update(data(), size());
+		mdctx.finalize(result.c_array(), result.size());
+
+		return result;
+	}
 }
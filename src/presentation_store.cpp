@@ -51,16 +51,16 @@ namespace fscp
 {
 	presentation_store::presentation_store(presentation_store::cert_type sig_cert, presentation_store::cert_type enc_cert) :
 		m_sig_cert(sig_cert),
-		m_enc_cert(enc_cert),
-		m_sig_hash(get_certificate_hash(m_sig_cert))
+		m_enc_cert(enc_cert ? enc_cert : sig_cert),
+		m_sig_hash(get_certificate_hash(m_sig_cert)),
+		m_sig_key(m_sig_cert.public_key()),
+		m_enc_key(m_enc_cert.public_key()),
+		m_verified_signature_count(0),
+		m_verified_signature_index(0)
 	{
 		assert(sig_cert);
 
-		if (!enc_cert)
-		{
-			enc_cert = sig_cert;
-		}
-		else
+		if (enc_cert)
 		{
 			if (cryptoplus::x509::compare(sig_cert.subject(), enc_cert.subject()) != 0)
 			{
@@ -0,0 +1,162 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+
+/**
+ * \file random_pool.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A per-thread buffered random source.
+ */
+
+#include "random_pool.hpp"
+
+#include <cryptoplus/random/random.hpp>
+
+#include <boost/thread/tss.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/array.hpp>
+
+#include <openssl/crypto.h>
+
+#ifndef WINDOWS
+#include <pthread.h>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+
+namespace fscp
+{
+	namespace random_pool
+	{
+		namespace
+		{
+			/**
+			 * \brief The random bytes of a thread.
+			 *
+			 * The bytes are served from the end of the array.
+			 */
+			struct pool
+			{
+				pool() : available(0) {}
+
+				~pool()
+				{
+					OPENSSL_cleanse(bytes.c_array(), bytes.size());
+				}
+
+				boost::array<uint8_t, POOL_SIZE> bytes;
+				size_t available;
+			};
+
+			boost::thread_specific_ptr<pool> thread_pool;
+
+			boost::once_flag fork_handler_flag = BOOST_ONCE_INIT;
+
+			void register_fork_handler()
+			{
+#ifndef WINDOWS
+				// Only the forking thread survives in the child: discarding its pool is enough.
+				if (pthread_atfork(NULL, NULL, &discard) != 0)
+				{
+					throw std::runtime_error("unable to register the fork handler of the random pool");
+				}
+#endif
+			}
+
+			pool& get_thread_pool()
+			{
+				pool* result = thread_pool.get();
+
+				if (!result)
+				{
+					// A child process must not serve the bytes its parent already served.
+					boost::call_once(&register_fork_handler, fork_handler_flag);
+
+					result = new pool();
+					thread_pool.reset(result);
+				}
+
+				return *result;
+			}
+		}
+
+		void get_random_bytes(void* buf, size_t buf_len)
+		{
+			if (buf_len > MAX_POOLED_REQUEST_SIZE)
+			{
+				cryptoplus::random::get_random_bytes(buf, buf_len);
+
+				return;
+			}
+
+			pool& _pool = get_thread_pool();
+			uint8_t* out = static_cast<uint8_t*>(buf);
+
+			while (buf_len > 0)
+			{
+				if (_pool.available == 0)
+				{
+					cryptoplus::random::get_random_bytes(_pool.bytes.c_array(), _pool.bytes.size());
+					_pool.available = _pool.bytes.size();
+				}
+
+				const size_t cnt = std::min(buf_len, _pool.available);
+				uint8_t* const src = _pool.bytes.c_array() + _pool.available - cnt;
+
+				std::copy(src, src + cnt, out);
+				OPENSSL_cleanse(src, cnt);
+
+				_pool.available -= cnt;
+				out += cnt;
+				buf_len -= cnt;
+			}
+		}
+
+		void discard()
+		{
+			pool* _pool = thread_pool.get();
+
+			if (_pool)
+			{
+				OPENSSL_cleanse(_pool->bytes.c_array(), _pool->bytes.size());
+				_pool->available = 0;
+			}
+		}
+	}
+}
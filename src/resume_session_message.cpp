@@ -0,0 +1,115 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file resume_session_message.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A resume session message class.
+ */
+
+#include "resume_session_message.hpp"
+
+#include <openssl/crypto.h>
+
+#include <cassert>
+#include <stdexcept>
+
+namespace fscp
+{
+	size_t resume_session_message::write(void* buf, size_t buf_len, message_type type, const resumption_ticket& ticket, session_number_type _session_number, const challenge_type& _challenge, const resumption_ticket::nonce_type& _nonce, channel_mask_type _authenticated_channels, session_flags_type _session_flags)
+	{
+		assert((type == MESSAGE_TYPE_RESUME_SESSION_REQUEST) || (type == MESSAGE_TYPE_RESUME_SESSION));
+
+		if (buf_len < HEADER_LENGTH + BODY_LENGTH)
+		{
+			throw std::runtime_error("buf_len");
+		}
+
+		uint8_t* const payload = static_cast<uint8_t*>(buf) + HEADER_LENGTH;
+		uint8_t* field = payload;
+
+		std::memcpy(field, ticket.id().data(), ticket.id().size());
+		field += ticket.id().size();
+		buffer_tools::set<session_number_type>(field, 0, htonl(_session_number));
+		field += sizeof(session_number_type);
+		std::memcpy(field, _challenge.data(), _challenge.size());
+		field += _challenge.size();
+		std::memcpy(field, _nonce.data(), _nonce.size());
+		field += _nonce.size();
+		buffer_tools::set<channel_mask_type>(field, 0, htons(_authenticated_channels));
+		field += sizeof(channel_mask_type);
+		buffer_tools::set<session_flags_type>(field, 0, htons(_session_flags));
+
+		compute_mac(payload + FIELDS_LENGTH, type, payload, ticket);
+
+		message::write(buf, buf_len, CURRENT_PROTOCOL_VERSION, type, BODY_LENGTH);
+
+		return HEADER_LENGTH + BODY_LENGTH;
+	}
+
+	resume_session_message::resume_session_message(const message& _message) :
+		message(_message)
+	{
+		if (length() != BODY_LENGTH)
+		{
+			throw std::runtime_error("bad message length");
+		}
+	}
+
+	void resume_session_message::check_mac(const resumption_ticket& ticket) const
+	{
+		boost::array<uint8_t, resumption_ticket::MAC_LENGTH> mac;
+
+		compute_mac(mac.c_array(), type(), payload(), ticket);
+
+		if (CRYPTO_memcmp(mac.data(), payload() + FIELDS_LENGTH, mac.size()) != 0)
+		{
+			throw std::runtime_error("mac mismatch");
+		}
+	}
+
+	void resume_session_message::compute_mac(void* mac, message_type _type, const void* fields, const resumption_ticket& ticket)
+	{
+		// The type is covered too, so that a request cannot be replayed as a response.
+		boost::array<uint8_t, 1 + FIELDS_LENGTH> data;
+
+		data[0] = static_cast<uint8_t>(_type);
+		std::memcpy(data.c_array() + 1, fields, FIELDS_LENGTH);
+
+		ticket.compute_mac(mac, resumption_ticket::MAC_LENGTH, data.data(), data.size());
+	}
+}
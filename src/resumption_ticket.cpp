@@ -0,0 +1,175 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+/**
+ * \file resumption_ticket.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief A session resumption ticket class.
+ */
+
+#include "resumption_ticket.hpp"
+
+#include "buffer_tools.hpp"
+
+#include <cryptoplus/hash/hmac_context.hpp>
+
+#include <boost/static_assert.hpp>
+
+#include <openssl/crypto.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+namespace fscp
+{
+	namespace
+	{
+		const char TICKET_INFO_LABEL[] = "FSCP resumption ticket";
+		const char SESSION_INFO_LABEL[] = "FSCP resumed session";
+
+		/**
+		 * \brief HKDF-SHA256 (RFC 5869).
+		 * \param okm The output keying material.
+		 * \param okm_len The length of okm. Cannot exceed 255 digests.
+		 * \param salt The salt.
+		 * \param salt_len The length of salt.
+		 * \param ikm The input keying material.
+		 * \param ikm_len The length of ikm.
+		 * \param info The info.
+		 * \param info_len The length of info.
+		 */
+		void hkdf(void* okm, size_t okm_len, const void* salt, size_t salt_len, const void* ikm, size_t ikm_len, const void* info, size_t info_len)
+		{
+			const cryptoplus::hash::message_digest_algorithm algorithm(MESSAGE_DIGEST_ALGORITHM);
+
+			boost::array<uint8_t, default_cipher_suite::digest_size> prk;
+			boost::array<uint8_t, default_cipher_suite::digest_size> block;
+
+			assert(okm_len <= 255 * block.size());
+
+			cryptoplus::hash::hmac_context hmac_context;
+
+			hmac_context.initialize(salt, salt_len, &algorithm);
+			hmac_context.update(ikm, ikm_len);
+			hmac_context.finalize(prk.c_array(), prk.size());
+
+			size_t block_len = 0;
+
+			for (uint8_t counter = 1; okm_len > 0; ++counter)
+			{
+				hmac_context.initialize(prk.data(), prk.size(), &algorithm);
+				hmac_context.update(block.data(), block_len);
+				hmac_context.update(info, info_len);
+				hmac_context.update(&counter, sizeof(counter));
+				block_len = hmac_context.finalize(block.c_array(), block.size());
+
+				const size_t cnt = std::min(block_len, okm_len);
+
+				std::memcpy(okm, block.data(), cnt);
+				okm = static_cast<uint8_t*>(okm) + cnt;
+				okm_len -= cnt;
+			}
+
+			OPENSSL_cleanse(prk.c_array(), prk.size());
+			OPENSSL_cleanse(block.c_array(), block.size());
+		}
+	}
+
+	resumption_ticket::resumption_ticket(const session_store& session, const hash_type& _peer_certificate_hash, const boost::posix_time::ptime& _expiration_date) :
+		m_peer_certificate_hash(_peer_certificate_hash),
+		m_expiration_date(_expiration_date)
+	{
+		boost::array<uint8_t, 2 * session_store::KEY_LENGTH> ikm;
+		boost::array<uint8_t, TICKET_ID_LENGTH + 2 * session_store::KEY_LENGTH> okm;
+
+		std::memcpy(ikm.c_array(), session.seal_key(), session.seal_key_size());
+		std::memcpy(ikm.c_array() + session.seal_key_size(), session.encryption_key(), session.encryption_key_size());
+
+		hkdf(okm.c_array(), okm.size(), NULL, 0, ikm.data(), ikm.size(), TICKET_INFO_LABEL, sizeof(TICKET_INFO_LABEL) - 1);
+
+		std::memcpy(m_id.c_array(), okm.data(), m_id.size());
+		std::memcpy(m_secret.c_array(), okm.data() + m_id.size(), m_secret.size());
+		std::memcpy(m_mac_key.c_array(), okm.data() + m_id.size() + m_secret.size(), m_mac_key.size());
+
+		OPENSSL_cleanse(ikm.c_array(), ikm.size());
+		OPENSSL_cleanse(okm.c_array(), okm.size());
+	}
+
+	resumption_ticket::~resumption_ticket()
+	{
+		OPENSSL_cleanse(m_secret.c_array(), m_secret.size());
+		OPENSSL_cleanse(m_mac_key.c_array(), m_mac_key.size());
+	}
+
+	void resumption_ticket::compute_mac(void* mac, size_t mac_len, const void* buf, size_t buf_len) const
+	{
+		BOOST_STATIC_ASSERT(MAC_LENGTH == default_cipher_suite::digest_size);
+
+		if (mac_len < MAC_LENGTH)
+		{
+			throw std::runtime_error("mac_len");
+		}
+
+		const cryptoplus::hash::message_digest_algorithm algorithm(MESSAGE_DIGEST_ALGORITHM);
+
+		cryptoplus::hash::hmac_context hmac_context;
+
+		hmac_context.initialize(m_mac_key.data(), m_mac_key.size(), &algorithm);
+		hmac_context.update(buf, buf_len);
+		hmac_context.finalize(mac, mac_len);
+	}
+
+	session_store resumption_ticket::derive_session(session_store::session_number_type session_number, const challenge_type& challenge, const nonce_type& nonce) const
+	{
+		boost::array<uint8_t, sizeof(SESSION_INFO_LABEL) - 1 + sizeof(session_store::session_number_type) + NONCE_LENGTH> info;
+		boost::array<uint8_t, 2 * session_store::KEY_LENGTH> okm;
+
+		std::memcpy(info.c_array(), SESSION_INFO_LABEL, sizeof(SESSION_INFO_LABEL) - 1);
+		buffer_tools::set<uint32_t>(info.c_array(), sizeof(SESSION_INFO_LABEL) - 1, htonl(session_number));
+		std::memcpy(info.c_array() + sizeof(SESSION_INFO_LABEL) - 1 + sizeof(session_number), nonce.data(), nonce.size());
+
+		hkdf(okm.c_array(), okm.size(), challenge.data(), challenge.size(), m_secret.data(), m_secret.size(), info.data(), info.size());
+
+		session_store result(session_number, okm.data(), session_store::KEY_LENGTH, okm.data() + session_store::KEY_LENGTH, session_store::KEY_LENGTH);
+
+		OPENSSL_cleanse(okm.c_array(), okm.size());
+
+		return result;
+	}
+}
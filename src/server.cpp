@@ -51,12 +51,19 @@
 #include "clear_session_request_message.hpp"
 #include "session_message.hpp"
 #include "clear_session_message.hpp"
+#include "ecdhe_session_message.hpp"
+#include "resume_session_message.hpp"
 #include "data_message.hpp"
+#include "data_path.hpp"
+#include "random_pool.hpp"
 
 #include <boost/bind.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/functional/hash.hpp>
 
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 
 using namespace boost;
 
@@ -79,28 +86,164 @@ namespace fscp
 
 			return ep;
 		}
+
+		bool accepts_data_message(const session_store& session, const data_message& _data_message, size_t replay_window_size)
+		{
+			// Authenticated-only data is only accepted on the channels we agreed on.
+			if (is_authenticated_data_message_type(_data_message.type()) && !(to_channel_mask(to_channel_number(_data_message.type())) & session.authenticated_channels()))
+			{
+				return false;
+			}
+
+			return session.can_accept_sequence_number(session.extend_sequence_number(_data_message.sequence_number()), replay_window_size);
+		}
+
+		size_t check_seal_and_get_cleartext(const data_message& _data_message, void* buf, size_t buf_len, const session_keys& keys, extended_sequence_number_type sequence_number)
+		{
+			const sequence_number_type sequence_number_high = static_cast<sequence_number_type>(sequence_number >> 32);
+
+			// The content of a keep-alive is meaningless: checking the seal is enough, there is nothing to decipher.
+			if (_data_message.type() == MESSAGE_TYPE_KEEP_ALIVE)
+			{
+				_data_message.check_seal(keys, sequence_number_high);
+
+				return 0;
+			}
+
+			return _data_message.check_seal_and_get_cleartext(buf, buf_len, keys, sequence_number_high);
+		}
+
+		void resize_worker_pool(std::vector<boost::shared_ptr<background_worker> >& workers, size_t count)
+		{
+			workers.resize(count);
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (!workers[i])
+				{
+					workers[i] = boost::make_shared<background_worker>();
+				}
+			}
+		}
+
+		// An upper bound of what a data message adds to its cleartext.
+		const size_t DATA_MESSAGE_OVERHEAD = 256;
+
+		void pin_worker_pool(std::vector<boost::shared_ptr<background_worker> >& workers, const std::vector<unsigned int>& cpus)
+		{
+			workers.clear();
+
+			for (std::vector<unsigned int>::const_iterator cpu = cpus.begin(); cpu != cpus.end(); ++cpu)
+			{
+				workers.push_back(boost::make_shared<background_worker>(*cpu));
+			}
+		}
+
+		void call_data_message_callback(server::data_message_callback callback, const server::ep_type& sender, channel_number_type channel_number, data_store::pointer_data_type data)
+		{
+			callback(sender, channel_number, boost::asio::buffer(*data));
+		}
+
+		std::vector<uint8_t> copy_message(const message& _message)
+		{
+			return std::vector<uint8_t>(_message.data(), _message.data() + _message.size());
+		}
+
+		std::vector<uint8_t> copy_message(const clear_session_request_message& _message)
+		{
+			return clear_session_request_message::write<uint8_t>(_message.session_number(), _message.challenge(), _message.session_flags());
+		}
+
+		std::vector<uint8_t> copy_message(const clear_session_message& _message)
+		{
+			return clear_session_message::write<uint8_t>(
+			           _message.session_number(),
+			           _message.challenge(),
+			           _message.seal_key(),
+			           _message.seal_key_size(),
+			           _message.encryption_key(),
+			           _message.encryption_key_size(),
+			           _message.authenticated_channels(),
+			           _message.session_flags()
+			       );
+		}
+
+		void apply_session_flags(session_store& session, session_flags_type session_flags)
+		{
+			session.set_extended_sequence_numbers((session_flags & SESSION_FLAG_EXTENDED_SEQUENCE_NUMBERS) != 0);
+		}
+
+		template <typename MessageType>
+		void check_signature(const MessageType& _message, presentation_store& presentation)
+		{
+			if (!presentation.signature_key())
+			{
+				throw std::runtime_error("no presentation");
+			}
+
+			// A retransmitted message was already verified: skip the public key operation.
+			const hash_type digest = _message.digest();
+
+			if (!presentation.is_signature_verified(digest))
+			{
+				_message.check_signature(presentation.signature_key());
+
+				presentation.set_signature_verified(digest);
+			}
+		}
 	}
 
 	server::server(asio::io_service& io_service, const identity_store& _identity) :
 		m_data(0),
+		m_strand(io_service),
 		m_socket(io_service),
 		m_identity_store(_identity),
+		m_receiving(false),
+		m_receive_paused(false),
 		m_hello_current_unique_number(0),
 		m_accept_hello_messages_default(true),
 		m_hello_message_callback(0),
 		m_presentation_message_callback(0),
 		m_accept_session_request_messages_default(true),
 		m_session_request_message_callback(0),
+		m_ecdhe_handshake(false),
+		m_resumption_ticket_lifetime(),
+		m_session_pregeneration_threshold(0.75),
 		m_accept_session_messages_default(true),
 		m_session_message_callback(0),
 		m_session_established_callback(0),
 		m_session_lost_callback(0),
+		m_data_submission_drain_pending(false),
 		m_data_message_callback(0),
+		m_authenticated_only_channels(0),
+		m_extended_sequence_numbers(false),
+		m_replay_window_size(DEFAULT_REPLAY_WINDOW_SIZE),
+		m_next_handshake_worker(0),
+		m_handshake_queue_size(DEFAULT_HANDSHAKE_QUEUE_SIZE),
+		m_dropped_handshake_count(0),
+		m_next_receive_worker(0),
+		m_receive_queue_size(DEFAULT_RECEIVE_QUEUE_SIZE),
+		m_receive_job_count(0),
+		m_dropped_receive_count(0),
 		m_contact_request_message_callback(0),
 		m_contact_message_callback(0),
 		m_network_error_callback(0),
-		m_keep_alive_timer(io_service, SESSION_KEEP_ALIVE_PERIOD)
+		m_keep_alive_timer(io_service, SESSION_KEEP_ALIVE_PERIOD),
+		m_decision_timeout(DEFAULT_DECISION_TIMEOUT),
+		m_next_decision_id(0),
+		m_decision_queue_size(DEFAULT_DECISION_QUEUE_SIZE),
+		m_dropped_decision_count(0)
+	{
+		// The data path kernel is selected now rather than on the first message.
+		get_data_path_kernel();
+	}
+
+	server::~server()
 	{
+		if (m_callback_queue)
+		{
+			m_callback_queue->detach_room_handler();
+		}
 	}
 
 	void server::open(const ep_type& listen_endpoint)
@@ -115,40 +258,139 @@ namespace fscp
 
 		m_socket.bind(listen_endpoint);
 
+		m_receive_paused = false;
 		async_receive();
-		m_keep_alive_timer.async_wait(boost::bind(&server::do_check_keep_alive, this, boost::asio::placeholders::error));
+		m_keep_alive_timer.async_wait(m_strand.wrap(boost::bind(&server::do_check_keep_alive, this, boost::asio::placeholders::error)));
 	}
 
-	void server::close()
+	void server::set_receive_worker_count(size_t count)
 	{
-		get_io_service().post(boost::bind(&hello_request_list::clear, &m_hello_request_list));
+		if (m_socket.is_open())
+		{
+			throw std::runtime_error("cannot change the receive workers of an open server");
+		}
 
-		m_keep_alive_timer.cancel();
-		m_socket.close();
+		resize_worker_pool(m_receive_workers, count);
+	}
+
+	void server::set_receive_worker_cpus(const std::vector<unsigned int>& cpus)
+	{
+		if (m_socket.is_open())
+		{
+			throw std::runtime_error("cannot change the receive workers of an open server");
+		}
+
+		pin_worker_pool(m_receive_workers, cpus);
+	}
+
+	void server::set_send_worker_count(size_t count)
+	{
+		if (m_socket.is_open())
+		{
+			throw std::runtime_error("cannot change the send workers of an open server");
+		}
+
+		resize_worker_pool(m_send_workers, count);
+	}
+
+	void server::set_send_worker_cpus(const std::vector<unsigned int>& cpus)
+	{
+		if (m_socket.is_open())
+		{
+			throw std::runtime_error("cannot change the send workers of an open server");
+		}
+
+		pin_worker_pool(m_send_workers, cpus);
+	}
+
+	void server::set_handshake_worker_count(size_t count)
+	{
+		if (m_socket.is_open())
+		{
+			throw std::runtime_error("cannot change the handshake workers of an open server");
+		}
+
+		resize_worker_pool(m_handshake_workers, count);
+	}
+
+	void server::set_handshake_worker_cpus(const std::vector<unsigned int>& cpus)
+	{
+		if (m_socket.is_open())
+		{
+			throw std::runtime_error("cannot change the handshake workers of an open server");
+		}
+
+		pin_worker_pool(m_handshake_workers, cpus);
+	}
+
+	void server::set_crypto_scheduler(boost::shared_ptr<crypto_scheduler> scheduler)
+	{
+		if (m_socket.is_open())
+		{
+			throw std::runtime_error("cannot change the crypto scheduler of an open server");
+		}
+
+		m_crypto_scheduler_client.reset(scheduler ? new crypto_scheduler::client(scheduler) : NULL);
+	}
+
+	void server::set_callback_executor(callback_executor_type executor, size_t queue_size, callback_queue::overflow_policy policy)
+	{
+		if (m_socket.is_open())
+		{
+			throw std::runtime_error("cannot change the callback executor of an open server");
+		}
+
+		if (queue_size == 0)
+		{
+			throw std::runtime_error("the callback queue cannot be empty");
+		}
+
+		// The previous queue may still be run by its executor: it must not resume the receive anymore.
+		if (m_callback_queue)
+		{
+			m_callback_queue->detach_room_handler();
+		}
+
+		if (executor)
+		{
+			m_callback_queue = boost::make_shared<callback_queue>(executor, queue_size, policy, m_strand.wrap(boost::bind(&server::resume_receive, this)));
+		}
+		else
+		{
+			m_callback_queue.reset();
+		}
+	}
+
+	void server::close()
+	{
+		// The strand handlers use the socket: it is only closed from the strand.
+		m_strand.post(boost::bind(&server::do_close, this));
 	}
 
 	void server::set_identity(const identity_store& _identity)
 	{
-		get_io_service().post(bind(&server::do_set_identity, this, _identity));
+		m_strand.post(bind(&server::do_set_identity, this, _identity));
 	}
 
 	void server::async_greet(ep_type target, hello_request::callback_type callback, const boost::posix_time::time_duration& timeout)
 	{
-		get_io_service().post(bind(&server::do_greet, this, normalize(target), callback, timeout));
+		m_strand.post(bind(&server::do_greet, this, normalize(target), callback, timeout));
 	}
 
 	void server::async_introduce_to(ep_type target)
 	{
-		get_io_service().post(bind(&server::do_introduce_to, this, normalize(target)));
+		m_strand.post(bind(&server::do_introduce_to, this, normalize(target)));
 	}
 
-	const presentation_store& server::get_presentation(ep_type target) const
+	presentation_store server::get_presentation(ep_type target) const
 	{
 		normalize(target);
 
-		presentation_store_map::const_iterator presentation_it = m_presentation_map.find(target);
+		// The shard version is immutable: it can be read without a lock, for as long as we hold it.
+		const presentation_snapshot_map::snapshot_type presentations = m_presentation_snapshot.shard_of(target);
+		const presentation_store_map::const_iterator presentation_it = presentations->find(target);
 
-		if (presentation_it != m_presentation_map.end())
+		if (presentation_it != presentations->end())
 		{
 			return presentation_it->second;
 		}
@@ -167,48 +409,41 @@ namespace fscp
 			enc_cert = sig_cert;
 		}
 
-		m_presentation_map[target] = presentation_store(sig_cert, enc_cert);
+		const presentation_store presentation(sig_cert, enc_cert);
+
+		set_presentation_snapshot(target, &presentation);
+
+		m_strand.post(bind(&server::do_set_presentation, this, target, presentation));
 	}
 
 	void server::clear_presentation(ep_type target)
 	{
 		normalize(target);
 
-		m_presentation_map.erase(target);
+		set_presentation_snapshot(target, NULL);
+
+		m_strand.post(bind(&server::do_clear_presentation, this, target));
 	}
 
 	void server::async_request_session(ep_type target)
 	{
 		normalize(target);
 
-		get_io_service().post(bind(&server::do_request_session, this, target));
+		m_strand.post(bind(&server::do_request_session, this, target));
 	}
 
 	bool server::has_session(ep_type host) const
 	{
 		normalize(host);
 
-		session_pair_map::const_iterator session_pair = m_session_map.find(host);
-
-		if (session_pair != m_session_map.end())
-		{
-			return session_pair->second.has_remote_session();
-		}
-
-		return false;
+		return m_session_endpoints.contains(host);
 	}
 
 	std::vector<server::ep_type> server::get_session_endpoints() const
 	{
 		std::vector<server::ep_type> result;
 
-		for (session_pair_map::const_iterator session_pair = m_session_map.begin(); session_pair != m_session_map.end(); ++session_pair)
-		{
-			if (session_pair->second.has_remote_session())
-			{
-				result.push_back(session_pair->first);
-			}
-		}
+		m_session_endpoints.copy_keys(std::back_inserter(result));
 
 		return result;
 	}
@@ -217,62 +452,64 @@ namespace fscp
 	{
 		normalize(host);
 
-		get_io_service().post(bind(&server::do_close_session, this, host));
+		m_strand.post(bind(&server::do_close_session, this, host));
 	}
 
 	void server::async_send_data(ep_type target, channel_number_type channel_number, boost::asio::const_buffer data)
 	{
 		normalize(target);
 
-		m_data_map[target].push(data);
+		// The data is copied right away: the caller may reuse its buffer as soon as we return.
+		const data_submission submission = { target, channel_number, data_store::make_pointer(data) };
 
-		get_io_service().post(bind(&server::do_send_data, this, target, channel_number));
-	}
-
-	void server::async_send_data_to_all(channel_number_type channel_number, boost::asio::const_buffer data)
-	{
-		for (session_pair_map::const_iterator session_pair = m_session_map.begin(); session_pair != m_session_map.end(); ++session_pair)
+		if (m_data_submission_queue.push(submission))
 		{
-			if (session_pair->second.has_remote_session())
+			// Only the first submission since the last drain wakes the strand up.
+			if (!m_data_submission_drain_pending.exchange(true))
+			{
+				m_strand.post(bind(&server::do_drain_data_submissions, this));
+			}
+		}
+		else
+		{
+			// The queue is full: waiting for it to drain could deadlock if we are called from a handler, so we take the slow path instead.
 			{
-				async_send_data(session_pair->first, channel_number, data);
+				boost::mutex::scoped_lock lock(m_data_map_mutex);
+
+				m_data_map[target].push(submission.data);
 			}
+
+			m_strand.post(bind(&server::do_send_data, this, target, channel_number));
 		}
 	}
 
-	void server::async_send_contact_request(ep_type target, cert_type cert)
+	void server::async_send_data_to_all(channel_number_type channel_number, boost::asio::const_buffer data)
 	{
-		const hash_type hash = get_certificate_hash(cert);
-
-		if (!has_session(hash))
+		if (has_crypto_workers(m_send_workers))
 		{
-			normalize(target);
+			m_strand.post(bind(&server::do_send_data_to_all, this, channel_number, data_store::make_pointer(data)));
 
-			m_hash_to_cert[hash] = cert;
-			m_hash_list_map[target].push_back(hash);
+			return;
+		}
+
+		const std::vector<ep_type> session_endpoints = get_session_endpoints();
 
-			get_io_service().post(bind(&server::do_send_contact_request, this, target));
+		for (std::vector<ep_type>::const_iterator session_endpoint = session_endpoints.begin(); session_endpoint != session_endpoints.end(); ++session_endpoint)
+		{
+			async_send_data(*session_endpoint, channel_number, data);
 		}
 	}
 
-	void server::async_send_contact_request_to_all(cert_type cert)
+	void server::async_send_contact_request(ep_type target, cert_type cert)
 	{
-		const hash_type hash = get_certificate_hash(cert);
-
-		if (!has_session(hash))
-		{
-			m_hash_to_cert[hash] = cert;
+		normalize(target);
 
-			for (session_pair_map::const_iterator session_pair = m_session_map.begin(); session_pair != m_session_map.end(); ++session_pair)
-			{
-				if (session_pair->second.has_remote_session())
-				{
-					m_hash_list_map[session_pair->first].push_back(hash);
+		m_strand.post(bind(&server::do_request_contact, this, target, cert));
+	}
 
-					get_io_service().post(bind(&server::do_send_contact_request, this, session_pair->first));
-				}
-			}
-		}
+	void server::async_send_contact_request_to_all(cert_type cert)
+	{
+		m_strand.post(bind(&server::do_request_contact_from_all, this, cert));
 	}
 
 	/* Identity update */
@@ -289,13 +526,26 @@ namespace fscp
 
 	/* Common */
 
+	void server::do_close()
+	{
+		m_hello_request_list.clear();
+		clear_pending_decisions();
+
+		m_keep_alive_timer.cancel();
+		m_socket.close();
+	}
+
 	void server::async_receive()
 	{
-		m_socket.async_receive_from(asio::buffer(m_recv_buffer), m_sender_endpoint, bind(&server::handle_receive_from, this, asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+		m_receiving = true;
+
+		m_socket.async_receive_from(asio::buffer(m_recv_buffer), m_sender_endpoint, m_strand.wrap(bind(&server::handle_receive_from, this, asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 	}
 
 	void server::handle_receive_from(const boost::system::error_code& error, size_t bytes_recvd)
 	{
+		m_receiving = false;
+
 		normalize(m_sender_endpoint);
 
 		if (m_socket.is_open())
@@ -324,6 +574,22 @@ namespace fscp
 						case MESSAGE_TYPE_DATA_13:
 						case MESSAGE_TYPE_DATA_14:
 						case MESSAGE_TYPE_DATA_15:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_0:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_1:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_2:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_3:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_4:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_5:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_6:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_7:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_8:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_9:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_10:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_11:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_12:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_13:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_14:
+						case MESSAGE_TYPE_AUTHENTICATED_DATA_15:
 						case MESSAGE_TYPE_CONTACT_REQUEST:
 						case MESSAGE_TYPE_CONTACT:
 						case MESSAGE_TYPE_KEEP_ALIVE:
@@ -355,7 +621,14 @@ namespace fscp
 							{
 								session_request_message session_request_message(message, m_identity_store.encryption_key().size());
 
-								handle_session_request_message_from(session_request_message, m_sender_endpoint);
+								if (!has_crypto_workers(m_handshake_workers))
+								{
+									handle_session_request_message_from(session_request_message, m_sender_endpoint);
+								}
+								else
+								{
+									dispatch_handshake_message(message, session_request_message.digest(), m_sender_endpoint);
+								}
 
 								break;
 							}
@@ -363,7 +636,48 @@ namespace fscp
 							{
 								session_message session_message(message, m_identity_store.encryption_key().size());
 
-								handle_session_message_from(session_message, m_sender_endpoint);
+								if (!has_crypto_workers(m_handshake_workers))
+								{
+									handle_session_message_from(session_message, m_sender_endpoint);
+								}
+								else
+								{
+									dispatch_handshake_message(message, session_message.digest(), m_sender_endpoint);
+								}
+
+								break;
+							}
+						case MESSAGE_TYPE_ECDHE_SESSION_REQUEST:
+							{
+								ecdhe_session_message ecdhe_session_message(message);
+
+								handle_ecdhe_session_request_message_from(ecdhe_session_message, m_sender_endpoint);
+
+								break;
+							}
+						case MESSAGE_TYPE_ECDHE_SESSION:
+							{
+								ecdhe_session_message ecdhe_session_message(message);
+
+								handle_ecdhe_session_message_from(ecdhe_session_message, m_sender_endpoint);
+
+								break;
+							}
+						case MESSAGE_TYPE_RESUME_SESSION_REQUEST:
+							{
+								resume_session_message resume_session_message(message);
+
+								handle_resume_session_request_message_from(resume_session_message, m_sender_endpoint);
+
+								break;
+							}
+						case MESSAGE_TYPE_RESUME_SESSION:
+							{
+								resume_session_message resume_session_message(message);
+
+								handle_resume_session_message_from(resume_session_message, m_sender_endpoint);
+
+								break;
 							}
 						default:
 							{
@@ -387,7 +701,24 @@ namespace fscp
 				}
 			}
 
-			async_receive();
+			// The callback queue is full: reading resumes once it has room.
+			if (!m_receive_paused)
+			{
+				async_receive();
+			}
+		}
+	}
+
+	void server::resume_receive()
+	{
+		if (m_receive_paused)
+		{
+			m_receive_paused = false;
+
+			if (m_socket.is_open() && !m_receiving)
+			{
+				async_receive();
+			}
 		}
 	}
 
@@ -397,7 +728,7 @@ namespace fscp
 	{
 		if (m_socket.is_open())
 		{
-			boost::shared_ptr<hello_request> _hello_request(new hello_request(get_io_service(), m_hello_current_unique_number, target, callback, timeout));
+			boost::shared_ptr<hello_request> _hello_request(new hello_request(m_strand, m_hello_current_unique_number, target, callback, timeout));
 
 			erase_expired_hello_requests(m_hello_request_list);
 
@@ -411,15 +742,27 @@ namespace fscp
 		}
 	}
 
-	void server::handle_hello_message_from(const hello_message& _hello_message, const ep_type& sender)
+	void server::handle_hello_message_from(const hello_message& _hello_message, const ep_type& sender, bool approved)
 	{
 		switch (_hello_message.type())
 		{
 			case MESSAGE_TYPE_HELLO_REQUEST:
 				{
-					bool can_reply = m_accept_hello_messages_default;
+					if (!approved && m_async_hello_message_callback)
+					{
+						const decision_handler decision = make_decision(sender, MESSAGE_TYPE_HELLO_REQUEST, boost::bind(&server::replay_message, this, copy_message(_hello_message), sender));
+
+						if (decision)
+						{
+							m_async_hello_message_callback(sender, m_accept_hello_messages_default, decision);
+						}
+
+						break;
+					}
 
-					if (m_hello_message_callback)
+					bool can_reply = approved || m_accept_hello_messages_default;
+
+					if (!approved && m_hello_message_callback)
 					{
 						can_reply = m_hello_message_callback(sender, m_accept_hello_messages_default);
 					}
@@ -464,11 +807,23 @@ namespace fscp
 		}
 	}
 
-	void server::handle_presentation_message_from(const presentation_message& _presentation_message, const ep_type& sender)
+	void server::handle_presentation_message_from(const presentation_message& _presentation_message, const ep_type& sender, bool approved)
 	{
+		if (!approved && m_async_presentation_message_callback)
+		{
+			const decision_handler decision = make_decision(sender, MESSAGE_TYPE_PRESENTATION, boost::bind(&server::replay_message, this, copy_message(_presentation_message), sender));
+
+			if (decision)
+			{
+				m_async_presentation_message_callback(sender, _presentation_message.signature_certificate(), _presentation_message.encryption_certificate(), m_presentation_map.find(sender) == m_presentation_map.end(), decision);
+			}
+
+			return;
+		}
+
 		bool accept = true;
 
-		if (m_presentation_message_callback)
+		if (!approved && m_presentation_message_callback)
 		{
 			if (!m_presentation_message_callback(sender, _presentation_message.signature_certificate(), _presentation_message.encryption_certificate(), m_presentation_map.find(sender) == m_presentation_map.end()))
 			{
@@ -478,23 +833,76 @@ namespace fscp
 
 		if (accept)
 		{
-			m_presentation_map[sender] = presentation_store(_presentation_message.signature_certificate(), _presentation_message.encryption_certificate());
+			do_set_presentation(sender, presentation_store(_presentation_message.signature_certificate(), _presentation_message.encryption_certificate()));
 		}
 	}
 
-	/* Session request messages */
-
-	void server::do_request_session(const ep_type& target)
+	void server::do_set_presentation(const ep_type& target, const presentation_store& presentation)
 	{
-		if (m_socket.is_open())
-		{
-			session_pair& session = m_session_map[target];
+		m_presentation_map[target] = presentation;
 
-			session_store::session_number_type session_number = session.has_remote_session() ? session.remote_session().session_number() + 1 : 0;
+		set_presentation_snapshot(target, &presentation);
+	}
 
-			std::vector<uint8_t> cleartext = clear_session_request_message::write<uint8_t>(session_number, session.generate_local_challenge());
+	void server::do_clear_presentation(const ep_type& target)
+	{
+		m_presentation_map.erase(target);
+
+		set_presentation_snapshot(target, NULL);
+	}
+
+	size_t server::endpoint_hash::operator()(const ep_type& ep) const
+	{
+		size_t seed = ep.port();
+
+		if (ep.address().is_v4())
+		{
+			boost::hash_combine(seed, ep.address().to_v4().to_ulong());
+		}
+		else
+		{
+			const boost::asio::ip::address_v6::bytes_type bytes = ep.address().to_v6().to_bytes();
+
+			boost::hash_range(seed, bytes.begin(), bytes.end());
+		}
+
+		return seed;
+	}
+
+	void server::set_presentation_snapshot(const ep_type& target, const presentation_store* presentation)
+	{
+		if (presentation)
+		{
+			m_presentation_snapshot.set(target, *presentation);
+		}
+		else
+		{
+			m_presentation_snapshot.erase(target);
+		}
+	}
+
+	/* Session request messages */
+
+	void server::do_request_session(const ep_type& target)
+	{
+		if (do_request_resumed_session(target))
+		{
+			return;
+		}
+
+		if (m_ecdhe_handshake)
+		{
+			do_request_ecdhe_session(target);
+		}
+		else if (m_socket.is_open())
+		{
+			session_pair& session = m_session_map[target];
+
+			session_store::session_number_type session_number = session.has_remote_session() ? session.remote_session().session_number() + 1 : 0;
+
+			std::vector<uint8_t> cleartext = clear_session_request_message::write<uint8_t>(session_number, session.generate_local_challenge(), get_requested_session_flags());
 
-			size_t size = session_request_message::write(m_send_buffer.data(), m_send_buffer.size(), &cleartext[0], cleartext.size(), m_presentation_map[target].encryption_certificate().public_key(), m_identity_store.signature_key());
+			size_t size = session_request_message::write(m_send_buffer.data(), m_send_buffer.size(), &cleartext[0], cleartext.size(), m_presentation_map[target].encryption_key(), m_identity_store.signature_key());
 
 			send_to(asio::buffer(m_send_buffer.data(), size), target);
 		}
@@ -502,7 +910,7 @@ namespace fscp
 
 	void server::handle_session_request_message_from(const session_request_message& _session_request_message, const ep_type& sender)
 	{
-		_session_request_message.check_signature(m_presentation_map[sender].signature_certificate().public_key());
+		check_signature(_session_request_message, m_presentation_map[sender]);
 
 		std::vector<uint8_t> cleartext = _session_request_message.get_cleartext<uint8_t>(m_identity_store.encryption_key());
 
@@ -511,15 +919,29 @@ namespace fscp
 		handle_clear_session_request_message_from(clear_session_request_message, sender);
 	}
 
-	void server::handle_clear_session_request_message_from(const clear_session_request_message& _clear_session_request_message, const ep_type& sender)
+	void server::handle_clear_session_request_message_from(const clear_session_request_message& _clear_session_request_message, const ep_type& sender, bool approved)
 	{
-		bool can_reply = m_accept_session_request_messages_default;
+		// The request only changes the state of the session once it is accepted.
+		if (!approved && m_async_session_request_message_callback)
+		{
+			const decision_handler decision = make_decision(sender, MESSAGE_TYPE_SESSION_REQUEST, boost::bind(&server::replay_clear_session_request_message, this, copy_message(_clear_session_request_message), sender));
+
+			if (decision)
+			{
+				m_async_session_request_message_callback(sender, m_accept_session_request_messages_default, decision);
+			}
+
+			return;
+		}
+
+		bool can_reply = approved || m_accept_session_request_messages_default;
 
 		session_pair& session = m_session_map[sender];
 
 		session.set_remote_challenge(_clear_session_request_message.challenge());
+		session.set_remote_session_flags(_clear_session_request_message.session_flags());
 
-		if (m_session_request_message_callback)
+		if (!approved && m_session_request_message_callback)
 		{
 			can_reply = m_session_request_message_callback(sender, m_accept_session_request_messages_default);
 		}
@@ -537,6 +959,8 @@ namespace fscp
 		session_pair& session = m_session_map[target];
 
 		session.renew_local_session(session_number);
+		session.local_session().set_authenticated_channels(m_authenticated_only_channels);
+		apply_session_flags(session.local_session(), get_session_flags(session));
 
 		std::vector<uint8_t> cleartext = clear_session_message::write<uint8_t>(
 		                                     session.local_session().session_number(),
@@ -544,17 +968,160 @@ namespace fscp
 		                                     session.local_session().seal_key(),
 		                                     session.local_session().seal_key_size(),
 		                                     session.local_session().encryption_key(),
-		                                     session.local_session().encryption_key_size()
+		                                     session.local_session().encryption_key_size(),
+		                                     session.local_session().authenticated_channels(),
+		                                     get_session_flags(session)
 		                                 );
 
-		size_t size = session_message::write(m_send_buffer.data(), m_send_buffer.size(), &cleartext[0], cleartext.size(), m_presentation_map[target].encryption_certificate().public_key(), m_identity_store.signature_key());
+		issue_resumption_ticket(target, session.local_session(), true);
+
+		if (has_crypto_workers(m_handshake_workers))
+		{
+			post_crypto_job(m_handshake_workers, m_next_handshake_worker, crypto_scheduler::PRIORITY_HANDSHAKE, boost::bind(&server::write_session_message, this, target, cleartext, m_presentation_map[target].encryption_key(), m_identity_store.signature_key()));
+
+			return;
+		}
+
+		size_t size = session_message::write(m_send_buffer.data(), m_send_buffer.size(), &cleartext[0], cleartext.size(), m_presentation_map[target].encryption_key(), m_identity_store.signature_key());
 
 		send_to(asio::buffer(m_send_buffer.data(), size), target);
 	}
 
+	session_flags_type server::get_requested_session_flags() const
+	{
+		return m_extended_sequence_numbers ? SESSION_FLAG_EXTENDED_SEQUENCE_NUMBERS : 0;
+	}
+
+	session_flags_type server::get_session_flags(const session_pair& session) const
+	{
+		// A flag is only enabled if both hosts asked for it.
+		return get_requested_session_flags() & session.remote_session_flags();
+	}
+
+	void server::do_prepare_session(const ep_type& target)
+	{
+		session_pair& session = m_session_map[target];
+
+		const session_store::session_number_type session_number = session.local_session().session_number() + 1;
+
+		prepared_session_map::const_iterator it = m_prepared_session_map.find(target);
+
+		// An empty entry means the preparation is in progress.
+		if ((it != m_prepared_session_map.end()) && (!it->second || (it->second->session.session_number() == session_number)))
+		{
+			return;
+		}
+
+		presentation_store_map::const_iterator presentation = m_presentation_map.find(target);
+
+		if ((presentation == m_presentation_map.end()) || !presentation->second.encryption_key())
+		{
+			return;
+		}
+
+		m_prepared_session_map[target].reset();
+
+		// The RSA operations are the expensive part: they run on the worker.
+		m_session_pregeneration_worker.post(boost::bind(
+		                                        &server::prepare_session,
+		                                        this,
+		                                        target,
+		                                        boost::make_shared<prepared_session>(
+		                                            session_store(session_number),
+		                                            session.remote_challenge(),
+		                                            presentation->second.signature_certificate_hash(),
+		                                            m_authenticated_only_channels,
+		                                            get_session_flags(session)
+		                                        ),
+		                                        presentation->second.encryption_key(),
+		                                        m_identity_store.signature_key()
+		                                    ));
+	}
+
+	void server::prepare_session(const ep_type& target, boost::shared_ptr<prepared_session> result, cryptoplus::pkey::pkey enc_key, cryptoplus::pkey::pkey sig_key)
+	{
+		// This runs on the pre-generation worker: it must not touch the server state.
+		try
+		{
+			std::vector<uint8_t> cleartext = clear_session_message::write<uint8_t>(
+			                                     result->session.session_number(),
+			                                     result->challenge,
+			                                     result->session.seal_key(),
+			                                     result->session.seal_key_size(),
+			                                     result->session.encryption_key(),
+			                                     result->session.encryption_key_size(),
+			                                     result->authenticated_channels,
+			                                     result->session_flags
+			                                 );
+
+			result->message.resize(65536);
+			result->message.resize(session_message::write(&result->message[0], result->message.size(), &cleartext[0], cleartext.size(), enc_key, sig_key));
+		}
+		catch (std::exception&)
+		{
+			result.reset();
+		}
+
+		m_strand.post(boost::bind(&server::handle_prepared_session, this, target, result));
+	}
+
+	void server::handle_prepared_session(const ep_type& target, boost::shared_ptr<prepared_session> result)
+	{
+		if (result)
+		{
+			m_prepared_session_map[target] = result;
+		}
+		else
+		{
+			m_prepared_session_map.erase(target);
+		}
+	}
+
+	bool server::do_send_prepared_session(const ep_type& target)
+	{
+		prepared_session_map::iterator it = m_prepared_session_map.find(target);
+
+		if ((it == m_prepared_session_map.end()) || !it->second)
+		{
+			return false;
+		}
+
+		const boost::shared_ptr<prepared_session> prepared = it->second;
+
+		m_prepared_session_map.erase(it);
+
+		session_pair& session = m_session_map[target];
+		presentation_store_map::const_iterator presentation = m_presentation_map.find(target);
+
+		// The session was prepared with the parameters of the time: they must still be current.
+		if (
+		    !session.has_local_session() ||
+		    (prepared->session.session_number() != session.local_session().session_number() + 1) ||
+		    (prepared->challenge != session.remote_challenge()) ||
+		    (prepared->authenticated_channels != m_authenticated_only_channels) ||
+		    (prepared->session_flags != get_session_flags(session)) ||
+		    (presentation == m_presentation_map.end()) ||
+		    (presentation->second.signature_certificate_hash() != prepared->peer_certificate_hash)
+		)
+		{
+			return false;
+		}
+
+		prepared->session.set_authenticated_channels(prepared->authenticated_channels);
+		apply_session_flags(prepared->session, prepared->session_flags);
+
+		session.set_local_session(prepared->session);
+
+		issue_resumption_ticket(target, session.local_session(), true);
+
+		send_to(asio::buffer(prepared->message), target);
+
+		return true;
+	}
+
 	void server::handle_session_message_from(const session_message& _session_message, const ep_type& sender)
 	{
-		_session_message.check_signature(m_presentation_map[sender].signature_certificate().public_key());
+		check_signature(_session_message, m_presentation_map[sender]);
 
 		std::vector<uint8_t> cleartext = _session_message.get_cleartext<uint8_t>(m_identity_store.encryption_key());
 
@@ -563,7 +1130,7 @@ namespace fscp
 		handle_clear_session_message_from(clear_session_message, sender);
 	}
 
-	void server::handle_clear_session_message_from(const clear_session_message& _clear_session_message, const ep_type& sender)
+	void server::handle_clear_session_message_from(const clear_session_message& _clear_session_message, const ep_type& sender, bool approved)
 	{
 		session_pair& session_pair = m_session_map[sender];
 
@@ -578,9 +1145,22 @@ namespace fscp
 		    )
 		)
 		{
-			bool can_accept = m_accept_session_messages_default;
+			// The conditions above are checked again once the answer comes.
+			if (!approved && m_async_session_message_callback)
+			{
+				const decision_handler decision = make_decision(sender, MESSAGE_TYPE_SESSION, boost::bind(&server::replay_clear_session_message, this, copy_message(_clear_session_message), sender));
+
+				if (decision)
+				{
+					m_async_session_message_callback(sender, m_accept_session_messages_default, decision);
+				}
+
+				return;
+			}
 
-			if (m_session_message_callback)
+			bool can_accept = approved || m_accept_session_messages_default;
+
+			if (!approved && m_session_message_callback)
 			{
 				can_accept = m_session_message_callback(sender, m_accept_session_messages_default);
 			}
@@ -597,6 +1177,11 @@ namespace fscp
 				    _clear_session_message.encryption_key_size()
 				);
 
+				_session_store.set_authenticated_channels(_clear_session_message.authenticated_channels());
+				apply_session_flags(_session_store, _clear_session_message.session_flags() & get_requested_session_flags());
+
+				issue_resumption_ticket(sender, _session_store, false);
+
 				session_pair.set_remote_session(_session_store);
 
 				if (session_is_new)
@@ -607,173 +1192,1335 @@ namespace fscp
 		}
 	}
 
-	void server::session_established(const ep_type& host)
+	/* Handshake pool */
+
+	void server::dispatch_handshake_message(const message& _message, const hash_type& digest, const ep_type& sender)
 	{
-		if (m_session_established_callback)
+		const presentation_store& presentation = m_presentation_map[sender];
+
+		if (!presentation.signature_key())
+		{
+			throw std::runtime_error("no presentation");
+		}
+
+		const pending_handshake_type pending_handshake(sender, _message.type());
+
+		// The hosts send their handshake messages again: dropping them is safe, queuing them forever is not.
+		if ((m_pending_handshakes.size() >= m_handshake_queue_size) || (m_pending_handshakes.find(pending_handshake) != m_pending_handshakes.end()))
+		{
+			++m_dropped_handshake_count;
+
+			return;
+		}
+
+		m_pending_handshakes.insert(pending_handshake);
+
+		const boost::shared_ptr<handshake_job> job = boost::make_shared<handshake_job>();
+
+		job->sender = sender;
+		job->type = _message.type();
+		job->message.assign(_message.data(), _message.data() + _message.size());
+		job->pkey_size = m_identity_store.encryption_key().size();
+		job->signature_key = presentation.signature_key();
+		job->encryption_key = m_identity_store.encryption_key();
+		job->digest = digest;
+		job->signature_verified = presentation.is_signature_verified(digest);
+		job->succeeded = false;
+
+		post_crypto_job(m_handshake_workers, m_next_handshake_worker, crypto_scheduler::PRIORITY_HANDSHAKE, boost::bind(&server::open_handshake_message, this, job));
+	}
+
+	void server::open_handshake_message(boost::shared_ptr<handshake_job> job)
+	{
+		// This runs on a handshake worker: it must not touch the server state.
+		try
+		{
+			const session_message _session_message(message(&job->message[0], job->message.size()), job->pkey_size);
+
+			if (!job->signature_verified)
+			{
+				_session_message.check_signature(job->signature_key);
+			}
+
+			job->cleartext = _session_message.get_cleartext<uint8_t>(job->encryption_key);
+			job->succeeded = true;
+		}
+		catch (std::exception&)
 		{
-			m_session_established_callback(host);
 		}
+
+		m_strand.post(boost::bind(&server::handle_opened_handshake_message, this, job));
 	}
 
-	void server::session_lost(const ep_type& host)
+	void server::handle_opened_handshake_message(boost::shared_ptr<handshake_job> job)
 	{
-		if (m_session_lost_callback)
+		m_pending_handshakes.erase(pending_handshake_type(job->sender, job->type));
+
+		if (!job->succeeded || !m_socket.is_open())
+		{
+			return;
+		}
+
+		presentation_store& presentation = m_presentation_map[job->sender];
+
+		// The message was verified with a presentation that is no longer current.
+		if (!presentation.signature_key() || (presentation.signature_key().raw() != job->signature_key.raw()))
+		{
+			return;
+		}
+
+		presentation.set_signature_verified(job->digest);
+
+		try
+		{
+			if (job->type == MESSAGE_TYPE_SESSION_REQUEST)
+			{
+				clear_session_request_message clear_session_request_message(&job->cleartext[0], job->cleartext.size());
+
+				handle_clear_session_request_message_from(clear_session_request_message, job->sender);
+			}
+			else
+			{
+				clear_session_message clear_session_message(&job->cleartext[0], job->cleartext.size());
+
+				handle_clear_session_message_from(clear_session_message, job->sender);
+			}
+		}
+		catch (std::runtime_error&)
 		{
-			m_session_lost_callback(host);
 		}
 	}
 
-	void server::network_error(const ep_type& target, const boost::system::error_code& code)
+	void server::write_session_message(const ep_type& target, std::vector<uint8_t> cleartext, cryptoplus::pkey::pkey enc_key, cryptoplus::pkey::pkey sig_key)
 	{
-		if (m_network_error_callback)
+		// This runs on a handshake worker: it must not touch the server state.
+		std::vector<uint8_t> result(65536);
+
+		try
+		{
+			result.resize(session_message::write(&result[0], result.size(), &cleartext[0], cleartext.size(), enc_key, sig_key));
+		}
+		catch (std::exception&)
 		{
-			m_network_error_callback(target, code);
+			result.clear();
 		}
+
+		m_strand.post(boost::bind(&server::handle_written_session_message, this, target, result));
 	}
 
-	void server::do_close_session(const ep_type& host)
+	void server::handle_written_session_message(const ep_type& target, const std::vector<uint8_t>& result)
 	{
-		if (m_session_map[host].clear_remote_session())
+		if (!result.empty() && m_socket.is_open())
 		{
-			session_lost(host);
+			send_to(asio::buffer(result), target);
 		}
 	}
 
-	/* Data messages */
+	/* ECDHE session messages */
 
-	void server::do_send_data(const ep_type& target, channel_number_type channel_number)
+	void server::do_request_ecdhe_session(const ep_type& target)
 	{
 		if (m_socket.is_open())
 		{
-			session_pair& session_pair = m_session_map[target];
+			session_pair& session = m_session_map[target];
 
-			if (session_pair.has_remote_session())
-			{
-				data_store& data_store = m_data_map[target];
+			session_store::session_number_type session_number = session.has_remote_session() ? session.remote_session().session_number() + 1 : 0;
 
-				for(; !data_store.empty(); data_store.pop())
-				{
-					size_t size = data_message::write(
-					                  m_send_buffer.data(),
-					                  m_send_buffer.size(),
-					                  channel_number,
-					                  session_pair.remote_session().session_number(),
-					                  session_pair.remote_session().sequence_number(),
-					                  &data_store.front()[0],
-					                  data_store.front().size(),
-					                  session_pair.remote_session().seal_key(),
-					                  session_pair.remote_session().seal_key_size(),
-					                  session_pair.remote_session().encryption_key(),
-					                  session_pair.remote_session().encryption_key_size()
-					              );
+			// A retransmission must carry the challenge and the key of the request it repeats: the peer only sends its answer again if they match.
+			if (!session.has_local_ephemeral_key() || (session.local_ephemeral_key_session_number() != session_number))
+			{
+				session.generate_local_challenge();
+				session.generate_local_ephemeral_key(session_number);
+			}
 
-					session_pair.remote_session().increment_sequence_number();
+			size_t size = ecdhe_session_message::write(
+			                  m_send_buffer.data(),
+			                  m_send_buffer.size(),
+			                  MESSAGE_TYPE_ECDHE_SESSION_REQUEST,
+			                  session_number,
+			                  session.local_challenge(),
+			                  session.local_ephemeral_key().public_key(),
+			                  0,
+			                  get_requested_session_flags(),
+			                  m_identity_store.signature_key()
+			              );
 
-					send_to(asio::buffer(m_send_buffer.data(), size), target);
-				}
-			}
+			send_to(asio::buffer(m_send_buffer.data(), size), target);
 		}
 	}
 
-	void server::handle_data_message_from(const data_message& _data_message, const ep_type& sender)
+	void server::handle_ecdhe_session_request_message_from(const ecdhe_session_message& _ecdhe_session_message, const ep_type& sender, bool approved)
 	{
-		session_pair& session_pair = m_session_map[sender];
+		check_signature(_ecdhe_session_message, m_presentation_map[sender]);
 
-		if (session_pair.has_local_session())
+		session_pair& session = m_session_map[sender];
+
+		// A retransmitted request: our answer was probably lost.
+		if (session.is_ecdhe_session_answer_for(_ecdhe_session_message.session_number(), _ecdhe_session_message.challenge(), _ecdhe_session_message.public_key()))
 		{
-			if (_data_message.sequence_number() > session_pair.local_session().sequence_number())
-			{
-				_data_message.check_seal(
-				    m_data_buffer.data(),
-				    m_data_buffer.size(),
-				    session_pair.local_session().seal_key(),
-				    session_pair.local_session().seal_key_size()
-				);
+			send_to(asio::buffer(session.ecdhe_session_answer()), sender);
 
-				size_t cnt = _data_message.get_cleartext(
-				                 m_data_buffer.data(),
-				                 m_data_buffer.size(),
-				                 session_pair.local_session().session_number(),
-				                 session_pair.local_session().encryption_key(),
-				                 session_pair.local_session().encryption_key_size()
-				             );
+			return;
+		}
 
-				session_pair.local_session().set_sequence_number(_data_message.sequence_number());
+		// Nothing makes a signed request fresh: an old one, replayed, must not replace the established session. A request for the same session number but another challenge or key comes from a peer that started over: it is a new one.
+		if (session.has_ecdhe_session_answer() && (_ecdhe_session_message.session_number() < session.ecdhe_session_answer_session_number()))
+		{
+			return;
+		}
 
-				if (session_pair.local_session().is_old())
-				{
-					do_send_session(sender, session_pair.local_session().session_number() + 1);
-				}
+		// The request only changes the state of the session once it is accepted.
+		if (!approved && m_async_session_request_message_callback)
+		{
+			const decision_handler decision = make_decision(sender, MESSAGE_TYPE_ECDHE_SESSION_REQUEST, boost::bind(&server::replay_message, this, copy_message(_ecdhe_session_message), sender));
 
-				session_pair.keep_alive();
+			if (decision)
+			{
+				m_async_session_request_message_callback(sender, m_accept_session_request_messages_default, decision);
+			}
 
-				if (is_data_message_type(_data_message.type()) && m_data_message_callback)
-				{
-					m_data_message_callback(sender, to_channel_number(_data_message.type()), boost::asio::buffer(m_data_buffer.data(), cnt));
-				}
-				else if (_data_message.type() == MESSAGE_TYPE_CONTACT_REQUEST)
-				{
-					std::vector<hash_type> hash_list = data_message::parse_hash_list(m_data_buffer.data(), cnt);
+			return;
+		}
 
-					contact_map_type contact_map;
+		bool can_reply = approved || m_accept_session_request_messages_default;
 
-					for (std::vector<hash_type>::iterator hash_it = hash_list.begin(); hash_it != hash_list.end(); ++hash_it)
-					{
-						for (presentation_store_map::const_iterator it = m_presentation_map.begin(); it != m_presentation_map.end(); ++it)
-						{
-							if (it->second.signature_certificate_hash() == *hash_it)
-							{
-								if (!m_contact_request_message_callback || m_contact_request_message_callback(sender, it->second.signature_certificate(), it->first))
-								{
-									contact_map[*hash_it] = it->first;
-								}
-							}
-						}
-					}
+		session.set_remote_challenge(_ecdhe_session_message.challenge());
+		session.set_remote_session_flags(_ecdhe_session_message.session_flags());
 
-					if (!contact_map.empty())
-					{
-						do_send_contact(sender, contact_map);
-					}
-				}
-				else if (_data_message.type() == MESSAGE_TYPE_CONTACT)
-				{
-					if (m_contact_message_callback)
-					{
-						contact_map_type contact_map = data_message::parse_contact_map(m_data_buffer.data(), cnt);
+		if (!approved && m_session_request_message_callback)
+		{
+			can_reply = m_session_request_message_callback(sender, m_accept_session_request_messages_default);
+		}
 
-						for (contact_map_type::const_iterator contact_it = contact_map.begin(); contact_it != contact_map.end(); ++contact_it)
-						{
-							if (m_hash_to_cert.find(contact_it->first) != m_hash_to_cert.end())
-							{
-								m_contact_message_callback(sender, m_hash_to_cert[contact_it->first], contact_it->second);
-							}
-						}
-					}
-				}
-			}
+		if (can_reply)
+		{
+			do_send_ecdhe_session(sender, _ecdhe_session_message.session_number(), _ecdhe_session_message.public_key());
 		}
 	}
 
-	bool server::has_session(const hash_type& hash) const
+	void server::do_send_ecdhe_session(const ep_type& target, session_store::session_number_type session_number, const ecdhe::key_type& peer_public_key)
 	{
-		for (session_pair_map::const_iterator session_pair = m_session_map.begin(); session_pair != m_session_map.end(); ++session_pair)
-		{
-			if (session_pair->second.has_remote_session())
-			{
-				presentation_store_map::const_iterator ps = m_presentation_map.find(session_pair->first);
+		session_pair& session = m_session_map[target];
 
-				if (ps != m_presentation_map.end())
-				{
-					if (ps->second.signature_certificate_hash() == hash)
-					{
-						return true;
-					}
-				}
-			}
-		}
+		// The keys depend on both ephemeral keys: the local session is always a new one.
+		const session_store::session_number_type local_session_number = session.next_local_session_number(session_number);
+		const ecdhe::ephemeral_key ephemeral_key;
 
-		return false;
+		session_store local_session = ephemeral_key.derive_session(peer_public_key, session.remote_challenge(), local_session_number, false);
+
+		local_session.set_sequence_number(0);
+		local_session.set_authenticated_channels(m_authenticated_only_channels);
+		apply_session_flags(local_session, get_session_flags(session));
+
+		session.set_local_session(local_session);
+
+		issue_resumption_ticket(target, local_session, true);
+
+		size_t size = ecdhe_session_message::write(
+		                  m_send_buffer.data(),
+		                  m_send_buffer.size(),
+		                  MESSAGE_TYPE_ECDHE_SESSION,
+		                  local_session_number,
+		                  session.remote_challenge(),
+		                  ephemeral_key.public_key(),
+		                  session.local_session().authenticated_channels(),
+		                  get_session_flags(session),
+		                  m_identity_store.signature_key()
+		              );
+
+		// Kept for the retransmissions of the request.
+		session.set_ecdhe_session_answer(session_number, session.remote_challenge(), peer_public_key, m_send_buffer.data(), size);
+
+		send_to(asio::buffer(m_send_buffer.data(), size), target);
+	}
+
+	void server::handle_ecdhe_session_message_from(const ecdhe_session_message& _ecdhe_session_message, const ep_type& sender, bool approved)
+	{
+		check_signature(_ecdhe_session_message, m_presentation_map[sender]);
+
+		session_pair& session_pair = m_session_map[sender];
+
+		if (
+		    session_pair.has_local_ephemeral_key() &&
+		    _ecdhe_session_message.challenge() == session_pair.local_challenge() &&
+		    (
+		        !session_pair.has_remote_session() ||
+		        (session_pair.remote_session().session_number() < _ecdhe_session_message.session_number())
+		    )
+		)
+		{
+			// The conditions above are checked again once the answer comes.
+			if (!approved && m_async_session_message_callback)
+			{
+				const decision_handler decision = make_decision(sender, MESSAGE_TYPE_ECDHE_SESSION, boost::bind(&server::replay_message, this, copy_message(_ecdhe_session_message), sender));
+
+				if (decision)
+				{
+					m_async_session_message_callback(sender, m_accept_session_messages_default, decision);
+				}
+
+				return;
+			}
+
+			bool can_accept = approved || m_accept_session_messages_default;
+
+			if (!approved && m_session_message_callback)
+			{
+				can_accept = m_session_message_callback(sender, m_accept_session_messages_default);
+			}
+
+			if (can_accept)
+			{
+				bool session_is_new = !session_pair.has_remote_session();
+
+				session_store _session_store = session_pair.local_ephemeral_key().derive_session(
+				                                   _ecdhe_session_message.public_key(),
+				                                   _ecdhe_session_message.challenge(),
+				                                   _ecdhe_session_message.session_number(),
+				                                   true
+				                               );
+
+				_session_store.set_authenticated_channels(_ecdhe_session_message.authenticated_channels());
+				apply_session_flags(_session_store, _ecdhe_session_message.session_flags() & get_requested_session_flags());
+
+				session_pair.clear_local_ephemeral_key();
+
+				issue_resumption_ticket(sender, _session_store, false);
+
+				session_pair.set_remote_session(_session_store);
+
+				if (session_is_new)
+				{
+					session_established(sender);
+				}
+			}
+		}
+	}
+
+	/* Resume session messages */
+
+	bool server::do_request_resumed_session(const ep_type& target)
+	{
+		if (!m_socket.is_open())
+		{
+			return false;
+		}
+
+		presentation_store_map::const_iterator presentation = m_presentation_map.find(target);
+
+		if ((presentation == m_presentation_map.end()) || !presentation->second.signature_key())
+		{
+			return false;
+		}
+
+		outgoing_ticket_map::iterator ticket = m_outgoing_ticket_map.find(presentation->second.signature_certificate_hash());
+
+		if (ticket == m_outgoing_ticket_map.end())
+		{
+			return false;
+		}
+
+		// A ticket is only used once: if this request gets no answer, the next one is a full handshake.
+		const resumption_ticket _ticket = ticket->second;
+
+		m_outgoing_ticket_map.erase(ticket);
+
+		if (_ticket.has_expired())
+		{
+			return false;
+		}
+
+		session_pair& session = m_session_map[target];
+
+		session_store::session_number_type session_number = session.has_remote_session() ? session.remote_session().session_number() + 1 : 0;
+
+		resumption_ticket::nonce_type nonce;
+		nonce.assign(0);
+
+		session.set_pending_resumption_ticket(_ticket);
+
+		size_t size = resume_session_message::write(
+		                  m_send_buffer.data(),
+		                  m_send_buffer.size(),
+		                  MESSAGE_TYPE_RESUME_SESSION_REQUEST,
+		                  _ticket,
+		                  session_number,
+		                  session.generate_local_challenge(),
+		                  nonce,
+		                  0,
+		                  get_requested_session_flags()
+		              );
+
+		send_to(asio::buffer(m_send_buffer.data(), size), target);
+
+		return true;
+	}
+
+	void server::handle_resume_session_request_message_from(const resume_session_message& _resume_session_message, const ep_type& sender, bool approved)
+	{
+		incoming_ticket_map::iterator ticket = m_incoming_ticket_map.find(_resume_session_message.ticket_id());
+
+		if (ticket == m_incoming_ticket_map.end())
+		{
+			return;
+		}
+
+		if (ticket->second.has_expired())
+		{
+			m_incoming_ticket_map.erase(ticket);
+
+			return;
+		}
+
+		// The ticket is bound to the identity of the host it was issued to, not to its endpoint.
+		presentation_store_map::const_iterator presentation = m_presentation_map.find(sender);
+
+		if ((presentation == m_presentation_map.end()) || !presentation->second.signature_key() || (presentation->second.signature_certificate_hash() != ticket->second.peer_certificate_hash()))
+		{
+			return;
+		}
+
+		_resume_session_message.check_mac(ticket->second);
+
+		// The request only changes the state of the session once it is accepted.
+		if (!approved && m_async_session_request_message_callback)
+		{
+			const decision_handler decision = make_decision(sender, MESSAGE_TYPE_RESUME_SESSION_REQUEST, boost::bind(&server::replay_message, this, copy_message(_resume_session_message), sender));
+
+			if (decision)
+			{
+				m_async_session_request_message_callback(sender, m_accept_session_request_messages_default, decision);
+			}
+
+			return;
+		}
+
+		bool can_reply = approved || m_accept_session_request_messages_default;
+
+		session_pair& session = m_session_map[sender];
+
+		session.set_remote_challenge(_resume_session_message.challenge());
+		session.set_remote_session_flags(_resume_session_message.session_flags());
+
+		if (!approved && m_session_request_message_callback)
+		{
+			can_reply = m_session_request_message_callback(sender, m_accept_session_request_messages_default);
+		}
+
+		if (can_reply)
+		{
+			const resumption_ticket _ticket = ticket->second;
+
+			do_send_resumed_session(sender, _resume_session_message.session_number(), _ticket);
+		}
+	}
+
+	void server::do_send_resumed_session(const ep_type& target, session_store::session_number_type session_number, const resumption_ticket& ticket)
+	{
+		session_pair& session = m_session_map[target];
+
+		const session_store::session_number_type local_session_number = session.next_local_session_number(session_number);
+
+		resumption_ticket::nonce_type nonce;
+		random_pool::get_random_bytes(nonce.c_array(), nonce.size());
+
+		session_store local_session = ticket.derive_session(local_session_number, session.remote_challenge(), nonce);
+
+		local_session.set_sequence_number(0);
+		local_session.set_authenticated_channels(m_authenticated_only_channels);
+		apply_session_flags(local_session, get_session_flags(session));
+
+		session.set_local_session(local_session);
+
+		// The ticket is consumed: the new session carries the next one, which keeps the original expiration date.
+		m_incoming_ticket_map.erase(ticket.id());
+		add_incoming_ticket(resumption_ticket(local_session, ticket.peer_certificate_hash(), ticket.expiration_date()));
+
+		size_t size = resume_session_message::write(
+		                  m_send_buffer.data(),
+		                  m_send_buffer.size(),
+		                  MESSAGE_TYPE_RESUME_SESSION,
+		                  ticket,
+		                  local_session_number,
+		                  session.remote_challenge(),
+		                  nonce,
+		                  local_session.authenticated_channels(),
+		                  get_session_flags(session)
+		              );
+
+		send_to(asio::buffer(m_send_buffer.data(), size), target);
+	}
+
+	void server::handle_resume_session_message_from(const resume_session_message& _resume_session_message, const ep_type& sender, bool approved)
+	{
+		session_pair& session_pair = m_session_map[sender];
+
+		if (
+		    session_pair.has_pending_resumption_ticket() &&
+		    _resume_session_message.ticket_id() == session_pair.pending_resumption_ticket().id() &&
+		    _resume_session_message.challenge() == session_pair.local_challenge() &&
+		    (
+		        !session_pair.has_remote_session() ||
+		        (session_pair.remote_session().session_number() < _resume_session_message.session_number())
+		    )
+		)
+		{
+			_resume_session_message.check_mac(session_pair.pending_resumption_ticket());
+
+			// The conditions above are checked again once the answer comes.
+			if (!approved && m_async_session_message_callback)
+			{
+				const decision_handler decision = make_decision(sender, MESSAGE_TYPE_RESUME_SESSION, boost::bind(&server::replay_message, this, copy_message(_resume_session_message), sender));
+
+				if (decision)
+				{
+					m_async_session_message_callback(sender, m_accept_session_messages_default, decision);
+				}
+
+				return;
+			}
+
+			bool can_accept = approved || m_accept_session_messages_default;
+
+			if (!approved && m_session_message_callback)
+			{
+				can_accept = m_session_message_callback(sender, m_accept_session_messages_default);
+			}
+
+			if (can_accept)
+			{
+				bool session_is_new = !session_pair.has_remote_session();
+
+				const resumption_ticket& ticket = session_pair.pending_resumption_ticket();
+
+				session_store _session_store = ticket.derive_session(
+				                                   _resume_session_message.session_number(),
+				                                   _resume_session_message.challenge(),
+				                                   _resume_session_message.nonce()
+				                               );
+
+				_session_store.set_authenticated_channels(_resume_session_message.authenticated_channels());
+				apply_session_flags(_session_store, _resume_session_message.session_flags() & get_requested_session_flags());
+
+				add_outgoing_ticket(resumption_ticket(_session_store, ticket.peer_certificate_hash(), ticket.expiration_date()));
+
+				session_pair.clear_pending_resumption_ticket();
+				session_pair.set_remote_session(_session_store);
+
+				if (session_is_new)
+				{
+					session_established(sender);
+				}
+			}
+		}
+	}
+
+	void server::issue_resumption_ticket(const ep_type& host, const session_store& session, bool incoming)
+	{
+		if (m_resumption_ticket_lifetime <= boost::posix_time::time_duration())
+		{
+			return;
+		}
+
+		const resumption_ticket ticket(session, m_presentation_map[host].signature_certificate_hash(), boost::posix_time::microsec_clock::local_time() + m_resumption_ticket_lifetime);
+
+		if (incoming)
+		{
+			add_incoming_ticket(ticket);
+		}
+		else
+		{
+			add_outgoing_ticket(ticket);
+		}
+	}
+
+	void server::add_incoming_ticket(const resumption_ticket& ticket)
+	{
+		for (incoming_ticket_map::iterator it = m_incoming_ticket_map.begin(); it != m_incoming_ticket_map.end();)
+		{
+			if (it->second.has_expired())
+			{
+				m_incoming_ticket_map.erase(it++);
+			}
+			else
+			{
+				++it;
+			}
+		}
+
+		m_incoming_ticket_map.erase(ticket.id());
+		m_incoming_ticket_map.insert(std::make_pair(ticket.id(), ticket));
+	}
+
+	void server::add_outgoing_ticket(const resumption_ticket& ticket)
+	{
+		m_outgoing_ticket_map.erase(ticket.peer_certificate_hash());
+		m_outgoing_ticket_map.insert(std::make_pair(ticket.peer_certificate_hash(), ticket));
+	}
+
+	void server::session_established(const ep_type& host)
+	{
+		m_session_endpoints.set(host, true);
+
+		if (m_session_established_callback)
+		{
+			run_callback(boost::bind(m_session_established_callback, host));
+		}
+	}
+
+	void server::session_lost(const ep_type& host)
+	{
+		m_session_endpoints.erase(host);
+
+		const receive_order_map::iterator order = m_receive_order_map.find(host);
+
+		if (order != m_receive_order_map.end())
+		{
+			// The messages checked but not delivered yet are dropped with the order.
+			m_receive_job_count -= order->second->completed_jobs.size();
+			m_receive_order_map.erase(order);
+		}
+
+		if (m_session_lost_callback)
+		{
+			run_callback(boost::bind(m_session_lost_callback, host));
+		}
+	}
+
+	void server::network_error(const ep_type& target, const boost::system::error_code& code)
+	{
+		if (m_network_error_callback)
+		{
+			run_callback(boost::bind(m_network_error_callback, target, code));
+		}
+	}
+
+	/* Asynchronous decisions */
+
+	server::decision_handler server::make_decision(const ep_type& sender, message_type type, boost::function<void ()> on_accept)
+	{
+		const pending_decision_key_type key(sender, type);
+
+		// Anyone can send HELLO and PRESENTATION messages: each waiting one costs a timer, a copy and a query, so their count is bounded.
+		if ((m_pending_decisions.size() >= m_decision_queue_size) || (m_pending_decision_keys.find(key) != m_pending_decision_keys.end()))
+		{
+			++m_dropped_decision_count;
+
+			return decision_handler();
+		}
+
+		m_pending_decision_keys.insert(key);
+
+		const uint64_t id = m_next_decision_id++;
+
+		pending_decision& decision = m_pending_decisions[id];
+
+		decision.key = key;
+		decision.on_accept = on_accept;
+		decision.timer.reset(new boost::asio::deadline_timer(get_io_service(), m_decision_timeout));
+		decision.timer->async_wait(m_strand.wrap(boost::bind(&server::handle_decision_timeout, this, id, boost::asio::placeholders::error)));
+
+		return boost::bind(&server::post_decision, this, id, _1);
+	}
+
+	void server::post_decision(uint64_t id, bool accept)
+	{
+		m_strand.post(boost::bind(&server::handle_decision, this, id, accept));
+	}
+
+	void server::handle_decision(uint64_t id, bool accept)
+	{
+		pending_decision_map::iterator decision = m_pending_decisions.find(id);
+
+		// The decision already timed out, or was answered twice.
+		if (decision == m_pending_decisions.end())
+		{
+			return;
+		}
+
+		const boost::function<void ()> on_accept = decision->second.on_accept;
+
+		decision->second.timer->cancel();
+		m_pending_decision_keys.erase(decision->second.key);
+		m_pending_decisions.erase(decision);
+
+		if (accept && m_socket.is_open())
+		{
+			try
+			{
+				on_accept();
+			}
+			catch (std::runtime_error&)
+			{
+			}
+		}
+	}
+
+	void server::clear_pending_decisions()
+	{
+		m_pending_decisions.clear();
+		m_pending_decision_keys.clear();
+	}
+
+	void server::handle_decision_timeout(uint64_t id, const boost::system::error_code& error)
+	{
+		if (error != boost::asio::error::operation_aborted)
+		{
+			handle_decision(id, false);
+		}
+	}
+
+	void server::replay_message(const std::vector<uint8_t>& buffer, const ep_type& sender)
+	{
+		const message message(&buffer[0], buffer.size());
+
+		switch (message.type())
+		{
+			case MESSAGE_TYPE_HELLO_REQUEST:
+				{
+					handle_hello_message_from(hello_message(message), sender, true);
+
+					break;
+				}
+			case MESSAGE_TYPE_PRESENTATION:
+				{
+					handle_presentation_message_from(presentation_message(message), sender, true);
+
+					break;
+				}
+			case MESSAGE_TYPE_ECDHE_SESSION_REQUEST:
+				{
+					handle_ecdhe_session_request_message_from(ecdhe_session_message(message), sender, true);
+
+					break;
+				}
+			case MESSAGE_TYPE_ECDHE_SESSION:
+				{
+					handle_ecdhe_session_message_from(ecdhe_session_message(message), sender, true);
+
+					break;
+				}
+			case MESSAGE_TYPE_RESUME_SESSION_REQUEST:
+				{
+					handle_resume_session_request_message_from(resume_session_message(message), sender, true);
+
+					break;
+				}
+			case MESSAGE_TYPE_RESUME_SESSION:
+				{
+					handle_resume_session_message_from(resume_session_message(message), sender, true);
+
+					break;
+				}
+			default:
+				{
+					break;
+				}
+		}
+	}
+
+	void server::replay_clear_session_request_message(const std::vector<uint8_t>& buffer, const ep_type& sender)
+	{
+		handle_clear_session_request_message_from(clear_session_request_message(&buffer[0], buffer.size()), sender, true);
+	}
+
+	void server::replay_clear_session_message(const std::vector<uint8_t>& buffer, const ep_type& sender)
+	{
+		handle_clear_session_message_from(clear_session_message(&buffer[0], buffer.size()), sender, true);
+	}
+
+	/* Callback executor */
+
+	void server::run_callback(callback_queue::task_type task)
+	{
+		if (m_callback_queue)
+		{
+			m_callback_queue->post(task);
+		}
+		else
+		{
+			task();
+		}
+	}
+
+	void server::do_close_session(const ep_type& host)
+	{
+		if (m_session_map[host].clear_remote_session())
+		{
+			session_lost(host);
+		}
+	}
+
+	/* Data messages */
+
+	void server::do_send_data(const ep_type& target, channel_number_type channel_number)
+	{
+		if (m_socket.is_open())
+		{
+			session_pair& session_pair = m_session_map[target];
+
+			if (session_pair.has_remote_session())
+			{
+				data_store* data_store = NULL;
+
+				{
+					boost::mutex::scoped_lock lock(m_data_map_mutex);
+
+					// The map nodes are stable: the store can be used once the lock is released.
+					data_store = &m_data_map[target];
+				}
+
+				// Both hosts must agree for the data to be sent in clear.
+				const bool authenticated_only = (to_channel_mask(channel_number) & m_authenticated_only_channels & session_pair.remote_session().authenticated_channels()) != 0;
+
+				// The pending data is sent in batches, so that the cryptographic contexts are shared between the messages.
+				data_store::pointer_data_type batch_data[data_message::MAX_BATCH_SIZE];
+				data_message::write_operation batch[data_message::MAX_BATCH_SIZE];
+
+				for (;;)
+				{
+					size_t count = 0;
+
+					// The lock is only held to dequeue: the application threads can keep on pushing while the batch gets ciphered.
+					{
+						boost::mutex::scoped_lock lock(m_data_map_mutex);
+
+						for (; (count < data_message::MAX_BATCH_SIZE) && !data_store->empty(); ++count, data_store->pop())
+						{
+							batch_data[count] = data_store->front_pointer();
+						}
+					}
+
+					if (count == 0)
+					{
+						break;
+					}
+
+					// The slots are sized after the largest message of the batch: the buffer only grows as much as the traffic requires.
+					size_t slot_size = 0;
+
+					for (size_t i = 0; i < count; ++i)
+					{
+						slot_size = std::max(slot_size, batch_data[i]->size() + DATA_MESSAGE_OVERHEAD);
+					}
+
+					if (m_batch_send_buffer.size() < count * slot_size)
+					{
+						m_batch_send_buffer.resize(count * slot_size);
+					}
+
+					for (size_t i = 0; i < count; ++i)
+					{
+						batch[i].buf = &m_batch_send_buffer[i * slot_size];
+						batch[i].buf_len = slot_size;
+						batch[i].channel_number = channel_number;
+						batch[i].sequence_number = session_pair.remote_session().sequence_number();
+						batch[i].cleartext = &(*batch_data[i])[0];
+						batch[i].cleartext_len = batch_data[i]->size();
+						batch[i].authenticated_only = authenticated_only;
+
+						session_pair.remote_session().increment_sequence_number();
+					}
+
+					data_message::write_batch(batch, count, *session_pair.remote_session().keys());
+
+					for (size_t i = 0; i < count; ++i)
+					{
+						send_to(asio::buffer(batch[i].buf, batch[i].size), target);
+					}
+				}
+			}
+		}
+	}
+
+	void server::do_drain_data_submissions()
+	{
+		// Cleared first: any submission queued from now on will post another drain.
+		m_data_submission_drain_pending = false;
+
+		data_submission submission;
+		bool pending = m_data_submission_queue.pop(submission);
+
+		while (pending)
+		{
+			typedef std::map<ep_type, channel_number_type> target_map;
+
+			target_map targets;
+
+			{
+				boost::mutex::scoped_lock lock(m_data_map_mutex);
+
+				do
+				{
+					const target_map::const_iterator target = targets.find(submission.target);
+
+					if (target == targets.end())
+					{
+						targets[submission.target] = submission.channel_number;
+					}
+					else if (target->second != submission.channel_number)
+					{
+						// The pending data of a host is sent on a single channel: flush it before switching.
+						break;
+					}
+
+					m_data_map[submission.target].push(submission.data);
+
+					pending = m_data_submission_queue.pop(submission);
+				}
+				while (pending);
+			}
+
+			for (target_map::const_iterator target = targets.begin(); target != targets.end(); ++target)
+			{
+				do_send_data(target->first, target->second);
+			}
+		}
+	}
+
+	void server::handle_data_message_from(const data_message& _data_message, const ep_type& sender)
+	{
+		// The messages are checked and deciphered by the receive workers, if any. The keep-alive and contact messages take the same way: delivered out of turn, they would move the replay window past the data messages still being checked.
+		if (has_crypto_workers(m_receive_workers))
+		{
+			dispatch_data_message(_data_message, sender);
+
+			return;
+		}
+
+		session_pair& session_pair = m_session_map[sender];
+
+		if (session_pair.has_local_session())
+		{
+			session_store* session = NULL;
+			size_t cnt = 0;
+
+			if (accepts_data_message(session_pair.local_session(), _data_message, m_replay_window_size))
+			{
+				try
+				{
+					cnt = check_seal_and_get_cleartext(_data_message, m_data_buffer.data(), m_data_buffer.size(), *session_pair.local_session().keys(), session_pair.local_session().extend_sequence_number(_data_message.sequence_number()));
+					session = &session_pair.local_session();
+				}
+				catch (std::runtime_error&)
+				{
+					// Right after a renewal, the messages still in flight were sealed with the previous session.
+					if (!session_pair.has_previous_local_session())
+					{
+						throw;
+					}
+				}
+			}
+
+			if (!session && session_pair.has_previous_local_session() && accepts_data_message(session_pair.previous_local_session(), _data_message, m_replay_window_size))
+			{
+				cnt = check_seal_and_get_cleartext(_data_message, m_data_buffer.data(), m_data_buffer.size(), *session_pair.previous_local_session().keys(), session_pair.previous_local_session().extend_sequence_number(_data_message.sequence_number()));
+				session = &session_pair.previous_local_session();
+			}
+
+			if (session)
+			{
+				deliver_data_message(_data_message, sender, session_pair, *session, session->extend_sequence_number(_data_message.sequence_number()), m_data_buffer.data(), cnt);
+			}
+		}
+	}
+
+	void server::do_send_data_to_all(channel_number_type channel_number, data_store::pointer_data_type data)
+	{
+		if (m_socket.is_open())
+		{
+			const boost::shared_ptr<fanout> _fanout = boost::make_shared<fanout>(channel_number, data);
+
+			// The sequence numbers are reserved now, so that the workers never touch the sessions.
+			for (session_pair_map::iterator session_pair = m_session_map.begin(); session_pair != m_session_map.end(); ++session_pair)
+			{
+				if (session_pair->second.has_remote_session())
+				{
+					session_store& session = session_pair->second.remote_session();
+
+					// Both hosts must agree for the data to be sent in clear.
+					const bool authenticated_only = (to_channel_mask(channel_number) & m_authenticated_only_channels & session.authenticated_channels()) != 0;
+
+					_fanout->messages.push_back(fanout_message(session_pair->first, session, session.sequence_number(), authenticated_only));
+
+					session.increment_sequence_number();
+				}
+			}
+
+			if (_fanout->messages.empty())
+			{
+				return;
+			}
+
+			const size_t slice_count = std::min(crypto_worker_count(m_send_workers), _fanout->messages.size());
+			const size_t slice_size = (_fanout->messages.size() + slice_count - 1) / slice_count;
+
+			_fanout->pending_slices = (_fanout->messages.size() + slice_size - 1) / slice_size;
+
+			size_t next_worker = 0;
+
+			for (size_t begin = 0; begin < _fanout->messages.size(); begin += slice_size)
+			{
+				post_crypto_job(m_send_workers, next_worker, crypto_scheduler::PRIORITY_DATA, boost::bind(&server::cipher_fanout, this, _fanout, begin, std::min(begin + slice_size, _fanout->messages.size())));
+			}
+		}
+	}
+
+	void server::cipher_fanout(boost::shared_ptr<fanout> _fanout, size_t begin, size_t end)
+	{
+		// This runs on a send worker: it must only touch its own slice of the messages.
+		const data_store::array_data_type& data = *_fanout->data;
+		const uint8_t* const cleartext = data.empty() ? NULL : &data[0];
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			fanout_message& message = _fanout->messages[i];
+
+			try
+			{
+				message.buffer.resize(data.size() + DATA_MESSAGE_OVERHEAD);
+
+				if (message.authenticated_only)
+				{
+					message.buffer.resize(data_message::write_authenticated(&message.buffer[0], message.buffer.size(), _fanout->channel_number, message.sequence_number, cleartext, data.size(), *message.session.keys()));
+				}
+				else
+				{
+					message.buffer.resize(data_message::write(&message.buffer[0], message.buffer.size(), _fanout->channel_number, message.sequence_number, cleartext, data.size(), *message.session.keys()));
+				}
+			}
+			catch (std::runtime_error&)
+			{
+				message.buffer.clear();
+			}
+		}
+
+		// The last slice to complete hands the messages over.
+		if (--_fanout->pending_slices == 0)
+		{
+			m_strand.post(boost::bind(&server::handle_ciphered_fanout, this, _fanout));
+		}
+	}
+
+	void server::handle_ciphered_fanout(boost::shared_ptr<fanout> _fanout)
+	{
+		for (std::vector<fanout_message>::const_iterator message = _fanout->messages.begin(); message != _fanout->messages.end(); ++message)
+		{
+			if (!message->buffer.empty())
+			{
+				send_to(asio::buffer(message->buffer), message->target);
+			}
+		}
+	}
+
+	void server::deliver_data_message(const data_message& _data_message, const ep_type& sender, session_pair& session_pair, session_store& session, extended_sequence_number_type sequence_number, uint8_t* cleartext, size_t cnt)
+	{
+		session.accept_sequence_number(sequence_number);
+
+		if (&session == &session_pair.local_session())
+		{
+			if (session_pair.local_session().is_old())
+			{
+				if (!do_send_prepared_session(sender))
+				{
+					do_send_session(sender, session_pair.local_session().session_number() + 1);
+				}
+			}
+			else if ((m_session_pregeneration_threshold > 0) && (session_pair.local_session().lifespan_usage() >= m_session_pregeneration_threshold))
+			{
+				do_prepare_session(sender);
+			}
+		}
+
+		session_pair.keep_alive();
+
+		if ((is_data_message_type(_data_message.type()) || is_authenticated_data_message_type(_data_message.type())) && m_data_message_callback)
+		{
+			const channel_number_type channel_number = to_channel_number(_data_message.type());
+
+			if (m_callback_queue)
+			{
+				// The cleartext buffer is reused as soon as we return: the executor gets a copy.
+				const bool has_room = m_callback_queue->post(
+				                          boost::bind(&call_data_message_callback, m_data_message_callback, sender, channel_number, data_store::make_pointer(boost::asio::buffer(cleartext, cnt))),
+				                          callback_queue::key_type(sender, channel_number)
+				                      );
+
+				// Blocking here would stall the strand, or deadlock it if the executor runs on the same threads.
+				if (!has_room)
+				{
+					m_receive_paused = true;
+				}
+			}
+			else
+			{
+				m_data_message_callback(sender, channel_number, boost::asio::buffer(cleartext, cnt));
+			}
+		}
+		else if (_data_message.type() == MESSAGE_TYPE_CONTACT_REQUEST)
+		{
+			const size_t hash_count = data_message::parse_hash_list(cleartext, cnt, m_hash_list_buffer.c_array(), m_hash_list_buffer.size());
+
+			contact_map_type contact_map;
+
+			for (const hash_type* hash_it = m_hash_list_buffer.data(); hash_it != m_hash_list_buffer.data() + hash_count; ++hash_it)
+			{
+				for (presentation_store_map::const_iterator it = m_presentation_map.begin(); it != m_presentation_map.end(); ++it)
+				{
+					if (it->second.signature_certificate_hash() == *hash_it)
+					{
+						if (!m_contact_request_message_callback || m_contact_request_message_callback(sender, it->second.signature_certificate(), it->first))
+						{
+							contact_map[*hash_it] = it->first;
+						}
+					}
+				}
+			}
+
+			if (!contact_map.empty())
+			{
+				do_send_contact(sender, contact_map);
+			}
+		}
+		else if (_data_message.type() == MESSAGE_TYPE_CONTACT)
+		{
+			if (m_contact_message_callback)
+			{
+				contact_map_type contact_map = data_message::parse_contact_map(cleartext, cnt);
+
+				for (contact_map_type::const_iterator contact_it = contact_map.begin(); contact_it != contact_map.end(); ++contact_it)
+				{
+					if (m_hash_to_cert.find(contact_it->first) != m_hash_to_cert.end())
+					{
+						run_callback(boost::bind(m_contact_message_callback, sender, m_hash_to_cert[contact_it->first], contact_it->second));
+					}
+				}
+			}
+		}
+	}
+
+	/* Receive pipeline */
+
+	void server::dispatch_data_message(const data_message& _data_message, const ep_type& sender)
+	{
+		session_pair& session_pair = m_session_map[sender];
+
+		if (session_pair.has_local_session())
+		{
+			// The messages wait for a receive worker, then for the ones received before them: past the limit, they are dropped and the hosts will send them again.
+			if (m_receive_job_count >= m_receive_queue_size)
+			{
+				++m_dropped_receive_count;
+
+				return;
+			}
+
+			boost::shared_ptr<receive_job> job = boost::make_shared<receive_job>();
+			job->session_count = 0;
+
+			// The workers share the keys of the sessions, that never change: the sessions themselves can while the message is being checked.
+			if (accepts_data_message(session_pair.local_session(), _data_message, m_replay_window_size))
+			{
+				job->sessions[job->session_count].keys = session_pair.local_session().keys();
+				job->sessions[job->session_count].sequence_number = session_pair.local_session().extend_sequence_number(_data_message.sequence_number());
+				++job->session_count;
+			}
+
+			if (session_pair.has_previous_local_session() && accepts_data_message(session_pair.previous_local_session(), _data_message, m_replay_window_size))
+			{
+				job->sessions[job->session_count].keys = session_pair.previous_local_session().keys();
+				job->sessions[job->session_count].sequence_number = session_pair.previous_local_session().extend_sequence_number(_data_message.sequence_number());
+				++job->session_count;
+			}
+
+			if (job->session_count == 0)
+			{
+				return;
+			}
+
+			boost::shared_ptr<receive_order>& order = m_receive_order_map[sender];
+
+			if (!order)
+			{
+				order = boost::make_shared<receive_order>();
+			}
+
+			job->sender = sender;
+			job->order = order;
+			job->ticket = order->next_ticket++;
+			job->message.assign(_data_message.data(), _data_message.data() + _data_message.size());
+			job->session_index = job->session_count;
+			job->cleartext_size = 0;
+
+			++m_receive_job_count;
+
+			post_crypto_job(m_receive_workers, m_next_receive_worker, crypto_scheduler::PRIORITY_DATA, boost::bind(&server::check_data_message, this, job));
+		}
+	}
+
+	void server::check_data_message(boost::shared_ptr<receive_job> job)
+	{
+		// This runs on a receive worker: it must not touch the server state.
+		try
+		{
+			const data_message _data_message(&job->message[0], job->message.size());
+
+			// The cleartext is never larger than the message that carries it.
+			job->cleartext.resize(job->message.size());
+
+			for (size_t i = 0; i < job->session_count; ++i)
+			{
+				try
+				{
+					job->cleartext_size = check_seal_and_get_cleartext(_data_message, &job->cleartext[0], job->cleartext.size(), *job->sessions[i].keys, job->sessions[i].sequence_number);
+					job->session_index = i;
+
+					break;
+				}
+				catch (std::runtime_error&)
+				{
+				}
+			}
+		}
+		catch (std::runtime_error&)
+		{
+		}
+
+		m_strand.post(boost::bind(&server::handle_checked_data_message, this, job));
+	}
+
+	void server::handle_checked_data_message(boost::shared_ptr<receive_job> job)
+	{
+		const receive_order_map::iterator order = m_receive_order_map.find(job->sender);
+
+		// The session with the host was lost while the message was being checked.
+		if ((order == m_receive_order_map.end()) || (order->second != job->order))
+		{
+			--m_receive_job_count;
+
+			return;
+		}
+
+		order->second->completed_jobs[job->ticket] = job;
+
+		// The rejected messages still count, or the ones behind them would wait forever.
+		while (!job->order->completed_jobs.empty() && (job->order->completed_jobs.begin()->first == job->order->next_delivery))
+		{
+			const boost::shared_ptr<receive_job> next_job = job->order->completed_jobs.begin()->second;
+
+			job->order->completed_jobs.erase(job->order->completed_jobs.begin());
+			++job->order->next_delivery;
+			--m_receive_job_count;
+
+			if (!m_socket.is_open() || (next_job->session_index == next_job->session_count))
+			{
+				continue;
+			}
+
+			session_pair& session_pair = m_session_map[next_job->sender];
+			const receive_job::candidate_session& checked_session = next_job->sessions[next_job->session_index];
+			session_store* session = NULL;
+
+			// The session may have been renewed or retired in the meantime: a renewed session never shares its keys with the previous one.
+			if (session_pair.has_local_session() && (session_pair.local_session().keys() == checked_session.keys))
+			{
+				session = &session_pair.local_session();
+			}
+			else if (session_pair.has_previous_local_session() && (session_pair.previous_local_session().keys() == checked_session.keys))
+			{
+				session = &session_pair.previous_local_session();
+			}
+
+			// A copy of the message may have been accepted while this one was being checked.
+			if (session && session->can_accept_sequence_number(checked_session.sequence_number, m_replay_window_size))
+			{
+				try
+				{
+					const data_message _data_message(&next_job->message[0], next_job->message.size());
+
+					deliver_data_message(_data_message, next_job->sender, session_pair, *session, checked_session.sequence_number, &next_job->cleartext[0], next_job->cleartext_size);
+				}
+				catch (std::runtime_error&)
+				{
+				}
+			}
+		}
+	}
+
+	bool server::has_crypto_workers(const worker_pool_type& workers) const
+	{
+		return m_crypto_scheduler_client || !workers.empty();
+	}
+
+	size_t server::crypto_worker_count(const worker_pool_type& workers) const
+	{
+		return m_crypto_scheduler_client ? m_crypto_scheduler_client->thread_count() : workers.size();
+	}
+
+	void server::post_crypto_job(worker_pool_type& workers, size_t& next_worker, crypto_scheduler::priority_type priority, background_worker::task_type job)
+	{
+		if (m_crypto_scheduler_client)
+		{
+			m_crypto_scheduler_client->post(priority, job);
+		}
+		else
+		{
+			workers[next_worker++ % workers.size()]->post(job);
+		}
+	}
+
+	bool server::has_session(const hash_type& hash) const
+	{
+		for (session_pair_map::const_iterator session_pair = m_session_map.begin(); session_pair != m_session_map.end(); ++session_pair)
+		{
+			if (session_pair->second.has_remote_session())
+			{
+				presentation_store_map::const_iterator ps = m_presentation_map.find(session_pair->first);
+
+				if (ps != m_presentation_map.end())
+				{
+					if (ps->second.signature_certificate_hash() == hash)
+					{
+						return true;
+					}
+				}
+			}
+		}
+
+		return false;
+	}
+
+	void server::do_request_contact(const ep_type& target, cert_type cert)
+	{
+		const hash_type hash = get_certificate_hash(cert);
+
+		if (!has_session(hash))
+		{
+			m_hash_to_cert[hash] = cert;
+			m_hash_list_map[target].push_back(hash);
+
+			do_send_contact_request(target);
+		}
+	}
+
+	void server::do_request_contact_from_all(cert_type cert)
+	{
+		const hash_type hash = get_certificate_hash(cert);
+
+		if (!has_session(hash))
+		{
+			m_hash_to_cert[hash] = cert;
+
+			for (session_pair_map::const_iterator session_pair = m_session_map.begin(); session_pair != m_session_map.end(); ++session_pair)
+			{
+				if (session_pair->second.has_remote_session())
+				{
+					m_hash_list_map[session_pair->first].push_back(hash);
+
+					do_send_contact_request(session_pair->first);
+				}
+			}
+		}
 	}
 
 	void server::do_send_contact_request(const ep_type& target)
@@ -791,13 +2538,9 @@ namespace fscp
 					size_t size = data_message::write_contact_request(
 					                  m_send_buffer.data(),
 					                  m_send_buffer.size(),
-					                  session_pair.remote_session().session_number(),
 					                  session_pair.remote_session().sequence_number(),
 					                  hash_list,
-					                  session_pair.remote_session().seal_key(),
-					                  session_pair.remote_session().seal_key_size(),
-					                  session_pair.remote_session().encryption_key(),
-					                  session_pair.remote_session().encryption_key_size()
+					                  *session_pair.remote_session().keys()
 					              );
 
 					hash_list.clear();
@@ -821,13 +2564,9 @@ namespace fscp
 				size_t size = data_message::write_contact(
 				                  m_send_buffer.data(),
 				                  m_send_buffer.size(),
-				                  session_pair.remote_session().session_number(),
 				                  session_pair.remote_session().sequence_number(),
 				                  contact_map,
-				                  session_pair.remote_session().seal_key(),
-				                  session_pair.remote_session().seal_key_size(),
-				                  session_pair.remote_session().encryption_key(),
-				                  session_pair.remote_session().encryption_key_size()
+				                  *session_pair.remote_session().keys()
 				              );
 
 				session_pair.remote_session().increment_sequence_number();
@@ -857,7 +2596,7 @@ namespace fscp
 			}
 
 			m_keep_alive_timer.expires_from_now(SESSION_KEEP_ALIVE_PERIOD);
-			m_keep_alive_timer.async_wait(boost::bind(&server::do_check_keep_alive, this, boost::asio::placeholders::error));
+			m_keep_alive_timer.async_wait(m_strand.wrap(boost::bind(&server::do_check_keep_alive, this, boost::asio::placeholders::error)));
 		}
 	}
 
@@ -872,13 +2611,9 @@ namespace fscp
 				size_t size = data_message::write_keep_alive(
 				                  m_send_buffer.data(),
 				                  m_send_buffer.size(),
-				                  session_pair.remote_session().session_number(),
 				                  session_pair.remote_session().sequence_number(),
-				                  session_pair.remote_session().encryption_key_size(), // This is the count of random data to send.
-				                  session_pair.remote_session().seal_key(),
-				                  session_pair.remote_session().seal_key_size(),
-				                  session_pair.remote_session().encryption_key(),
-				                  session_pair.remote_session().encryption_key_size()
+				                  0, // The receivers only check the seal: a single block of padding is enough.
+				                  *session_pair.remote_session().keys()
 				              );
 
 				session_pair.remote_session().increment_sequence_number();
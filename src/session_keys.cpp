@@ -0,0 +1,76 @@
+/*
+ * libfscp - C++ portable OpenSSL cryptographic wrapper library.
+ * Copyright (C) 2010-2011 Julien Kauffmann <julien.kauffmann@freelan.org>
+ *
+ * This file is part of libfscp.
+ *
+ * libfscp is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * libfscp is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * If you intend to use libfscp in a commercial software, please
+ * contact me : we may arrange this for a small fee or no fee at all,
+ * depending on the nature of your project.
+ */
+
+/**
+ * \file session_keys.cpp
+ * \author Julien Kauffmann <julien.kauffmann@freelan.org>
+ * \brief The keys of a session.
+ */
+
+#include "session_keys.hpp"
+
+#include <openssl/crypto.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace fscp
+{
+	session_keys::session_keys(session_number_type _session_number, const void* _seal_key, size_t _seal_key_len, const void* _enc_key, size_t _enc_key_len) :
+		m_session_number(_session_number)
+	{
+		if (_seal_key_len != m_seal_key.size())
+		{
+			throw std::runtime_error("seal_key_len");
+		}
+
+		if (_enc_key_len != m_enc_key.size())
+		{
+			throw std::runtime_error("enc_key_len");
+		}
+
+		std::memcpy(m_seal_key.c_array(), _seal_key, _seal_key_len);
+		std::memcpy(m_enc_key.c_array(), _enc_key, _enc_key_len);
+	}
+
+	session_keys::~session_keys()
+	{
+		OPENSSL_cleanse(m_seal_key.c_array(), m_seal_key.size());
+		OPENSSL_cleanse(m_enc_key.c_array(), m_enc_key.size());
+	}
+}
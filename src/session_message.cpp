@@ -51,6 +51,7 @@
 #include <cryptoplus/pkey/rsa_key.hpp>
 #include <cassert>
 #include <stdexcept>
+#include <algorithm>
 
 namespace fscp
 {
@@ -149,7 +150,10 @@ namespace fscp
 
 		for (unsigned int packet_index = 0; packet_index < packet_count; ++packet_index)
 		{
-			enc_key.get_rsa_key().public_encrypt(&ciphertext[0 + packet_index * enc_key.size()], enc_key.size(), static_cast<const char*>(cleartext) + packet_index * max_cleartext_len, max_cleartext_len, RSA_PKCS1_OAEP_PADDING);
+			// The last packet only holds what remains of the cleartext.
+			const size_t packet_cleartext_len = std::min(max_cleartext_len, cleartext_len - packet_index * max_cleartext_len);
+
+			enc_key.get_rsa_key().public_encrypt(&ciphertext[0 + packet_index * enc_key.size()], enc_key.size(), static_cast<const char*>(cleartext) + packet_index * max_cleartext_len, packet_cleartext_len, RSA_PKCS1_OAEP_PADDING);
 		}
 
 		cryptoplus::hash::message_digest_context mdctx;
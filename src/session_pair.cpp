@@ -44,7 +44,7 @@
 
 #include "session_pair.hpp"
 
-#include <cryptoplus/random/random.hpp>
+#include "random_pool.hpp"
 
 namespace fscp
 {
@@ -54,7 +54,11 @@ namespace fscp
 		{
 			if ((session_number > local_session().session_number()) || local_session().is_old())
 			{
-				m_local_session = boost::make_optional(session_store(std::max(local_session().session_number() + 1, session_number)));
+				const session_store::session_number_type new_session_number = std::max(local_session().session_number() + 1, session_number);
+
+				retire_local_session();
+
+				m_local_session = boost::make_optional(session_store(new_session_number));
 
 				return true;
 			}
@@ -73,6 +77,18 @@ namespace fscp
 		return false;
 	}
 
+	session_store::session_number_type session_pair::next_local_session_number(session_store::session_number_type session_number) const
+	{
+		return has_local_session() ? std::max(local_session().session_number() + 1, session_number) : session_number;
+	}
+
+	void session_pair::set_local_session(const session_store& session)
+	{
+		retire_local_session();
+
+		m_local_session = session;
+	}
+
 	void session_pair::set_remote_session(const session_store& session)
 	{
 		keep_alive();
@@ -82,8 +98,25 @@ namespace fscp
 
 	const challenge_type& session_pair::generate_local_challenge()
 	{
-		cryptoplus::random::get_random_bytes(m_local_challenge.c_array(), m_local_challenge.size());
+		random_pool::get_random_bytes(m_local_challenge.c_array(), m_local_challenge.size());
 
 		return m_local_challenge;
 	}
+
+	void session_pair::retire_local_session()
+	{
+		if (has_local_session())
+		{
+			m_previous_local_session = m_local_session;
+			m_previous_local_session_end = boost::posix_time::microsec_clock::local_time() + SESSION_GRACE_PERIOD;
+		}
+	}
+
+	const ecdhe::ephemeral_key& session_pair::generate_local_ephemeral_key(session_store::session_number_type session_number)
+	{
+		m_local_ephemeral_key = ecdhe::ephemeral_key();
+		m_local_ephemeral_key_session_number = session_number;
+
+		return *m_local_ephemeral_key;
+	}
 }
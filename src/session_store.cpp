@@ -44,40 +44,133 @@
 
 #include "session_store.hpp"
 
-#include <cryptoplus/random/random.hpp>
+#include "random_pool.hpp"
 
-#include <cstring>
+#include <boost/make_shared.hpp>
+
+#include <openssl/crypto.h>
+
+#include <algorithm>
+#include <cassert>
 
 namespace fscp
 {
+	namespace
+	{
+		const sequence_number_type OLD_SEQUENCE_NUMBER = static_cast<sequence_number_type>(1) << (sizeof(sequence_number_type) * 8 - 1);
+		const extended_sequence_number_type EXTENDED_OLD_SEQUENCE_NUMBER = static_cast<extended_sequence_number_type>(1) << (sizeof(extended_sequence_number_type) * 8 - 1);
+	}
+
 	session_store::session_store(session_number_type _session_number) :
-		m_session_number(_session_number),
-		m_sequence_number(0)
+		m_sequence_number(0),
+		m_authenticated_channels(0),
+		m_extended_sequence_numbers(false),
+		m_creation_date(boost::posix_time::microsec_clock::universal_time())
 	{
-		cryptoplus::random::get_random_bytes(m_seal_key.data(), m_seal_key.size());
-		cryptoplus::random::get_random_bytes(m_enc_key.data(), m_enc_key.size());
+		m_replay_bitmap.assign(0);
+
+		boost::array<uint8_t, 2 * KEY_LENGTH> key_material;
+
+		random_pool::get_random_bytes(key_material.c_array(), key_material.size());
+
+		m_keys = boost::make_shared<session_keys>(_session_number, key_material.data(), KEY_LENGTH, key_material.data() + KEY_LENGTH, KEY_LENGTH);
+
+		OPENSSL_cleanse(key_material.c_array(), key_material.size());
 	}
 
 	session_store::session_store(session_number_type _session_number, const void* _seal_key, size_t _seal_key_len, const void* _enc_key, size_t _enc_key_len) :
-		m_session_number(_session_number),
-		m_sequence_number(1)
+		m_keys(boost::make_shared<session_keys>(_session_number, _seal_key, _seal_key_len, _enc_key, _enc_key_len)),
+		m_sequence_number(1),
+		m_authenticated_channels(0),
+		m_extended_sequence_numbers(false),
+		m_creation_date(boost::posix_time::microsec_clock::universal_time())
+	{
+		m_replay_bitmap.assign(0);
+	}
+
+	extended_sequence_number_type session_store::extend_sequence_number(sequence_number_type _sequence_number) const
+	{
+		if (!m_extended_sequence_numbers)
+		{
+			return _sequence_number;
+		}
+
+		// Of the three candidates around the current epoch, pick the closest to the current sequence number.
+		const extended_sequence_number_type epoch_size = static_cast<extended_sequence_number_type>(1) << (sizeof(sequence_number_type) * 8);
+		const extended_sequence_number_type candidate = (m_sequence_number & ~(epoch_size - 1)) | _sequence_number;
+
+		if ((candidate > m_sequence_number) && (candidate - m_sequence_number > epoch_size / 2) && (candidate >= epoch_size))
+		{
+			return candidate - epoch_size;
+		}
+
+		if ((candidate < m_sequence_number) && (m_sequence_number - candidate > epoch_size / 2) && (candidate <= static_cast<extended_sequence_number_type>(-1) - epoch_size))
+		{
+			return candidate + epoch_size;
+		}
+
+		return candidate;
+	}
+
+	bool session_store::can_accept_sequence_number(extended_sequence_number_type _sequence_number, size_t replay_window_size) const
 	{
-		if (_seal_key_len != m_seal_key.size())
+		assert(replay_window_size <= MAX_REPLAY_WINDOW_SIZE);
+
+		if (_sequence_number > m_sequence_number)
 		{
-			throw std::runtime_error("seal_key_len");
+			return true;
 		}
 
-		if (_enc_key_len != m_enc_key.size())
+		if (m_sequence_number - _sequence_number >= replay_window_size)
 		{
-			throw std::runtime_error("enc_key_len");
+			return false;
 		}
 
-		std::memcpy(m_seal_key.c_array(), _seal_key, _seal_key_len);
-		std::memcpy(m_enc_key.c_array(), _enc_key, _enc_key_len);
+		const extended_sequence_number_type word = _sequence_number / 32;
+
+		return !(m_replay_bitmap[word % m_replay_bitmap.size()] & (static_cast<uint32_t>(1) << (_sequence_number % 32)));
+	}
+
+	void session_store::accept_sequence_number(extended_sequence_number_type _sequence_number)
+	{
+		const extended_sequence_number_type word = _sequence_number / 32;
+
+		if (_sequence_number > m_sequence_number)
+		{
+			// The words the window slides over are recycled: at most the whole ring needs to be cleared.
+			const extended_sequence_number_type current_word = m_sequence_number / 32;
+			const extended_sequence_number_type cleared_words = std::min<extended_sequence_number_type>(word - current_word, m_replay_bitmap.size());
+
+			for (extended_sequence_number_type i = 1; i <= cleared_words; ++i)
+			{
+				m_replay_bitmap[(current_word + i) % m_replay_bitmap.size()] = 0;
+			}
+
+			m_sequence_number = _sequence_number;
+		}
+
+		m_replay_bitmap[word % m_replay_bitmap.size()] |= (static_cast<uint32_t>(1) << (_sequence_number % 32));
 	}
 
 	bool session_store::is_old() const
 	{
-		return (m_sequence_number > (static_cast<sequence_number_type>(1) << (sizeof(sequence_number_type) * 8 - 1)));
+		if (m_extended_sequence_numbers)
+		{
+			return (lifespan_usage() > 1.0) || (m_sequence_number > EXTENDED_OLD_SEQUENCE_NUMBER);
+		}
+
+		return (m_sequence_number > OLD_SEQUENCE_NUMBER);
+	}
+
+	double session_store::lifespan_usage() const
+	{
+		if (m_extended_sequence_numbers)
+		{
+			const boost::posix_time::time_duration age = boost::posix_time::microsec_clock::universal_time() - m_creation_date;
+
+			return static_cast<double>(age.total_milliseconds()) / EXTENDED_SESSION_LIFESPAN.total_milliseconds();
+		}
+
+		return static_cast<double>(m_sequence_number) / OLD_SEQUENCE_NUMBER;
 	}
 }